@@ -16,7 +16,12 @@
 
 #include "FwmarkClient.h"
 
+#include "FwmarkCommand.h"
+
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -25,6 +30,250 @@ namespace {
 
 const sockaddr_un FWMARK_SERVER_PATH = {AF_UNIX, "/dev/socket/fwmarkd"};
 
+int sendWithFd(int channel, void* data, size_t len, int fd, int flags) {
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(fd))];
+    } cmsgu;
+
+    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+    message.msg_control = cmsgu.cmsg;
+    message.msg_controllen = sizeof(cmsgu.cmsg);
+
+    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+    cmsgh->cmsg_len = CMSG_LEN(sizeof(fd));
+    cmsgh->cmsg_level = SOL_SOCKET;
+    cmsgh->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
+
+    if (TEMP_FAILURE_RETRY(sendmsg(channel, &message, flags)) == -1) {
+        return -errno;
+    }
+    return 0;
+}
+
+// A connection to the fwmark server shared by all the threads of the process, so that marking a
+// socket doesn't cost a socket(), connect() and close() of its own. Any thread that is waiting for
+// a response reads whatever response comes next and hands it to the thread that sent the request.
+class SharedChannel {
+public:
+    // Sends |command| over the channel and waits for the server's answer, which it puts in
+    // |*error|. Returns false if that didn't work out (e.g.: the server doesn't support persistent
+    // connections, or dropped this one), in which case |command| must be sent the old way.
+    static bool transact(const FwmarkCommand& command, int fd, int* error);
+
+private:
+    // How many requests can be waiting for a response at once. Further requests wait for a slot.
+    static const uint32_t MAX_IN_FLIGHT = 16;
+
+    struct Waiter {
+        bool done;
+        int error;
+    };
+
+    // The socket is only closed once no thread uses it anymore, so that a thread that is still
+    // sending or reading can't end up using an unrelated file that reused the descriptor.
+    struct Connection {
+        int socket;
+        unsigned users;  // Including the channel itself, while this is sConnection.
+        uid_t uid;       // The effective UID when it was connected.
+    };
+
+    static void initOnce();
+    static void resetInChild();
+
+    static int openLocked();
+    static void closeLocked();
+    static Connection* acquireLocked();
+    static void releaseLocked(Connection* connection);
+    static void deliverLocked(const FwmarkResponse& response);
+
+    // Held while sending, so that requests go out whole and in the order their slots were taken.
+    static pthread_mutex_t sSendLock;
+    // Guards everything below.
+    static pthread_mutex_t sLock;
+    static pthread_cond_t sCondition;
+
+    static Connection* sConnection;  // NULL if not connected.
+    static bool sUnsupported;  // Set once the server answers in the old format.
+    static bool sReading;      // Whether some thread is blocked reading the next response.
+    static uint32_t sGeneration;  // Incremented every time the channel is closed.
+    static uint32_t sNextRequestId;
+    static Waiter* sWaiters[MAX_IN_FLIGHT];  // Indexed by request ID modulo MAX_IN_FLIGHT.
+};
+
+pthread_mutex_t SharedChannel::sSendLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t SharedChannel::sLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SharedChannel::sCondition = PTHREAD_COND_INITIALIZER;
+SharedChannel::Connection* SharedChannel::sConnection = NULL;
+bool SharedChannel::sUnsupported = false;
+bool SharedChannel::sReading = false;
+uint32_t SharedChannel::sGeneration = 0;
+uint32_t SharedChannel::sNextRequestId = 0;
+SharedChannel::Waiter* SharedChannel::sWaiters[MAX_IN_FLIGHT];
+
+void SharedChannel::initOnce() {
+    pthread_atfork(NULL, NULL, resetInChild);
+}
+
+// The child of a fork() must not share the connection (and thus the responses) with its parent.
+// Only the forking thread survives in the child, so the locks and waiters are simply discarded.
+void SharedChannel::resetInChild() {
+    sSendLock = PTHREAD_MUTEX_INITIALIZER;
+    sLock = PTHREAD_MUTEX_INITIALIZER;
+    sCondition = PTHREAD_COND_INITIALIZER;
+    if (sConnection) {
+        close(sConnection->socket);
+        free(sConnection);
+        sConnection = NULL;
+    }
+    sReading = false;
+    ++sGeneration;
+    memset(sWaiters, 0, sizeof(sWaiters));
+}
+
+int SharedChannel::openLocked() {
+    uid_t uid = geteuid();
+    int channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel == -1) {
+        return -errno;
+    }
+    if (TEMP_FAILURE_RETRY(connect(channel, reinterpret_cast<const sockaddr*>(&FWMARK_SERVER_PATH),
+                                   sizeof(FWMARK_SERVER_PATH))) == -1) {
+        int error = -errno;
+        close(channel);
+        return error;
+    }
+    sConnection = static_cast<Connection*>(malloc(sizeof(Connection)));
+    if (!sConnection) {
+        close(channel);
+        return -ENOMEM;
+    }
+    sConnection->socket = channel;
+    sConnection->users = 1;
+    sConnection->uid = uid;
+    return 0;
+}
+
+// Fails all the requests in flight. The socket is only shut down here, which also wakes up a thread
+// blocked reading from it. The last thread that uses it closes it.
+void SharedChannel::closeLocked() {
+    if (!sConnection) {
+        return;
+    }
+    shutdown(sConnection->socket, SHUT_RDWR);
+    releaseLocked(sConnection);
+    sConnection = NULL;
+    ++sGeneration;
+    memset(sWaiters, 0, sizeof(sWaiters));
+    pthread_cond_broadcast(&sCondition);
+}
+
+SharedChannel::Connection* SharedChannel::acquireLocked() {
+    ++sConnection->users;
+    return sConnection;
+}
+
+void SharedChannel::releaseLocked(Connection* connection) {
+    if (--connection->users == 0) {
+        close(connection->socket);
+        free(connection);
+    }
+}
+
+void SharedChannel::deliverLocked(const FwmarkResponse& response) {
+    Waiter*& waiter = sWaiters[response.requestId % MAX_IN_FLIGHT];
+    if (!waiter) {
+        // Not a response to anything we sent. The channel is out of sync, so give up on it.
+        closeLocked();
+        return;
+    }
+    waiter->done = true;
+    waiter->error = response.error;
+    waiter = NULL;
+    pthread_cond_broadcast(&sCondition);
+}
+
+bool SharedChannel::transact(const FwmarkCommand& command, int fd, int* error) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, initOnce);
+
+    Waiter waiter = {false, 0};
+    FwmarkRequest request;
+    request.magic = FWMARK_REQUEST_MAGIC;
+    request.command = command;
+
+    pthread_mutex_lock(&sSendLock);
+    pthread_mutex_lock(&sLock);
+    while (!sUnsupported && sWaiters[sNextRequestId % MAX_IN_FLIGHT]) {
+        pthread_cond_wait(&sCondition, &sLock);
+    }
+    // The server authorizes commands with the credentials the connection was made with. After a
+    // setuid() or the like, commands must go over a connection made with the new ones.
+    if (sConnection && sConnection->uid != geteuid()) {
+        closeLocked();
+    }
+    if (sUnsupported || (!sConnection && openLocked())) {
+        pthread_mutex_unlock(&sLock);
+        pthread_mutex_unlock(&sSendLock);
+        return false;
+    }
+    request.requestId = sNextRequestId++;
+    sWaiters[request.requestId % MAX_IN_FLIGHT] = &waiter;
+    uint32_t generation = sGeneration;
+    Connection* connection = acquireLocked();
+    pthread_mutex_unlock(&sLock);
+
+    // MSG_NOSIGNAL, since the server may have dropped the connection since our last request.
+    int ret = sendWithFd(connection->socket, &request, sizeof(request), fd, MSG_NOSIGNAL);
+    pthread_mutex_unlock(&sSendLock);
+
+    pthread_mutex_lock(&sLock);
+    if (ret && generation == sGeneration) {
+        closeLocked();
+    }
+    while (!waiter.done && generation == sGeneration) {
+        if (sReading) {
+            pthread_cond_wait(&sCondition, &sLock);
+            continue;
+        }
+        sReading = true;
+        pthread_mutex_unlock(&sLock);
+        FwmarkResponse response;
+        ssize_t length = TEMP_FAILURE_RETRY(recv(connection->socket, &response, sizeof(response),
+                                                 MSG_WAITALL));
+        pthread_mutex_lock(&sLock);
+        sReading = false;
+        if (generation != sGeneration) {
+            // Closed by another thread while we were reading.
+        } else if (length == sizeof(response)) {
+            deliverLocked(response);
+        } else {
+            // A server that predates FwmarkRequests answers with a bare int and hangs up.
+            if (length == sizeof(int)) {
+                sUnsupported = true;
+            }
+            closeLocked();
+        }
+        pthread_cond_broadcast(&sCondition);
+    }
+    bool done = waiter.done;
+    releaseLocked(connection);
+    pthread_mutex_unlock(&sLock);
+
+    *error = waiter.error;
+    return done;
+}
+
 }  // namespace
 
 bool FwmarkClient::shouldSetFwmark(int family) {
@@ -41,6 +290,15 @@ FwmarkClient::~FwmarkClient() {
 }
 
 int FwmarkClient::send(void* data, size_t len, int fd) {
+    if (len == sizeof(FwmarkCommand)) {
+        // If the command was lost along with the shared channel, it's safe to send it again: all
+        // commands just set the mark of |fd|, so repeating one makes no difference.
+        int error;
+        if (SharedChannel::transact(*static_cast<FwmarkCommand*>(data), fd, &error)) {
+            return error;
+        }
+    }
+
     mChannel = socket(AF_UNIX, SOCK_STREAM, 0);
     if (mChannel == -1) {
         return -errno;
@@ -53,32 +311,8 @@ int FwmarkClient::send(void* data, size_t len, int fd) {
         return 0;
     }
 
-    iovec iov;
-    iov.iov_base = data;
-    iov.iov_len = len;
-
-    msghdr message;
-    memset(&message, 0, sizeof(message));
-    message.msg_iov = &iov;
-    message.msg_iovlen = 1;
-
-    union {
-        cmsghdr cmh;
-        char cmsg[CMSG_SPACE(sizeof(fd))];
-    } cmsgu;
-
-    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
-    message.msg_control = cmsgu.cmsg;
-    message.msg_controllen = sizeof(cmsgu.cmsg);
-
-    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
-    cmsgh->cmsg_len = CMSG_LEN(sizeof(fd));
-    cmsgh->cmsg_level = SOL_SOCKET;
-    cmsgh->cmsg_type = SCM_RIGHTS;
-    memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
-
-    if (TEMP_FAILURE_RETRY(sendmsg(mChannel, &message, 0)) == -1) {
-        return -errno;
+    if (int ret = sendWithFd(mChannel, data, len, fd, 0)) {
+        return ret;
     }
 
     int error = 0;
@@ -29,6 +29,8 @@ public:
     ~FwmarkClient();
 
     // Sends |data| to the fwmark server, along with |fd| as ancillary data using cmsg(3).
+    // FwmarkCommands go over a connection shared by the whole process when the server supports
+    // it, and over a connection of their own otherwise.
     // Returns 0 on success or a negative errno value on failure.
     int send(void* data, size_t len, int fd);
 
@@ -17,6 +17,7 @@
 #ifndef NETD_INCLUDE_FWMARK_COMMAND_H
 #define NETD_INCLUDE_FWMARK_COMMAND_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
 // Commands sent from clients to the fwmark server to mark sockets (i.e., set their SO_MARK).
@@ -32,4 +33,29 @@ struct FwmarkCommand {
     uid_t uid;  // used only in the SELECT_FOR_USER command; ignored otherwise.
 };
 
+// A client that sends a bare FwmarkCommand gets a single int (0 or a negative errno value) back,
+// and the server then closes the connection. A client that wants to keep its connection open and
+// have several commands in flight at once sends FwmarkRequests instead. The server answers each
+// with a FwmarkResponse carrying the same |requestId|, and leaves the connection open as long as
+// the client keeps reading its responses.
+//
+// A server that only knows bare commands reads the first words of a FwmarkRequest as a
+// FwmarkCommand. |magic| is where it expects the |cmdId|, and is deliberately not a valid one, so
+// such a server fails the request with -EPROTO before it touches the socket's mark.
+static const uint32_t FWMARK_REQUEST_MAGIC = 0x666d7632;  // "fmv2"
+
+struct FwmarkRequest {
+    uint32_t magic;  // FWMARK_REQUEST_MAGIC.
+    uint32_t requestId;
+    FwmarkCommand command;
+};
+
+struct FwmarkResponse {
+    uint32_t requestId;
+    int32_t error;  // 0 or a negative errno value.
+};
+
+static_assert(sizeof(FwmarkRequest) != sizeof(FwmarkCommand),
+              "The fwmark server tells requests from bare commands by their size");
+
 #endif  // NETD_INCLUDE_FWMARK_COMMAND_H
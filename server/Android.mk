@@ -48,6 +48,9 @@ LOCAL_SRC_FILES := \
         FwmarkServer.cpp \
         IdletimerController.cpp \
         InterfaceController.cpp \
+        InterfaceRegistry.cpp \
+        IptablesCounterReader.cpp \
+        IptablesRestoreController.cpp \
         LocalNetwork.cpp \
         MDnsSdListener.cpp \
         NatController.cpp \
@@ -59,8 +62,11 @@ LOCAL_SRC_FILES := \
         NetworkController.cpp \
         PhysicalNetwork.cpp \
         PppController.cpp \
+        QuotaRegistry.cpp \
         ResolverController.cpp \
         RouteController.cpp \
+        RuleTransaction.cpp \
+        ShadowRuleStore.cpp \
         SoftapController.cpp \
         TetherController.cpp \
         UidRanges.cpp \
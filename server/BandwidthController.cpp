@@ -44,16 +44,18 @@
 #define LOG_TAG "BandwidthController"
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <logwrap/logwrap.h>
 
 #include "NetdConstants.h"
 #include "BandwidthController.h"
+#include "InterfaceRegistry.h"
+#include "IptablesCounterReader.h"
 #include "NatController.h"  /* For LOCAL_TETHER_COUNTERS_CHAIN */
 #include "ResponseCode.h"
+#include "RuleTransaction.h"
+#include "ShadowRuleStore.h"
 
 /* Alphabetical */
 #define ALERT_IPT_TEMPLATE "%s %s -m quota2 ! --quota %" PRId64" --name %s"
-#define MAX_EXPECTED_ARGS 5
 const char BandwidthController::ALERT_GLOBAL_NAME[] = "globalAlert";
 const char* BandwidthController::LOCAL_INPUT = "bw_INPUT";
 const char* BandwidthController::LOCAL_FORWARD = "bw_FORWARD";
@@ -63,7 +65,6 @@ const char* BandwidthController::LOCAL_MANGLE_POSTROUTING = "bw_mangle_POSTROUTI
 const int  BandwidthController::MAX_CMD_ARGS = 32;
 const int  BandwidthController::MAX_CMD_LEN = 1024;
 const int  BandwidthController::MAX_IFACENAME_LEN = 64;
-const int  BandwidthController::MAX_IPT_OUTPUT_LINE_LEN = 256;
 
 /**
  * Some comments about the rules:
@@ -104,12 +105,18 @@ const int  BandwidthController::MAX_IPT_OUTPUT_LINE_LEN = 256;
  *   E.g  Adding an app, it has to preserve the appened bw_happy_box, so "-I":
  *    iptables -I bw_penalty_box -m owner --uid-owner app_3 \
  *        --jump REJECT --reject-with icmp-port-unreachable
+ *  - consecutive uids share a single rule, so that the chain stays short
+ *    even with thousands of apps. E.g. adding app_4 when app_3 and app_5
+ *    are already there replaces their rules with:
+ *    iptables -I bw_penalty_box -m owner --uid-owner app_3-app_5 \
+ *        --jump REJECT --reject-with icmp-port-unreachable
  *
  * * bw_happy_box handling:
  *  - The bw_happy_box goes at the end of the penalty box.
  *   E.g  Adding a happy app,
  *    iptables -I bw_happy_box -m owner --uid-owner app_3 \
  *        --jump RETURN
+ *  - consecutive uids share a single rule, like in the bw_penalty_box.
  */
 const char *BandwidthController::IPT_FLUSH_COMMANDS[] = {
     /*
@@ -160,8 +167,7 @@ int BandwidthController::runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling
     int res = 0;
 
     ALOGV("runIpxtablesCmd(cmd=%s)", cmd);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV4, failureHandling);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV6, failureHandling);
+    res |= runIptablesCmd(cmd, jumpHandling, IptIpV4V6, failureHandling);
     return res;
 }
 
@@ -180,7 +186,7 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
     char *next = buffer;
     char *tmp;
     int res;
-    int status = 0;
+    IptablesTarget target;
 
     std::string fullCmd = cmd;
 
@@ -200,9 +206,6 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
         break;
     }
 
-    fullCmd.insert(0, " ");
-    fullCmd.insert(0, iptVer == IptIpV4 ? IPTABLES_PATH : IP6TABLES_PATH);
-
     if (StrncpyAndCheck(buffer, fullCmd.c_str(), sizeof(buffer))) {
         ALOGE("iptables command too long");
         return -1;
@@ -218,12 +221,20 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
     }
 
     argv[argc] = NULL;
-    res = android_fork_execvp(argc, (char **)argv, &status, false,
-            failureHandling == IptFailShow);
-    res = res || !WIFEXITED(status) || WEXITSTATUS(status);
+    switch (iptVer) {
+    case IptIpV4:
+        target = V4;
+        break;
+    case IptIpV6:
+        target = V6;
+        break;
+    default:
+        target = V4V6;
+        break;
+    }
+    res = execIptablesArgv(target, failureHandling != IptFailShow, argc, argv);
     if (res && failureHandling == IptFailShow) {
-      ALOGE("runIptablesCmd(): res=%d status=%d failed %s", res, status,
-            fullCmd.c_str());
+      ALOGE("runIptablesCmd(): res=%d failed %s", res, fullCmd.c_str());
     }
     return res;
 }
@@ -246,34 +257,75 @@ int BandwidthController::setupIptablesHooks(void) {
 
     /* flush+clean is allowed to fail */
     flushCleanTables(true);
-    runCommands(sizeof(IPT_SETUP_COMMANDS) / sizeof(char*),
-            IPT_SETUP_COMMANDS, RunCmdFailureBad);
+    runCommandsAtomically(sizeof(IPT_SETUP_COMMANDS) / sizeof(char*), IPT_SETUP_COMMANDS);
 
     return 0;
 }
 
-int BandwidthController::enableBandwidthControl(bool force) {
-    int res;
-    char value[PROPERTY_VALUE_MAX];
+void BandwidthController::addIptablesHooks(IptablesTarget family, RuleTransaction *transaction) {
+    /*
+     * The top-level chains were just recreated, so only chains left over from
+     * a previous run still need to go. They can still refer to each other, so
+     * flush all of them before removing any.
+     */
+    const char *prefixes[] = { "bw_costly_", "bw_penalty_box", "bw_happy_box" };
+    std::vector<std::string> leftovers;
+    for (size_t i = 0; i < ARRAY_SIZE(prefixes); i++) {
+        std::vector<std::string> chains = ShadowRuleStore::listChains(family, "filter",
+                                                                      prefixes[i]);
+        leftovers.insert(leftovers.end(), chains.begin(), chains.end());
+    }
+    for (size_t i = 0; i < leftovers.size(); i++) {
+        transaction->add(("-w -F " + leftovers[i]).c_str());
+    }
+    for (size_t i = 0; i < leftovers.size(); i++) {
+        transaction->add(("-w -X " + leftovers[i]).c_str());
+    }
 
-    if (!force) {
-            property_get("persist.bandwidth.enable", value, "1");
-            if (!strcmp(value, "0"))
-                    return 0;
+    for (size_t i = 0; i < ARRAY_SIZE(IPT_SETUP_COMMANDS); i++) {
+        transaction->add(IPT_SETUP_COMMANDS[i]);
     }
+    if (isEnabledByDefault()) {
+        for (size_t i = 0; i < ARRAY_SIZE(IPT_BASIC_ACCOUNTING_COMMANDS); i++) {
+            transaction->add(IPT_BASIC_ACCOUNTING_COMMANDS[i]);
+        }
+    }
+}
 
-    /* Let's pretend we started from scratch ... */
+void BandwidthController::finishIptablesHooks(void) {
+    resetState();
+}
+
+void BandwidthController::resetState(void) {
     sharedQuotaIfaces.clear();
     quotaIfaces.clear();
     naughtyAppUids.clear();
     niceAppUids.clear();
+    quotaRegistry.clear();
     globalAlertBytes = 0;
     globalAlertTetherCount = 0;
     sharedQuotaBytes = sharedAlertBytes = 0;
+}
+
+bool BandwidthController::isEnabledByDefault(void) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("persist.bandwidth.enable", value, "1");
+    return strcmp(value, "0") != 0;
+}
+
+int BandwidthController::enableBandwidthControl(bool force) {
+    int res;
+
+    if (!force && !isEnabledByDefault()) {
+        return 0;
+    }
+
+    /* Let's pretend we started from scratch ... */
+    resetState();
 
     flushCleanTables(false);
-    res = runCommands(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
-            IPT_BASIC_ACCOUNTING_COMMANDS, RunCmdFailureBad);
+    res = runCommandsAtomically(sizeof(IPT_BASIC_ACCOUNTING_COMMANDS) / sizeof(char*),
+            IPT_BASIC_ACCOUNTING_COMMANDS);
 
     return res;
 
@@ -282,6 +334,7 @@ int BandwidthController::enableBandwidthControl(bool force) {
 int BandwidthController::disableBandwidthControl(void) {
 
     flushCleanTables(false);
+    quotaRegistry.clear();
     return 0;
 }
 
@@ -301,7 +354,32 @@ int BandwidthController::runCommands(int numCommands, const char *commands[],
     return 0;
 }
 
-std::string BandwidthController::makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain) {
+int BandwidthController::runCommandsAtomically(int numCommands, const char *commands[]) {
+    RuleTransaction transaction(V4V6);
+
+    ALOGV("runCommandsAtomically(): %d commands", numCommands);
+    for (int cmdNum = 0; cmdNum < numCommands; cmdNum++) {
+        transaction.add(commands[cmdNum]);
+    }
+    return transaction.commit();
+}
+
+void BandwidthController::getUidRanges(const std::set<int> &uids,
+                                       std::set<std::pair<int, int> > &ranges) {
+    std::set<int>::const_iterator it = uids.begin();
+    while (it != uids.end()) {
+        int first = *it;
+        int last = first;
+        for (++it; it != uids.end() && *it == last + 1; ++it) {
+            last = *it;
+        }
+        ranges.insert(std::make_pair(first, last));
+    }
+}
+
+std::string BandwidthController::makeIptablesSpecialAppCmd(IptOp op,
+                                                           const std::pair<int, int> &uidRange,
+                                                           const char *chain) {
     std::string res;
     char *buff;
     const char *opFlag;
@@ -323,7 +401,12 @@ std::string BandwidthController::makeIptablesSpecialAppCmd(IptOp op, int uid, co
         opFlag = "-D";
         break;
     }
-    asprintf(&buff, "%s %s -m owner --uid-owner %d", opFlag, chain, uid);
+    if (uidRange.first == uidRange.second) {
+        asprintf(&buff, "%s %s -m owner --uid-owner %d", opFlag, chain, uidRange.first);
+    } else {
+        asprintf(&buff, "%s %s -m owner --uid-owner %d-%d", opFlag, chain, uidRange.first,
+                 uidRange.second);
+    }
     res = buff;
     free(buff);
     return res;
@@ -376,102 +459,116 @@ int BandwidthController::disableHappyBox(void) {
     return 0;
 }
 
-int BandwidthController::addNaughtyApps(int numUids, char *appUids[]) {
-    return manipulateNaughtyApps(numUids, appUids, SpecialAppOpAdd);
+int BandwidthController::addNaughtyApps(int numUids, char *appUids[],
+                                        std::vector<int> &unchangedUids) {
+    return manipulateNaughtyApps(numUids, appUids, SpecialAppOpAdd, unchangedUids);
 }
 
-int BandwidthController::removeNaughtyApps(int numUids, char *appUids[]) {
-    return manipulateNaughtyApps(numUids, appUids, SpecialAppOpRemove);
+int BandwidthController::removeNaughtyApps(int numUids, char *appUids[],
+                                        std::vector<int> &unchangedUids) {
+    return manipulateNaughtyApps(numUids, appUids, SpecialAppOpRemove, unchangedUids);
 }
 
-int BandwidthController::addNiceApps(int numUids, char *appUids[]) {
-    return manipulateNiceApps(numUids, appUids, SpecialAppOpAdd);
+int BandwidthController::addNiceApps(int numUids, char *appUids[],
+                                        std::vector<int> &unchangedUids) {
+    return manipulateNiceApps(numUids, appUids, SpecialAppOpAdd, unchangedUids);
 }
 
-int BandwidthController::removeNiceApps(int numUids, char *appUids[]) {
-    return manipulateNiceApps(numUids, appUids, SpecialAppOpRemove);
+int BandwidthController::removeNiceApps(int numUids, char *appUids[],
+                                        std::vector<int> &unchangedUids) {
+    return manipulateNiceApps(numUids, appUids, SpecialAppOpRemove, unchangedUids);
 }
 
-int BandwidthController::manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_penalty_box", naughtyAppUids, IptJumpReject, appOp);
+int BandwidthController::manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp,
+                                               std::vector<int> &unchangedUids) {
+    return manipulateSpecialApps(numUids, appStrUids, "bw_penalty_box", naughtyAppUids, IptJumpReject, appOp,
+                                 unchangedUids);
 }
 
-int BandwidthController::manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_happy_box", niceAppUids, IptJumpReturn, appOp);
+int BandwidthController::manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp,
+                                            std::vector<int> &unchangedUids) {
+    return manipulateSpecialApps(numUids, appStrUids, "bw_happy_box", niceAppUids, IptJumpReturn, appOp,
+                                 unchangedUids);
 }
 
 
 int BandwidthController::manipulateSpecialApps(int numUids, char *appStrUids[],
                                                const char *chain,
-                                               std::list<int /*appUid*/> &specialAppUids,
-                                               IptJumpOp jumpHandling, SpecialAppOp appOp) {
+                                               std::set<int /*appUid*/> &specialAppUids,
+                                               IptJumpOp jumpHandling, SpecialAppOp appOp,
+                                               std::vector<int> &unchangedUids) {
 
     int uidNum;
     const char *failLogTemplate;
-    IptOp op;
-    int appUids[numUids];
+    const char *jump;
+    std::set<int /*uid*/> newAppUids(specialAppUids);
+    std::set<std::pair<int, int> > oldRanges, newRanges;
+    std::set<std::pair<int, int> >::iterator it;
     std::string iptCmd;
-    std::list<int /*uid*/>::iterator it;
+    RuleTransaction transaction(V4V6);
 
     switch (appOp) {
     case SpecialAppOpAdd:
-        op = IptOpInsert;
         failLogTemplate = "Failed to add app uid %s(%d) to %s.";
         break;
     case SpecialAppOpRemove:
-        op = IptOpDelete;
         failLogTemplate = "Failed to delete app uid %s(%d) from %s box.";
         break;
     default:
         ALOGE("Unexpected app Op %d", appOp);
         return -1;
     }
+    jump = (jumpHandling == IptJumpReject) ? " --jump REJECT" : " --jump RETURN";
 
     for (uidNum = 0; uidNum < numUids; uidNum++) {
         char *end;
-        appUids[uidNum] = strtoul(appStrUids[uidNum], &end, 0);
+        int uid = strtoul(appStrUids[uidNum], &end, 0);
         if (*end || !*appStrUids[uidNum]) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], appUids[uidNum], chain);
-            goto fail_parse;
-        }
-    }
-
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        int uid = appUids[uidNum];
-        for (it = specialAppUids.begin(); it != specialAppUids.end(); it++) {
-            if (*it == uid)
-                break;
+            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
+            return -1;
         }
-        bool found = (it != specialAppUids.end());
 
+        bool changed;
         if (appOp == SpecialAppOpRemove) {
-            if (!found) {
-                ALOGE("No such appUid %d to remove", uid);
-                return -1;
-            }
-            specialAppUids.erase(it);
+            changed = newAppUids.erase(uid);
         } else {
-            if (found) {
-                ALOGE("appUid %d exists already", uid);
-                return -1;
-            }
-            specialAppUids.push_front(uid);
+            changed = newAppUids.insert(uid).second;
         }
+        if (!changed) {
+            unchangedUids.push_back(uid);
+        }
+    }
+    if (!unchangedUids.empty()) {
+        ALOGV("%zu appUids already %s %s", unchangedUids.size(),
+              appOp == SpecialAppOpRemove ? "absent from" : "present in", chain);
+    }
 
-        iptCmd = makeIptablesSpecialAppCmd(op, uid, chain);
-        if (runIpxtablesCmd(iptCmd.c_str(), jumpHandling)) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
-            goto fail_with_uidNum;
+    /*
+     * Only the runs of uids that changed need new rules. The new rules go in
+     * before the stale ones are removed, so no uid is ever let through while
+     * the box is being updated.
+     */
+    getUidRanges(specialAppUids, oldRanges);
+    getUidRanges(newAppUids, newRanges);
+    for (it = newRanges.begin(); it != newRanges.end(); it++) {
+        if (!oldRanges.count(*it)) {
+            iptCmd = makeIptablesSpecialAppCmd(IptOpInsert, *it, chain) + jump;
+            transaction.add(iptCmd.c_str());
+        }
+    }
+    for (it = oldRanges.begin(); it != oldRanges.end(); it++) {
+        if (!newRanges.count(*it)) {
+            iptCmd = makeIptablesSpecialAppCmd(IptOpDelete, *it, chain) + jump;
+            transaction.add(iptCmd.c_str());
         }
     }
-    return 0;
 
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    iptCmd = makeIptablesSpecialAppCmd(IptOpDelete, appUids[uidNum], chain);
-    runIpxtablesCmd(iptCmd.c_str(), jumpHandling);
-fail_parse:
-    return -1;
+    if (transaction.commit()) {
+        ALOGE("Failed to update app uids in %s", chain);
+        return -1;
+    }
+    specialAppUids.swap(newAppUids);
+    return 0;
 }
 
 std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota) {
@@ -635,6 +732,7 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
                 ALOGE("Failed set quota rule");
                 goto fail;
             }
+            quotaRegistry.add(costName);
             sharedQuotaBytes = maxBytes;
         }
         sharedQuotaIfaces.push_front(ifaceName);
@@ -694,6 +792,7 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
         std::string quotaCmd;
         quotaCmd = makeIptablesQuotaCmd(IptOpDelete, costName, sharedQuotaBytes);
         res |= runIpxtablesCmd(quotaCmd.c_str(), IptJumpReject);
+        quotaRegistry.remove(costName);
         sharedQuotaBytes = 0;
         if (sharedAlertBytes) {
             removeSharedAlert();
@@ -751,6 +850,7 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
             goto fail;
         }
 
+        quotaRegistry.add(costName);
         quotaIfaces.push_front(QuotaInfo(ifaceName, maxBytes, 0));
 
     } else {
@@ -779,24 +879,18 @@ int BandwidthController::getInterfaceSharedQuota(int64_t *bytes) {
 }
 
 int BandwidthController::getInterfaceQuota(const char *costName, int64_t *bytes) {
-    FILE *fp;
-    char *fname;
-    int scanRes;
+    int res;
 
     if (!isIfaceName(costName))
         return -1;
 
-    asprintf(&fname, "/proc/net/xt_quota/%s", costName);
-    fp = fopen(fname, "r");
-    free(fname);
-    if (!fp) {
-        ALOGE("Reading quota %s failed (%s)", costName, strerror(errno));
+    res = quotaRegistry.get(costName, bytes);
+    if (res) {
+        ALOGE("Reading quota %s failed (%s)", costName, strerror(-res));
         return -1;
     }
-    scanRes = fscanf(fp, "%" SCNd64, bytes);
-    ALOGV("Read quota res=%d bytes=%" PRId64, scanRes, *bytes);
-    fclose(fp);
-    return scanRes == 1 ? 0 : -1;
+    ALOGV("Read quota bytes=%" PRId64, *bytes);
+    return 0;
 }
 
 int BandwidthController::removeInterfaceQuota(const char *iface) {
@@ -828,6 +922,8 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
 
     /* This also removes the quota command of CostlyIface chain. */
     res |= cleanupCostlyIface(ifn, QuotaUnique);
+    quotaRegistry.remove(ifaceName);
+    quotaRegistry.remove(ifaceName + "Alert");
 
     quotaIfaces.erase(it);
 
@@ -835,26 +931,25 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
 }
 
 int BandwidthController::updateQuota(const char *quotaName, int64_t bytes) {
-    FILE *fp;
-    char *fname;
+    int res;
 
     if (!isIfaceName(quotaName)) {
         ALOGE("updateQuota: Invalid quotaName \"%s\"", quotaName);
         return -1;
     }
 
-    asprintf(&fname, "/proc/net/xt_quota/%s", quotaName);
-    fp = fopen(fname, "w");
-    free(fname);
-    if (!fp) {
-        ALOGE("Updating quota %s failed (%s)", quotaName, strerror(errno));
+    res = quotaRegistry.set(quotaName, bytes);
+    if (res) {
+        ALOGE("Updating quota %s failed (%s)", quotaName, strerror(-res));
         return -1;
     }
-    fprintf(fp, "%" PRId64"\n", bytes);
-    fclose(fp);
     return 0;
 }
 
+void BandwidthController::getQuotaSnapshot(std::vector<std::pair<std::string, int64_t> > &quotas) {
+    quotaRegistry.snapshot(&quotas);
+}
+
 int BandwidthController::runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes) {
     int res = 0;
     const char *opFlag;
@@ -931,6 +1026,7 @@ int BandwidthController::setGlobalAlert(int64_t bytes) {
             ALOGV("setGlobalAlert for %d tether", globalAlertTetherCount);
             res |= runIptablesAlertFwdCmd(IptOpInsert, alertName, bytes);
         }
+        quotaRegistry.add(alertName);
     }
     globalAlertBytes = bytes;
     return res;
@@ -970,6 +1066,7 @@ int BandwidthController::removeGlobalAlert(void) {
     if (globalAlertTetherCount) {
         res |= runIptablesAlertFwdCmd(IptOpDelete, alertName, globalAlertBytes);
     }
+    quotaRegistry.remove(alertName);
     globalAlertBytes = 0;
     return res;
 }
@@ -1084,6 +1181,7 @@ int BandwidthController::setCostlyAlert(const char *costName, int64_t bytes, int
         res |= runIpxtablesCmd(alertQuotaCmd, IptJumpNoAdd);
         free(alertQuotaCmd);
         free(chainName);
+        quotaRegistry.add(alertName);
     }
     *alertBytes = bytes;
     free(alertName);
@@ -1112,6 +1210,7 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
     res |= runIpxtablesCmd(alertQuotaCmd, IptJumpNoAdd);
     free(alertQuotaCmd);
     free(chainName);
+    quotaRegistry.remove(alertName);
 
     *alertBytes = 0;
     free(alertName);
@@ -1120,25 +1219,18 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
 
 
 /* ipv6 tethering stats collection
- * Parse the ptks and bytes out of:
- *   Chain natctrl_tether_counters (4 references)
+ * Uses the pkts and bytes of the natctrl_tether_counters rules, e.g.:
  *       pkts      bytes target   prot opt in     out   source    destination
  *         26     2373 RETURN  all    wlan0  rmnet0  ::/0    ::/0   counter wlan0_rmnet0: 0 bytes
  *         27     2002 RETURN  all    rmnet0 wlan0   ::/0    ::/0   counter rmnet0_wlan0: 0 bytes
  *       1040   107471 RETURN  all    bt-pan rmnet0  ::/0    ::/0   counter bt-pan_rmnet0:0 bytes
  *       1450  1708806 RETURN  all    rmnet0 bt-pan  ::/0    ::/0   counter rmnet0_bt-pan:0 bytes
  */
-int BandwidthController::parseForwardChainStatsv6(SocketClient *cli, const TetherStats filter,
-                                                  FILE *fp, std::string &extraProcessingInfo) {
-    int res;
-    char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface0[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface1[MAX_IPT_OUTPUT_LINE_LEN];
-    char rest[MAX_IPT_OUTPUT_LINE_LEN];
-
+int BandwidthController::parseForwardChainStatsv6(std::vector<TetherStats> &statsList,
+        const TetherStats filter,
+        const std::vector<IptablesCounterReader::RuleCounters> &rules,
+        std::string &extraProcessingInfo) {
     TetherStats stats;
-    char *buffPtr;
-    int64_t packets, bytes;
 
     bool filterPair = filter.intIface[0] && filter.extIface[0];
 
@@ -1148,18 +1240,15 @@ int BandwidthController::parseForwardChainStatsv6(SocketClient *cli, const Tethe
 
     stats = filter;
 
-    while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
-        /* Clean up, so a failed parse can still print info */
-        iface0[0] = iface1[0] = rest[0] = packets = bytes = 0;
-
-        ALOGV( "  lineBuffer ; %s ",lineBuffer);
-        res = sscanf(buffPtr, "%" PRId64" %" PRId64" RETURN all  %s %s ::%s",
-                &packets, &bytes, iface0, iface1, rest);
-        ALOGE("parse res=%d iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64" rest=<%s>" \
-              "orig line=<%s>", res, iface0, iface1, packets, bytes, rest, buffPtr);
-        extraProcessingInfo += buffPtr;
+    for (size_t i = 0; i < rules.size(); i++) {
+        const char *iface0 = rules[i].inIface.c_str();
+        const char *iface1 = rules[i].outIface.c_str();
+        int64_t packets = rules[i].packets;
+        int64_t bytes = rules[i].bytes;
 
-        if (res != MAX_EXPECTED_ARGS) {
+        ALOGV("rule iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64,
+              iface0, iface1, packets, bytes);
+        if (!iface0[0] || !iface1[0]) {
             continue;
         }
         /*
@@ -1213,48 +1302,36 @@ int BandwidthController::parseForwardChainStatsv6(SocketClient *cli, const Tethe
         if (stats.rxBytes != -1 && stats.txBytes != -1) {
             ALOGV("rx_bytes=%" PRId64" tx_bytes=%" PRId64" filterPair=%d",
                   stats.rxBytes, stats.txBytes, filterPair);
-            /* Send out stats, and prep for the next if needed. */
-            char *msg = stats.getStatsLine();
+            /* Collect stats, and prep for the next if needed. */
+            statsList.push_back(stats);
             if (filterPair) {
-                cli->sendMsg(ResponseCode::TetheringStatsResult, msg, false);
                 return 0;
-            } else {
-                cli->sendMsg(ResponseCode::TetheringStatsListResult, msg, false);
-                stats = filter;
             }
-            free(msg);
+            stats = filter;
         }
     }
     /* Successful if the last stats entry wasn't partial. */
     if ((stats.rxBytes == -1) == (stats.txBytes == -1)) {
-        cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
         return 0;
     }
     return -1;
 }
 
 /*
- * Parse the ptks and bytes out of:
- *   Chain natctrl_tether_counters (4 references)
+ * Uses the pkts and bytes of the natctrl_tether_counters rules, e.g.:
  *       pkts      bytes target     prot opt in     out     source               destination
  *         26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
  *         27     2002 RETURN     all  --  rmnet0 wlan0   0.0.0.0/0            0.0.0.0/0
  *       1040   107471 RETURN     all  --  bt-pan rmnet0  0.0.0.0/0            0.0.0.0/0
  *       1450  1708806 RETURN     all  --  rmnet0 bt-pan  0.0.0.0/0            0.0.0.0/0
  * It results in an error if invoked and no tethering counter rules exist. The constraint
- * helps detect complete parsing failure.
+ * helps detect a missing or unexpectedly laid out chain.
  */
-int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherStats filter,
-                                                FILE *fp, std::string &extraProcessingInfo) {
-    int res;
-    char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface0[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface1[MAX_IPT_OUTPUT_LINE_LEN];
-    char rest[MAX_IPT_OUTPUT_LINE_LEN];
-
+int BandwidthController::parseForwardChainStats(std::vector<TetherStats> &statsList,
+        const TetherStats filter,
+        const std::vector<IptablesCounterReader::RuleCounters> &rules,
+        std::string &extraProcessingInfo) {
     TetherStats stats;
-    char *buffPtr;
-    int64_t packets, bytes;
     int statsFound = 0;
 
     bool filterPair = filter.intIface[0] && filter.extIface[0];
@@ -1265,16 +1342,15 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
 
     stats = filter;
 
-    while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
-        /* Clean up, so a failed parse can still print info */
-        iface0[0] = iface1[0] = rest[0] = packets = bytes = 0;
-        res = sscanf(buffPtr, "%" SCNd64" %" SCNd64" RETURN all -- %s %s 0.%s",
-                &packets, &bytes, iface0, iface1, rest);
-        ALOGV("parse res=%d iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64" rest=<%s> orig line=<%s>", res,
-             iface0, iface1, packets, bytes, rest, buffPtr);
-        extraProcessingInfo += buffPtr;
+    for (size_t i = 0; i < rules.size(); i++) {
+        const char *iface0 = rules[i].inIface.c_str();
+        const char *iface1 = rules[i].outIface.c_str();
+        int64_t packets = rules[i].packets;
+        int64_t bytes = rules[i].bytes;
 
-        if (res != 5) {
+        ALOGV("rule iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64,
+              iface0, iface1, packets, bytes);
+        if (!iface0[0] || !iface1[0]) {
             continue;
         }
         /*
@@ -1321,16 +1397,12 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
         }
         if (stats.rxBytes != -1 && stats.txBytes != -1) {
             ALOGV("rx_bytes=%" PRId64" tx_bytes=%" PRId64" filterPair=%d", stats.rxBytes, stats.txBytes, filterPair);
-            /* Send out stats, and prep for the next if needed. */
-            char *msg = stats.getStatsLine();
+            /* Collect stats, and prep for the next if needed. */
+            statsList.push_back(stats);
             if (filterPair) {
-                cli->sendMsg(ResponseCode::TetheringStatsResult, msg, false);
                 return 0;
-            } else {
-                cli->sendMsg(ResponseCode::TetheringStatsListResult, msg, false);
-                stats = filter;
             }
-            free(msg);
+            stats = filter;
             statsFound++;
         }
     }
@@ -1341,7 +1413,6 @@ int BandwidthController::parseForwardChainStats(SocketClient *cli, const TetherS
         (!statsFound && !filterPair)) {
         return -1;
     }
-    /* Tethering stats list completed will be sent from parseForwardChainStatsv6() */
     return 0;
 }
 
@@ -1352,91 +1423,124 @@ char *BandwidthController::TetherStats::getStatsLine(void) const {
     return msg;
 }
 
-int BandwidthController::getTetherStats(SocketClient *cli, TetherStats &stats, std::string &extraProcessingInfo) {
+void BandwidthController::describeTetherCounters(
+        const std::vector<IptablesCounterReader::RuleCounters> &rules,
+        std::string &extraProcessingInfo) {
+    char *line;
+
+    for (size_t i = 0; i < rules.size(); i++) {
+        asprintf(&line, "%" PRIu64" %" PRIu64" %s %s\n", rules[i].packets, rules[i].bytes,
+                 rules[i].inIface.c_str(), rules[i].outIface.c_str());
+        extraProcessingInfo += line;
+        free(line);
+    }
+}
+
+void BandwidthController::sendTetherStats(SocketClient *cli, const TetherStats &filter,
+                                          const std::vector<TetherStats> &statsList,
+                                          bool binary) {
+    bool filterPair = filter.intIface[0] && filter.extIface[0];
+
+    if (!binary) {
+        for (size_t i = 0; i < statsList.size(); i++) {
+            char *msg = statsList[i].getStatsLine();
+            cli->sendMsg(filterPair ? ResponseCode::TetheringStatsResult :
+                         ResponseCode::TetheringStatsListResult, msg, false);
+            free(msg);
+        }
+        return;
+    }
+
+    /*
+     * Announce the number and size of the records, then send them all at
+     * once. The caller finishes with the usual CommandOkay.
+     */
+    std::vector<TetherStatsRecord> records(statsList.size());
+    for (size_t i = 0; i < statsList.size(); i++) {
+        records[i].intIfaceIdx = InterfaceRegistry::nameToIndex(statsList[i].intIface.c_str());
+        records[i].extIfaceIdx = InterfaceRegistry::nameToIndex(statsList[i].extIface.c_str());
+        records[i].rxBytes = statsList[i].rxBytes;
+        records[i].rxPackets = statsList[i].rxPackets;
+        records[i].txBytes = statsList[i].txBytes;
+        records[i].txPackets = statsList[i].txPackets;
+    }
+    char *msg;
+    asprintf(&msg, "%zu %zu", records.size(), sizeof(TetherStatsRecord));
+    cli->sendMsg(ResponseCode::TetheringStatsBinaryResult, msg, false);
+    free(msg);
+    if (!records.empty()) {
+        cli->sendData(&records[0], records.size() * sizeof(TetherStatsRecord));
+    }
+}
+
+int BandwidthController::getTetherStats(SocketClient *cli, TetherStats &stats, bool binary,
+                                        std::string &extraProcessingInfo) {
     int res, res6;
-    std::string fullCmd, fullCmd6;
-    FILE *iptOutput, *iptOutput6;
+    std::vector<IptablesCounterReader::RuleCounters> rules, rules6;
+    std::vector<TetherStats> statsList;
+    bool filterPair = stats.intIface[0] && stats.extIface[0];
 
     /*
-     * Why not use some kind of lib to talk to iptables?
-     * Because the only libs are libiptc and libip6tc in iptables, and they are
-     * not easy to use. They require the known iptables match modules to be
-     * preloaded/linked, and require apparently a lot of wrapper code to get
-     * the wanted info.
+     * The counters are read straight from the kernel, the same way libiptc does it,
+     * which avoids running iptables and parsing its text output on every poll.
      */
-    fullCmd = IPTABLES_PATH;
-    fullCmd += " -nvx -L ";
-    fullCmd += NatController::LOCAL_TETHER_COUNTERS_CHAIN;
-    iptOutput = popen(fullCmd.c_str(), "r");
-    if (!iptOutput) {
-            ALOGE("Failed to run %s err=%s", fullCmd.c_str(), strerror(errno));
-            extraProcessingInfo += "Failed to run iptables.";
+    res = IptablesCounterReader::readChain(V4, "filter", NatController::LOCAL_TETHER_COUNTERS_CHAIN,
+                                           &rules);
+    if (res) {
+        ALOGE("Failed to read %s: %s", NatController::LOCAL_TETHER_COUNTERS_CHAIN,
+              strerror(-res));
+        extraProcessingInfo += "Failed to read iptables counters.";
         return -1;
     }
 
-    ALOGV("  getTetherStats  iptOutput  %s ", fullCmd.c_str());
-    res = parseForwardChainStats(cli, stats, iptOutput, extraProcessingInfo);
-    pclose(iptOutput);
+    res = parseForwardChainStats(statsList, stats, rules, extraProcessingInfo);
+    if (res) {
+        describeTetherCounters(rules, extraProcessingInfo);
+    }
 
-    fullCmd6 = IP6TABLES_PATH;
-    fullCmd6 += " -nvx -L ";
-    fullCmd6 += NatController::LOCAL_TETHER_COUNTERS_CHAIN;
-    iptOutput6 = popen(fullCmd6.c_str(), "r");
-    if (!iptOutput6) {
-            ALOGE("Failed to run %s err=%s", fullCmd6.c_str(), strerror(errno));
-            extraProcessingInfo += "Failed to run ip6tables.";
-            return res;
+    res6 = IptablesCounterReader::readChain(V6, "filter",
+                                            NatController::LOCAL_TETHER_COUNTERS_CHAIN, &rules6);
+    if (res6 && res6 != -ENOENT) {
+        ALOGE("Failed to read ip6 %s: %s", NatController::LOCAL_TETHER_COUNTERS_CHAIN,
+              strerror(-res6));
+        extraProcessingInfo += "Failed to read ip6tables counters.";
+        sendTetherStats(cli, stats, statsList, binary);
+        return res;
     }
 
-    ALOGV("  getTetherStats  iptOutput6  %s ", fullCmd6.c_str());
-    res6 = parseForwardChainStatsv6(cli, stats, iptOutput6, extraProcessingInfo);
-    pclose(iptOutput6);
+    size_t found = statsList.size();
+    res6 = parseForwardChainStatsv6(statsList, stats, rules6, extraProcessingInfo);
+    if (res6) {
+        describeTetherCounters(rules6, extraProcessingInfo);
+    }
+
+    sendTetherStats(cli, stats, statsList, binary);
+    /* A filtered pair found in the ip6 counters is the final answer by itself. */
+    if (!res6 && !(filterPair && statsList.size() > found)) {
+        cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
+    }
 
     ALOGV(" ipv4: %d, ipv6 : %d ",res,res6);
     return res + res6;
 }
 
 void BandwidthController::flushExistingCostlyTables(bool doClean) {
-    std::string fullCmd;
-    FILE *iptOutput;
+    char cmd[MAX_CMD_LEN];
 
     /* Only lookup ip4 table names as ip6 will have the same tables ... */
-    fullCmd = IPTABLES_PATH;
-    fullCmd += " -S";
-    iptOutput = popen(fullCmd.c_str(), "r");
-    if (!iptOutput) {
-            ALOGE("Failed to run %s err=%s", fullCmd.c_str(), strerror(errno));
-        return;
-    }
-    /* ... then flush/clean both ip4 and ip6 iptables. */
-    parseAndFlushCostlyTables(iptOutput, doClean);
-    pclose(iptOutput);
-}
+    std::vector<std::string> chains = ShadowRuleStore::listChains(V4, "filter", "bw_costly_");
 
-void BandwidthController::parseAndFlushCostlyTables(FILE *fp, bool doRemove) {
-    int res;
-    char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
-    char costlyIfaceName[MAX_IPT_OUTPUT_LINE_LEN];
-    char cmd[MAX_CMD_LEN];
-    char *buffPtr;
-
-    while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
-        costlyIfaceName[0] = '\0';   /* So that debugging output always works */
-        res = sscanf(buffPtr, "-N bw_costly_%s", costlyIfaceName);
-        ALOGV("parse res=%d costly=<%s> orig line=<%s>", res,
-            costlyIfaceName, buffPtr);
-        if (res != 1) {
-            continue;
-        }
+    /* ... then flush/clean both ip4 and ip6 iptables. */
+    for (size_t i = 0; i < chains.size(); i++) {
         /* Exclusions: "shared" is not an ifacename */
-        if (!strcmp(costlyIfaceName, "shared")) {
+        if (chains[i] == "bw_costly_shared") {
             continue;
         }
 
-        snprintf(cmd, sizeof(cmd), "-F bw_costly_%s", costlyIfaceName);
+        snprintf(cmd, sizeof(cmd), "-F %s", chains[i].c_str());
         runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-        if (doRemove) {
-            snprintf(cmd, sizeof(cmd), "-X bw_costly_%s", costlyIfaceName);
+        if (doClean) {
+            snprintf(cmd, sizeof(cmd), "-X %s", chains[i].c_str());
             runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
         }
     }
@@ -17,11 +17,19 @@
 #define _BANDWIDTH_CONTROLLER_H
 
 #include <list>
+#include <set>
 #include <string>
 #include <utility>  // for pair
+#include <vector>
 
 #include <sysutils/SocketClient.h>
 
+#include "IptablesCounterReader.h"
+#include "NetdConstants.h"
+#include "QuotaRegistry.h"
+
+class RuleTransaction;
+
 class BandwidthController {
 public:
     class TetherStats {
@@ -49,10 +57,31 @@ public:
         char *getStatsLine(void) const;
     };
 
+    /*
+     * Fixed layout of the records sent by getTetherStats() in binary mode.
+     * Interfaces are identified by ifindex, 0 if the interface is gone.
+     */
+    struct TetherStatsRecord {
+        uint32_t intIfaceIdx;
+        uint32_t extIfaceIdx;
+        int64_t rxBytes, rxPackets;
+        int64_t txBytes, txPackets;
+    } __attribute__((packed));
+
     BandwidthController();
 
     int setupIptablesHooks(void);
 
+    /*
+     * For setting up the hooks of all modules at once at boot, instead of
+     * setupIptablesHooks() followed by enableBandwidthControl(false).
+     * addIptablesHooks() queues the rules they would create for |family| on
+     * |transaction|, which must also recreate the bw_ top-level chains empty.
+     * finishIptablesHooks() resets the state once the transaction is committed.
+     */
+    void addIptablesHooks(IptablesTarget family, RuleTransaction *transaction);
+    void finishIptablesHooks(void);
+
     int enableBandwidthControl(bool force);
     int disableBandwidthControl(void);
 
@@ -64,12 +93,21 @@ public:
     int getInterfaceQuota(const char *iface, int64_t *bytes);
     int removeInterfaceQuota(const char *iface);
 
+    /* Reads the remaining bytes of every active quota and alert. */
+    void getQuotaSnapshot(std::vector<std::pair<std::string, int64_t> > &quotas);
+
     int enableHappyBox(void);
     int disableHappyBox(void);
-    int addNaughtyApps(int numUids, char *appUids[]);
-    int removeNaughtyApps(int numUids, char *appUids[]);
-    int addNiceApps(int numUids, char *appUids[]);
-    int removeNiceApps(int numUids, char *appUids[]);
+    /*
+     * These apply the whole batch of uids at once, or nothing if any uid is
+     * invalid or the kernel update fails.
+     * Uids that are already in (for add) or not in (for remove) the box are
+     * skipped and returned in unchangedUids.
+     */
+    int addNaughtyApps(int numUids, char *appUids[], std::vector<int> &unchangedUids);
+    int removeNaughtyApps(int numUids, char *appUids[], std::vector<int> &unchangedUids);
+    int addNiceApps(int numUids, char *appUids[], std::vector<int> &unchangedUids);
+    int removeNiceApps(int numUids, char *appUids[], std::vector<int> &unchangedUids);
 
     int setGlobalAlert(int64_t bytes);
     int removeGlobalAlert(void);
@@ -90,7 +128,13 @@ public:
      * Error is to be handled on the outside.
      * It results in an error if invoked and no tethering counter rules exist.
      */
-    int getTetherStats(SocketClient *cli, TetherStats &stats, std::string &extraProcessingInfo);
+    /*
+     * If binary, the stats are sent as a single packed array of
+     * TetherStatsRecord, announced by a TetheringStatsBinaryResult line with
+     * the number of records and the size of each.
+     */
+    int getTetherStats(SocketClient *cli, TetherStats &stats, bool binary,
+                       std::string &extraProcessingInfo);
 
     static const char* LOCAL_INPUT;
     static const char* LOCAL_FORWARD;
@@ -108,7 +152,7 @@ protected:
         int64_t alert;
     };
 
-    enum IptIpVer { IptIpV4, IptIpV6 };
+    enum IptIpVer { IptIpV4, IptIpV6, IptIpV4V6 };
     enum IptOp { IptOpInsert, IptOpReplace, IptOpDelete, IptOpAppend };
     enum IptJumpOp { IptJumpReject, IptJumpReturn, IptJumpNoAdd };
     enum SpecialAppOp { SpecialAppOpAdd, SpecialAppOpRemove };
@@ -122,15 +166,29 @@ protected:
 
     int manipulateSpecialApps(int numUids, char *appStrUids[],
                                const char *chain,
-                               std::list<int /*appUid*/> &specialAppUids,
-                               IptJumpOp jumpHandling, SpecialAppOp appOp);
-    int manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
-    int manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
+                               std::set<int /*appUid*/> &specialAppUids,
+                               IptJumpOp jumpHandling, SpecialAppOp appOp,
+                               std::vector<int> &unchangedUids);
+    int manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp,
+                              std::vector<int> &unchangedUids);
+    int manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp,
+                           std::vector<int> &unchangedUids);
+
+    /* Forgets all quotas, alerts and special apps. */
+    void resetState(void);
+    /* Whether bandwidth control is enabled unless forced, as set by persist.bandwidth.enable. */
+    static bool isEnabledByDefault(void);
 
     int prepCostlyIface(const char *ifn, QuotaType quotaType);
     int cleanupCostlyIface(const char *ifn, QuotaType quotaType);
 
-    std::string makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain);
+    /*
+     * Collapses the uids into runs of consecutive uids, so that each run can be
+     * matched by a single "--uid-owner first-last" rule.
+     */
+    static void getUidRanges(const std::set<int> &uids, std::set<std::pair<int, int> > &ranges);
+    std::string makeIptablesSpecialAppCmd(IptOp op, const std::pair<int, int> &uidRange,
+                                          const char *chain);
     std::string makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota);
 
     int runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes);
@@ -138,7 +196,14 @@ protected:
 
     /* Runs for both ipv4 and ipv6 iptables */
     int runCommands(int numCommands, const char *commands[], RunCmdErrHandling cmdErrHandling);
-    /* Runs for both ipv4 and ipv6 iptables, appends -j REJECT --reject-with ...  */
+    /*
+     * Runs for both ipv4 and ipv6 iptables, as a single transaction: either all
+     * commands are applied, or none are (see RuleTransaction).
+     */
+    int runCommandsAtomically(int numCommands, const char *commands[]);
+    /*
+     * Runs for both ipv4 and ipv6 iptables, concurrently, appends -j REJECT --reject-with ...
+     */
     static int runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
                                IptFailureLog failureHandling = IptFailShow);
     static int runIptablesCmd(const char *cmd, IptJumpOp jumpHandling, IptIpVer iptIpVer,
@@ -152,19 +217,29 @@ protected:
 
     int setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes);
     int removeCostlyAlert(const char *costName, int64_t *alertBytes);
-    int parseForwardChainStatsv6(SocketClient *cli, const TetherStats filter,
-                                 FILE *fp, std::string &extraProcessingInfo);
+    int parseForwardChainStatsv6(std::vector<TetherStats> &statsList, const TetherStats filter,
+                                 const std::vector<IptablesCounterReader::RuleCounters> &rules,
+                                 std::string &extraProcessingInfo);
     /*
+     * Appends the stats found to statsList.
      * stats should never have only intIface initialized. Other 3 combos are ok.
-     * fp should be a file to the apropriate FORWARD chain of iptables rules.
-     * extraProcessingInfo: contains raw parsed data, and error info.
+     * rules should be the counters of the tethering counters chain, in rule order.
+     * extraProcessingInfo: contains error info.
      * This strongly requires that setup of the rules is in a specific order:
      *  in:intIface out:extIface
      *  in:extIface out:intIface
      * and the rules are grouped in pairs when more that one tethering was setup.
      */
-    static int parseForwardChainStats(SocketClient *cli, const TetherStats filter, FILE *fp,
+    static int parseForwardChainStats(std::vector<TetherStats> &statsList,
+                                      const TetherStats filter,
+                                      const std::vector<IptablesCounterReader::RuleCounters> &rules,
                                       std::string &extraProcessingInfo);
+    static void sendTetherStats(SocketClient *cli, const TetherStats &filter,
+                                const std::vector<TetherStats> &statsList, bool binary);
+    /* Appends a human readable dump of the counters, for error reporting. */
+    static void describeTetherCounters(
+            const std::vector<IptablesCounterReader::RuleCounters> &rules,
+            std::string &extraProcessingInfo);
 
     /*
      * Attempt to find the bw_costly_* tables that need flushing,
@@ -173,7 +248,6 @@ protected:
      * Deals with both ip4 and ip6 tables.
      */
     void flushExistingCostlyTables(bool doClean);
-    static void parseAndFlushCostlyTables(FILE *fp, bool doRemove);
 
     /*
      * Attempt to flush our tables.
@@ -199,8 +273,11 @@ protected:
     int globalAlertTetherCount;
 
     std::list<QuotaInfo> quotaIfaces;
-    std::list<int /*appUid*/> naughtyAppUids;
-    std::list<int /*appUid*/> niceAppUids;
+    std::set<int /*appUid*/> naughtyAppUids;
+    std::set<int /*appUid*/> niceAppUids;
+
+    /* Open /proc/net/xt_quota/ files of the active quotas and alerts. */
+    QuotaRegistry quotaRegistry;
 
 private:
     static const char *IPT_FLUSH_COMMANDS[];
@@ -213,7 +290,6 @@ private:
     static const int  MAX_CMD_ARGS;
     static const int  MAX_CMD_LEN;
     static const int  MAX_IFACENAME_LEN;
-    static const int  MAX_IPT_OUTPUT_LINE_LEN;
 };
 
 #endif
@@ -19,6 +19,7 @@
 
 // #define LOG_NDEBUG 0
 
+#include <ctype.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -27,6 +28,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <linux/if.h>
 #include <resolv_netid.h>
 
@@ -46,9 +48,12 @@
 #include "oem_iptables_hook.h"
 #include "NetdConstants.h"
 #include "FirewallController.h"
+#include "InterfaceRegistry.h"
 #include "RouteController.h"
 #include "UidRanges.h"
 #include "QcRouteController.h"
+#include "RuleTransaction.h"
+#include "ShadowRuleStore.h"
 
 #ifdef QSAP_WLAN
 #include "qsap_api.h"
@@ -87,6 +92,22 @@ unsigned stringToNetId(const char* arg) {
     return strtoul(arg, NULL, 0);
 }
 
+// Parses a number in any base strtoul() understands. Unlike strtoul(), rejects anything that isn't
+// entirely a number (including a sign) and anything outside [min, max].
+bool parseNumber(const char* arg, unsigned long min, unsigned long max, unsigned long* value) {
+    if (!isdigit(arg[0])) {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 0);
+    if (errno || *end || n < min || n > max) {
+        return false;
+    }
+    *value = n;
+    return true;
+}
+
 }  // namespace
 
 NetworkController *CommandListener::sNetCtrl = NULL;
@@ -158,6 +179,76 @@ static const char* NAT_POSTROUTING[] = {
         NULL,
 };
 
+struct ChildChains {
+    IptablesTarget target;
+    const char* table;
+    const char* parentChain;
+    const char** childChains;
+};
+
+static const ChildChains CHILD_CHAINS[] = {
+        { V4V6, "filter", "INPUT", FILTER_INPUT },
+        { V4V6, "filter", "FORWARD", FILTER_FORWARD },
+        { V4V6, "filter", "OUTPUT", FILTER_OUTPUT },
+        { V4V6, "raw", "PREROUTING", RAW_PREROUTING },
+        { V4V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING },
+        { V4, "mangle", "FORWARD", MANGLE_FORWARD },
+        { V4, "nat", "PREROUTING", NAT_PREROUTING },
+        { V4, "nat", "POSTROUTING", NAT_POSTROUTING },
+};
+
+static bool chainExists(IptablesTarget family, const char* table, const char* chain) {
+    std::vector<std::string> chains = ShadowRuleStore::listChains(family, table, chain);
+    for (size_t i = 0; i < chains.size(); i++) {
+        if (chains[i] == chain) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Creates the whole initial skeleton: the same chains as calling
+ * createChildChains() on every entry of CHILD_CHAINS, and the rules that the
+ * setupIptablesHooks() of the modules that have any would then add, as one
+ * iptables-restore run per family instead of dozens of iptables runs per
+ * module. The modules' finishIptablesHooks() must be called afterwards.
+ * Returns false if a transaction failed and was rolled back, e.g. because a
+ * chain left over from a previous run isn't linked from its parent anymore.
+ */
+static bool setupAllIptablesHooks(NatController* natCtrl, BandwidthController* bandwidthCtrl) {
+    for (int family = V4; family <= V6; family++) {
+        RuleTransaction transaction(static_cast<IptablesTarget>(family));
+        for (size_t i = 0; i < ARRAY_SIZE(CHILD_CHAINS); i++) {
+            const ChildChains& entry = CHILD_CHAINS[i];
+            if (entry.target != family && entry.target != V4V6) {
+                continue;
+            }
+            std::string prefix = std::string("-t ") + entry.table + " ";
+            for (const char** childChain = entry.childChains; *childChain; childChain++) {
+                // Only a leftover chain needs to be unlinked and removed first.
+                if (chainExists(static_cast<IptablesTarget>(family), entry.table, *childChain)) {
+                    transaction.add((prefix + "-D " + entry.parentChain + " -j " +
+                                     *childChain).c_str());
+                    transaction.add((prefix + "-F " + *childChain).c_str());
+                    transaction.add((prefix + "-X " + *childChain).c_str());
+                }
+                transaction.add((prefix + "-N " + *childChain).c_str());
+                transaction.add((prefix + "-A " + entry.parentChain + " -j " +
+                                 *childChain).c_str());
+            }
+        }
+        natCtrl->addIptablesHooks(static_cast<IptablesTarget>(family), &transaction);
+        bandwidthCtrl->addIptablesHooks(static_cast<IptablesTarget>(family), &transaction);
+        // On failure, the tables that did go in are rolled back, and the one-by-one fallback
+        // recreates the whole skeleton.
+        if (transaction.commitInOneRestore()) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void createChildChains(IptablesTarget target, const char* table, const char* parentChain,
         const char** childChains) {
     const char** childChain = childChains;
@@ -180,10 +271,10 @@ static void createChildChains(IptablesTarget target, const char* table, const ch
 
 /**
  * Check if string is a valid interface name.
- * Utilize if_nametoindex, on success it returns ifindex, and on error 0.
+ * Utilize InterfaceRegistry::nameToIndex, on success it returns ifindex, and on error 0.
  */
 static bool isValidIface(const char* iface) {
-    return (0 != if_nametoindex(iface));
+    return (0 != InterfaceRegistry::nameToIndex(iface));
 }
 
 /**
@@ -237,6 +328,7 @@ CommandListener::CommandListener() :
     registerCmd(new IdletimerControlCmd());
     registerCmd(new ResolverCmd());
     registerCmd(new FirewallCmd());
+    registerCmd(new IptablesCmd());
     registerCmd(new ClatdCmd());
     registerCmd(new NetworkCommand());
     registerCmd(new QcRouteCmd());
@@ -276,36 +368,54 @@ CommandListener::CommandListener() :
      * otherwise DROP/REJECT.
      */
 
-    // Create chains for children modules
-    createChildChains(V4V6, "filter", "INPUT", FILTER_INPUT);
-    createChildChains(V4V6, "filter", "FORWARD", FILTER_FORWARD);
-    createChildChains(V4V6, "filter", "OUTPUT", FILTER_OUTPUT);
-    createChildChains(V4V6, "raw", "PREROUTING", RAW_PREROUTING);
-    createChildChains(V4V6, "mangle", "POSTROUTING", MANGLE_POSTROUTING);
-    createChildChains(V4, "mangle", "FORWARD", MANGLE_FORWARD);
-    createChildChains(V4, "nat", "PREROUTING", NAT_PREROUTING);
-    createChildChains(V4, "nat", "POSTROUTING", NAT_POSTROUTING);
-
-    // Let each module setup their child chains
+    // This is on the device's time-to-network path, so keep an eye on how long it takes.
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Create chains for children modules, and let each module setup their child chains
+    bool setUpAtOnce = setupAllIptablesHooks(sNatCtrl, sBandwidthCtrl);
+    if (!setUpAtOnce) {
+        ALOGW("Setting up iptables hooks in one go failed, setting them up one by one");
+        for (size_t i = 0; i < ARRAY_SIZE(CHILD_CHAINS); i++) {
+            createChildChains(CHILD_CHAINS[i].target, CHILD_CHAINS[i].table,
+                              CHILD_CHAINS[i].parentChain, CHILD_CHAINS[i].childChains);
+        }
+    }
+
+    // The OEM chains are filled by a script, so this can't be part of the transaction. (Its
+    // flushes of the chains that were just created are answered by ShadowRuleStore.)
     setupOemIptablesHook();
 
     /* When enabled, DROPs all packets except those matching rules. */
     sFirewallCtrl->setupIptablesHooks();
 
     /* Does DROPs in FORWARD by default */
-    sNatCtrl->setupIptablesHooks();
+    if (setUpAtOnce) {
+        sNatCtrl->finishIptablesHooks();
+    } else {
+        sNatCtrl->setupIptablesHooks();
+    }
     /*
      * Does REJECT in INPUT, OUTPUT. Does counting also.
      * No DROP/REJECT allowed later in netfilter-flow hook order.
      */
-    sBandwidthCtrl->setupIptablesHooks();
+    if (setUpAtOnce) {
+        sBandwidthCtrl->finishIptablesHooks();
+    } else {
+        sBandwidthCtrl->setupIptablesHooks();
+        sBandwidthCtrl->enableBandwidthControl(false);
+    }
     /*
      * Counts in nat: PREROUTING, POSTROUTING.
      * No DROP/REJECT allowed later in netfilter-flow hook order.
      */
     sIdletimerCtrl->setupIptablesHooks();
 
-    sBandwidthCtrl->enableBandwidthControl(false);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ALOGI("iptables hooks set up in %lld ms",
+          (long long) (end.tv_sec - start.tv_sec) * 1000 +
+          (end.tv_nsec - start.tv_nsec) / 1000000);
 
     if (int ret = RouteController::Init(NetworkController::LOCAL_NET_ID)) {
         ALOGE("failed to initialize RouteController (%s)", strerror(-ret));
@@ -1002,6 +1112,20 @@ void CommandListener::BandwidthControlCmd::sendGenericOkFail(SocketClient *cli,
     }
 }
 
+void CommandListener::BandwidthControlCmd::sendAppsResult(SocketClient *cli, int cond,
+                                                          const std::vector<int> &unchangedUids) {
+    if (!cond && !unchangedUids.empty()) {
+        std::string msg;
+        char uid[16];
+        for (size_t i = 0; i < unchangedUids.size(); i++) {
+            snprintf(uid, sizeof(uid), i ? " %d" : "%d", unchangedUids[i]);
+            msg += uid;
+        }
+        cli->sendMsg(ResponseCode::BandwidthUnchangedUidsResult, msg.c_str(), false);
+    }
+    sendGenericOkFail(cli, cond);
+}
+
 void CommandListener::BandwidthControlCmd::sendGenericOpFailed(SocketClient *cli, const char *errMsg) {
     cli->sendMsg(ResponseCode::OperationFailed, errMsg, false);
 }
@@ -1073,6 +1197,23 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         free(msg);
         return 0;
 
+    }
+    if (!strcmp(argv[1], "getquotas") || !strcmp(argv[1], "gqs")) {
+        if (argc != 2) {
+            sendGenericSyntaxError(cli, "getquotas");
+            return 0;
+        }
+        std::vector<std::pair<std::string, int64_t> > quotas;
+        sBandwidthCtrl->getQuotaSnapshot(quotas);
+        for (size_t i = 0; i < quotas.size(); i++) {
+            char *msg;
+            asprintf(&msg, "%s %" PRId64, quotas[i].first.c_str(), quotas[i].second);
+            cli->sendMsg(ResponseCode::QuotaListResult, msg, false);
+            free(msg);
+        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Quotas listed", false);
+        return 0;
+
     }
     if (!strcmp(argv[1], "setquota") || !strcmp(argv[1], "sq")) {
         if (argc != 4) {
@@ -1152,8 +1293,9 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
             sendGenericSyntaxError(cli, "addnaughtyapps <appUid> ...");
             return 0;
         }
-        int rc = sBandwidthCtrl->addNaughtyApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
+        std::vector<int> unchangedUids;
+        int rc = sBandwidthCtrl->addNaughtyApps(argc - 2, argv + 2, unchangedUids);
+        sendAppsResult(cli, rc, unchangedUids);
         return 0;
 
 
@@ -1163,8 +1305,9 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
             sendGenericSyntaxError(cli, "removenaughtyapps <appUid> ...");
             return 0;
         }
-        int rc = sBandwidthCtrl->removeNaughtyApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
+        std::vector<int> unchangedUids;
+        int rc = sBandwidthCtrl->removeNaughtyApps(argc - 2, argv + 2, unchangedUids);
+        sendAppsResult(cli, rc, unchangedUids);
         return 0;
     }
     if (!strcmp(argv[1], "happybox")) {
@@ -1191,8 +1334,9 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
             sendGenericSyntaxError(cli, "addniceapps <appUid> ...");
             return 0;
         }
-        int rc = sBandwidthCtrl->addNiceApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
+        std::vector<int> unchangedUids;
+        int rc = sBandwidthCtrl->addNiceApps(argc - 2, argv + 2, unchangedUids);
+        sendAppsResult(cli, rc, unchangedUids);
         return 0;
     }
     if (!strcmp(argv[1], "removeniceapps") || !strcmp(argv[1], "rha")) {
@@ -1200,8 +1344,9 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
             sendGenericSyntaxError(cli, "removeniceapps <appUid> ...");
             return 0;
         }
-        int rc = sBandwidthCtrl->removeNiceApps(argc - 2, argv + 2);
-        sendGenericOkFail(cli, rc);
+        std::vector<int> unchangedUids;
+        int rc = sBandwidthCtrl->removeNiceApps(argc - 2, argv + 2, unchangedUids);
+        sendAppsResult(cli, rc, unchangedUids);
         return 0;
     }
     if (!strcmp(argv[1], "setglobalalert") || !strcmp(argv[1], "sga")) {
@@ -1285,21 +1430,31 @@ int CommandListener::BandwidthControlCmd::runCommand(SocketClient *cli, int argc
         return 0;
 
     }
-    if (!strcmp(argv[1], "gettetherstats") || !strcmp(argv[1], "gts")) {
+    if (!strcmp(argv[1], "gettetherstats") || !strcmp(argv[1], "gts") ||
+        !strcmp(argv[1], "gettetherstatsbin") || !strcmp(argv[1], "gtsb")) {
         BandwidthController::TetherStats tetherStats;
         std::string extraProcessingInfo = "";
+        bool binary = !strcmp(argv[1], "gettetherstatsbin") || !strcmp(argv[1], "gtsb");
         if (argc < 2 || argc > 4) {
-            sendGenericSyntaxError(cli, "gettetherstats [<intInterface> <extInterface>]");
+            sendGenericSyntaxError(cli, binary ?
+                                   "gettetherstatsbin [<intInterface> <extInterface>]" :
+                                   "gettetherstats [<intInterface> <extInterface>]");
             return 0;
         }
         tetherStats.intIface = argc > 2 ? argv[2] : "";
         tetherStats.extIface = argc > 3 ? argv[3] : "";
         // No filtering requested and there are no interface pairs to lookup.
         if (argc <= 2 && sNatCtrl->ifacePairList.empty()) {
+            if (binary) {
+                char *msg;
+                asprintf(&msg, "0 %zu", sizeof(BandwidthController::TetherStatsRecord));
+                cli->sendMsg(ResponseCode::TetheringStatsBinaryResult, msg, false);
+                free(msg);
+            }
             cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
             return 0;
         }
-        int rc = sBandwidthCtrl->getTetherStats(cli, tetherStats, extraProcessingInfo);
+        int rc = sBandwidthCtrl->getTetherStats(cli, tetherStats, binary, extraProcessingInfo);
         if (rc) {
                 extraProcessingInfo.insert(0, "Failed to get tethering stats.\n");
                 sendGenericOpFailed(cli, extraProcessingInfo.c_str());
@@ -1482,6 +1637,25 @@ int CommandListener::FirewallCmd::runCommand(SocketClient *cli, int argc,
     return 0;
 }
 
+CommandListener::IptablesCmd::IptablesCmd() :
+    NetdCommand("iptables") {
+}
+
+int CommandListener::IptablesCmd::runCommand(SocketClient *cli, int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[1], "dump")) {
+        cli->sendMsg(ResponseCode::CommandSyntaxError, "Usage: iptables dump", false);
+        return 0;
+    }
+
+    std::vector<std::string> lines;
+    ShadowRuleStore::dump(&lines);
+    for (size_t i = 0; i < lines.size(); i++) {
+        cli->sendMsg(ResponseCode::IptablesDumpResult, lines[i].c_str(), false);
+    }
+    cli->sendMsg(ResponseCode::CommandOkay, "Iptables rules dumped", false);
+    return 0;
+}
+
 CommandListener::ClatdCmd::ClatdCmd() : NetdCommand("clatd") {
 }
 
@@ -1526,6 +1700,11 @@ int CommandListener::NetworkCommand::syntaxError(SocketClient* client, const cha
     return 0;
 }
 
+int CommandListener::NetworkCommand::parameterError(SocketClient* client, const char* message) {
+    client->sendMsg(ResponseCode::CommandParameterError, message, false);
+    return 0;
+}
+
 int CommandListener::NetworkCommand::operationError(SocketClient* client, const char* message,
                                                     int ret) {
     errno = -ret;
@@ -1545,11 +1724,27 @@ int CommandListener::NetworkCommand::runCommand(SocketClient* client, int argc,
 
     //    0      1      2      3      4       5         6            7           8
     // network route [legacy <uid>]  add   <netId> <interface> <destination> [nexthop]
+    //               [metric <metric>] [nexthop <interface> <gateway> <weight>]...
     // network route [legacy <uid>] remove <netId> <interface> <destination> [nexthop]
+    //               [metric <metric>] [nexthop <interface> <gateway> <weight>]...
+    // network route   dump  <netId>
     //
-    // nexthop may be either an IPv4/IPv6 address or one of "unreachable" or "throw".
+    // nexthop may be either an IPv4/IPv6 address or one of "unreachable" or "throw". Giving
+    // "nexthop" clauses instead makes a multipath route that spreads flows over those gateways, in
+    // proportion to their weights (1-256).
     if (!strcmp(argv[1], "route")) {
-        if (argc < 6 || argc > 9) {
+        if (argc == 4 && !strcmp(argv[2], "dump")) {
+            std::vector<std::string> routes;
+            if (int ret = sNetCtrl->getRoutes(stringToNetId(argv[3]), &routes)) {
+                return operationError(client, "getRoutes() failed", ret);
+            }
+            for (const std::string& route : routes) {
+                client->sendMsg(ResponseCode::RouteListResult, route.c_str(), false);
+            }
+            return success(client);
+        }
+
+        if (argc < 6) {
             return syntaxError(client, "Incorrect number of arguments");
         }
 
@@ -1570,20 +1765,59 @@ int CommandListener::NetworkCommand::runCommand(SocketClient* client, int argc,
         }
         ++nextArg;
 
-        if (argc < nextArg + 3 || argc > nextArg + 4) {
+        if (argc < nextArg + 3) {
             return syntaxError(client, "Incorrect number of arguments");
         }
 
         unsigned netId = stringToNetId(argv[nextArg++]);
         const char* interface = argv[nextArg++];
         const char* destination = argv[nextArg++];
-        const char* nexthop = argc > nextArg ? argv[nextArg] : NULL;
+        const char* nexthop = NULL;
+        if (argc > nextArg && strcmp(argv[nextArg], "metric") && strcmp(argv[nextArg], "nexthop")) {
+            nexthop = argv[nextArg++];
+        }
+        uint32_t metric = 0;
+        if (argc > nextArg + 1 && !strcmp(argv[nextArg], "metric")) {
+            unsigned long value;
+            if (!parseNumber(argv[nextArg + 1], 0, UINT32_MAX, &value)) {
+                return parameterError(client, "Invalid metric");
+            }
+            metric = value;
+            nextArg += 2;
+        }
+        std::vector<RouteController::Nexthop> nexthops;
+        while (argc >= nextArg + 4 && !strcmp(argv[nextArg], "nexthop")) {
+            // The kernel stores the weight as rtnh_hops + 1, so it must fit in a byte after that.
+            unsigned long weight;
+            if (!parseNumber(argv[nextArg + 3], 1, 256, &weight)) {
+                return parameterError(client, "Invalid weight");
+            }
+            RouteController::Nexthop hop = {
+                argv[nextArg + 1],
+                argv[nextArg + 2],
+                static_cast<unsigned>(weight),
+            };
+            nexthops.push_back(hop);
+            nextArg += 4;
+        }
+        if (argc != nextArg) {
+            return syntaxError(client, "Incorrect number of arguments");
+        }
+        if (nexthop && !nexthops.empty()) {
+            return syntaxError(client, "Both a nexthop and multipath nexthops given");
+        }
 
         int ret;
-        if (add) {
-            ret = sNetCtrl->addRoute(netId, interface, destination, nexthop, legacy, uid);
+        if (!nexthops.empty()) {
+            ret = add ? sNetCtrl->addMultipathRoute(netId, interface, destination, nexthops,
+                                                    legacy, uid, metric) :
+                        sNetCtrl->removeMultipathRoute(netId, interface, destination, nexthops,
+                                                       legacy, uid, metric);
+        } else if (add) {
+            ret = sNetCtrl->addRoute(netId, interface, destination, nexthop, legacy, uid, metric);
         } else {
-            ret = sNetCtrl->removeRoute(netId, interface, destination, nexthop, legacy, uid);
+            ret = sNetCtrl->removeRoute(netId, interface, destination, nexthop, legacy, uid,
+                                        metric);
         }
         if (ret) {
             return operationError(client, add ? "addRoute() failed" : "removeRoute() failed", ret);
@@ -1729,6 +1963,7 @@ int CommandListener::NetworkCommand::runCommand(SocketClient* client, int argc,
     //    0      1     2       3           4
     // network users  add   <netId> [<uid>[-<uid>]] ...
     // network users remove <netId> [<uid>[-<uid>]] ...
+    // network users  set   <netId> [<uid>[-<uid>]] ...
     if (!strcmp(argv[1], "users")) {
         if (argc < 4) {
             return syntaxError(client, "Missing argument");
@@ -1746,6 +1981,10 @@ int CommandListener::NetworkCommand::runCommand(SocketClient* client, int argc,
             if (int ret = sNetCtrl->removeUsersFromNetwork(netId, uidRanges)) {
                 return operationError(client, "removeUsersFromNetwork() failed", ret);
             }
+        } else if (!strcmp(argv[2], "set")) {
+            if (int ret = sNetCtrl->setUsersForNetwork(netId, uidRanges)) {
+                return operationError(client, "setUsersForNetwork() failed", ret);
+            }
         } else {
             return syntaxError(client, "Unknown argument");
         }
@@ -134,6 +134,7 @@ private:
         void sendGenericOkFail(SocketClient *cli, int cond);
         void sendGenericOpFailed(SocketClient *cli, const char *errMsg);
         void sendGenericSyntaxError(SocketClient *cli, const char *usageMsg);
+        void sendAppsResult(SocketClient *cli, int cond, const std::vector<int> &unchangedUids);
     };
 
     class IdletimerControlCmd : public NetdCommand {
@@ -160,6 +161,13 @@ private:
         static FirewallRule parseRule(const char* arg);
     };
 
+    class IptablesCmd : public NetdCommand {
+    public:
+        IptablesCmd();
+        virtual ~IptablesCmd() {}
+        int runCommand(SocketClient *c, int argc, char ** argv);
+    };
+
     class ClatdCmd : public NetdCommand {
     public:
         ClatdCmd();
@@ -174,6 +182,7 @@ private:
         int runCommand(SocketClient* client, int argc, char** argv);
     private:
         int syntaxError(SocketClient* cli, const char* message);
+        int parameterError(SocketClient* cli, const char* message);
         int operationError(SocketClient* cli, const char* message, int ret);
         int success(SocketClient* cli);
     };
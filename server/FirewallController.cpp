@@ -26,6 +26,7 @@
 
 #include "NetdConstants.h"
 #include "FirewallController.h"
+#include "RuleTransaction.h"
 
 const char* FirewallController::LOCAL_INPUT = "fw_INPUT";
 const char* FirewallController::LOCAL_OUTPUT = "fw_OUTPUT";
@@ -39,17 +40,25 @@ int FirewallController::setupIptablesHooks(void) {
 }
 
 int FirewallController::enableFirewall(void) {
-    int res = 0;
-
-    // flush any existing rules
-    disableFirewall();
-
-    // create default rule to drop all traffic
-    res |= execIptables(V4V6, "-w", "-A", LOCAL_INPUT, "-j", "DROP", NULL);
-    res |= execIptables(V4V6, "-w", "-A", LOCAL_OUTPUT, "-j", "REJECT", NULL);
-    res |= execIptables(V4V6, "-w", "-A", LOCAL_FORWARD, "-j", "REJECT", NULL);
-
-    return res;
+    const char* commands[][5] = {
+        // flush any existing rules
+        { "-w", "-F", LOCAL_INPUT },
+        { "-w", "-F", LOCAL_OUTPUT },
+        { "-w", "-F", LOCAL_FORWARD },
+
+        // create default rule to drop all traffic
+        { "-w", "-A", LOCAL_INPUT, "-j", "DROP" },
+        { "-w", "-A", LOCAL_OUTPUT, "-j", "REJECT" },
+        { "-w", "-A", LOCAL_FORWARD, "-j", "REJECT" },
+    };
+
+    // Flushing and adding the default rules in one transaction means the chains are never seen
+    // empty or half set up.
+    RuleTransaction transaction(V4V6);
+    for (size_t i = 0; i < ARRAY_SIZE(commands); i++) {
+        transaction.add(ARRAY_SIZE(commands[i]), commands[i]);
+    }
+    return transaction.commit();
 }
 
 int FirewallController::disableFirewall(void) {
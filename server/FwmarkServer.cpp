@@ -19,22 +19,54 @@
 #include "Fwmark.h"
 #include "FwmarkCommand.h"
 #include "NetworkController.h"
-#include "resolv_netid.h"
 
 #include <sys/socket.h>
 #include <unistd.h>
 
+namespace {
+
+// Every persistent client holds on to one of our file descriptors for as long as it lives, so only
+// this many of them get to stay connected. Any others are hung up on after each command, as old
+// clients are, and reconnect for the next one.
+const size_t MAX_PERSISTENT_CLIENTS = 128;
+
+}  // namespace
+
 FwmarkServer::FwmarkServer(NetworkController* networkController) :
         SocketListener("fwmarkd", true), mNetworkController(networkController) {
 }
 
 bool FwmarkServer::onDataAvailable(SocketClient* client) {
+    FwmarkRequest request;
+    bool persistent = false;
     int socketFd = -1;
-    int error = processClient(client, &socketFd);
+    int error = processClient(client, &request, &persistent, &socketFd);
     if (socketFd >= 0) {
         close(socketFd);
     }
 
+    if (persistent) {
+        // The client may have many requests in flight, so a client that never reads its responses
+        // would eventually fill up its receive buffer. Rather than block on it (and thus stall all
+        // other clients), drop the connection as soon as a response can't be sent in full. The
+        // client then retries over a fresh connection.
+        FwmarkResponse response;
+        response.requestId = request.requestId;
+        response.error = error;
+        ssize_t sent = TEMP_FAILURE_RETRY(send(client->getSocket(), &response, sizeof(response),
+                                               MSG_DONTWAIT | MSG_NOSIGNAL));
+        bool keep = sent == static_cast<ssize_t>(sizeof(response)) &&
+                (mPersistentClients.count(client) ||
+                 mPersistentClients.size() < MAX_PERSISTENT_CLIENTS);
+        if (keep) {
+            mPersistentClients.insert(client);
+        } else {
+            mPersistentClients.erase(client);
+        }
+        return keep;
+    }
+    mPersistentClients.erase(client);
+
     // Always send a response even if there were connection errors or read errors, so that we don't
     // inadvertently cause the client to hang (which always waits for a response).
     client->sendData(&error, sizeof(error));
@@ -45,12 +77,11 @@ bool FwmarkServer::onDataAvailable(SocketClient* client) {
     return false;
 }
 
-int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
-    FwmarkCommand command;
-
+int FwmarkServer::processClient(SocketClient* client, FwmarkRequest* request, bool* persistent,
+                                int* socketFd) {
     iovec iov;
-    iov.iov_base = &command;
-    iov.iov_len = sizeof(command);
+    iov.iov_base = request;
+    iov.iov_len = sizeof(*request);
 
     msghdr message;
     memset(&message, 0, sizeof(message));
@@ -71,7 +102,13 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         return -errno;
     }
 
-    if (messageLength != sizeof(command)) {
+    FwmarkCommand command;
+    if (messageLength == sizeof(*request) && request->magic == FWMARK_REQUEST_MAGIC) {
+        *persistent = true;
+        command = request->command;
+    } else if (messageLength == sizeof(command)) {
+        memcpy(&command, request, sizeof(command));
+    } else {
         return -EBADMSG;
     }
 
@@ -91,112 +128,10 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         return -errno;
     }
 
-    Permission permission = mNetworkController->getPermissionForUser(client->getUid());
-
-    switch (command.cmdId) {
-        case FwmarkCommand::ON_ACCEPT: {
-            // Called after a socket accept(). The kernel would've marked the NetId and necessary
-            // permissions bits, so we just add the rest of the user's permissions here.
-            permission = static_cast<Permission>(permission | fwmark.permission);
-            break;
-        }
-
-        case FwmarkCommand::ON_CONNECT: {
-            // Called before a socket connect() happens. Set an appropriate NetId into the fwmark so
-            // that the socket routes consistently over that network. Do this even if the socket
-            // already has a NetId, so that calling connect() multiple times still works.
-            //
-            // But if the explicit bit was set, the existing NetId was explicitly preferred (and not
-            // a case of connect() being called multiple times). Don't reset the NetId in that case.
-            //
-            // An "appropriate" NetId is the NetId of a bypassable VPN that applies to the user, or
-            // failing that, the default network. We'll never set the NetId of a secure VPN here.
-            // See the comments in the implementation of getNetworkForConnect() for more details.
-            //
-            // If the protect bit is set, this could be either a system proxy (e.g.: the dns proxy
-            // or the download manager) acting on behalf of another user, or a VPN provider. If it's
-            // a proxy, we shouldn't reset the NetId. If it's a VPN provider, we should set the
-            // default network's NetId.
-            //
-            // There's no easy way to tell the difference between a proxy and a VPN app. We can't
-            // use PERMISSION_SYSTEM to identify the proxy because a VPN app may also have those
-            // permissions. So we use the following heuristic:
-            //
-            // If it's a proxy, but the existing NetId is not a VPN, that means the user (that the
-            // proxy is acting on behalf of) is not subject to a VPN, so the proxy must have picked
-            // the default network's NetId. So, it's okay to replace that with the current default
-            // network's NetId (which in all likelihood is the same).
-            //
-            // Conversely, if it's a VPN provider, the existing NetId cannot be a VPN. The only time
-            // we set a VPN's NetId into a socket without setting the explicit bit is here, in
-            // ON_CONNECT, but we won't do that if the socket has the protect bit set. If the VPN
-            // provider connect()ed (and got the VPN NetId set) and then called protect(), we
-            // would've unset the NetId in PROTECT_FROM_VPN below.
-            //
-            // So, overall (when the explicit bit is not set but the protect bit is set), if the
-            // existing NetId is a VPN, don't reset it. Else, set the default network's NetId.
-            if (!fwmark.explicitlySelected) {
-                if (!fwmark.protectedFromVpn) {
-                    fwmark.netId = mNetworkController->getNetworkForConnect(client->getUid());
-                } else if (!mNetworkController->isVirtualNetwork(fwmark.netId)) {
-                    fwmark.netId = mNetworkController->getDefaultNetwork();
-                }
-            }
-            break;
-        }
-
-        case FwmarkCommand::SELECT_NETWORK: {
-            fwmark.netId = command.netId;
-            if (command.netId == NETID_UNSET) {
-                fwmark.explicitlySelected = false;
-                fwmark.protectedFromVpn = false;
-                permission = PERMISSION_NONE;
-            } else {
-                if (int ret = mNetworkController->checkUserNetworkAccess(client->getUid(),
-                                                                         command.netId)) {
-                    return ret;
-                }
-                fwmark.explicitlySelected = true;
-                fwmark.protectedFromVpn = mNetworkController->canProtect(client->getUid());
-            }
-            break;
-        }
-
-        case FwmarkCommand::PROTECT_FROM_VPN: {
-            if (!mNetworkController->canProtect(client->getUid())) {
-                return -EPERM;
-            }
-            // If a bypassable VPN's provider app calls connect() and then protect(), it will end up
-            // with a socket that looks like that of a system proxy but is not (see comments for
-            // ON_CONNECT above). So, reset the NetId.
-            //
-            // In any case, it's appropriate that if the socket has an implicit VPN NetId mark, the
-            // PROTECT_FROM_VPN command should unset it.
-            if (!fwmark.explicitlySelected && mNetworkController->isVirtualNetwork(fwmark.netId)) {
-                fwmark.netId = mNetworkController->getDefaultNetwork();
-            }
-            fwmark.protectedFromVpn = true;
-            permission = static_cast<Permission>(permission | fwmark.permission);
-            break;
-        }
-
-        case FwmarkCommand::SELECT_FOR_USER: {
-            if ((permission & PERMISSION_SYSTEM) != PERMISSION_SYSTEM) {
-                return -EPERM;
-            }
-            fwmark.netId = mNetworkController->getNetworkForUser(command.uid);
-            fwmark.protectedFromVpn = true;
-            break;
-        }
-
-        default: {
-            // unknown command
-            return -EPROTO;
-        }
+    if (int ret = mNetworkController->resolveFwmark(client->getUid(), command, &fwmark)) {
+        return ret;
     }
 
-    fwmark.permission = permission;
-
     if (setsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
                    sizeof(fwmark.intValue)) == -1) {
         return -errno;
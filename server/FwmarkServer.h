@@ -19,7 +19,10 @@
 
 #include "sysutils/SocketListener.h"
 
+#include <set>
+
 class NetworkController;
+struct FwmarkRequest;
 
 class FwmarkServer : public SocketListener {
 public:
@@ -29,10 +32,16 @@ private:
     // Overridden from SocketListener:
     bool onDataAvailable(SocketClient* client);
 
-    // Returns 0 on success or a negative errno value on failure.
-    int processClient(SocketClient* client, int* socketFd);
+    // Reads and carries out one command. Sets |*persistent| if it came as a FwmarkRequest, in
+    // which case |*request| holds it. Returns 0 on success or a negative errno value on failure.
+    int processClient(SocketClient* client, FwmarkRequest* request, bool* persistent,
+                      int* socketFd);
 
     NetworkController* const mNetworkController;
+
+    // Clients that keep their connection open between commands. Only accessed from the listener
+    // thread.
+    std::set<SocketClient*> mPersistentClients;
 };
 
 #endif  // NETD_SERVER_FWMARK_SERVER_H
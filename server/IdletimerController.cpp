@@ -108,7 +108,6 @@
 
 #define LOG_TAG "IdletimerController"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 
 #include "IdletimerController.h"
 #include "NetdConstants.h"
@@ -123,27 +122,22 @@ IdletimerController::~IdletimerController() {
 }
 /* return 0 or non-zero */
 int IdletimerController::runIpxtablesCmd(int argc, const char **argv) {
-    int resIpv4, resIpv6;
+    int res;
 
-    // Running for IPv4
-    argv[0] = IPTABLES_PATH;
-    resIpv4 = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-
-    // Running for IPv6
-    argv[0] = IP6TABLES_PATH;
-    resIpv6 = android_fork_execvp(argc, (char **)argv, NULL, false, false);
+    // argv[0] is a placeholder for the binary name. Both families are applied concurrently.
+    res = execIptablesArgv(V4V6, false, argc - 1, argv + 1);
 
 #if !LOG_NDEBUG
-    std::string full_cmd = argv[0];
+    std::string full_cmd = "ip(6)tables";
     argc--; argv++;
     for (; argc; argc--, argv++) {
         full_cmd += " ";
         full_cmd += argv[0];
     }
-    ALOGV("runCmd(%s) res_ipv4=%d, res_ipv6=%d", full_cmd.c_str(), resIpv4, resIpv6);
+    ALOGV("runCmd(%s) res=%d", full_cmd.c_str(), res);
 #endif
 
-    return (resIpv4 == 0 && resIpv6 == 0) ? 0 : -1;
+    return res ? -1 : 0;
 }
 
 bool IdletimerController::setupIptablesHooks() {
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "InterfaceRegistry.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+
+#include <errno.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <map>
+#include <string>
+#include <utils/Mutex.h>
+
+namespace {
+
+// Large enough for a dump reply; the kernel fills dump datagrams up to a page (NLMSG_GOODSIZE).
+const size_t NETLINK_BUFFER_SIZE = 8192;
+const int MONITOR_RECEIVE_BUFFER_SIZE = 256 * 1024;
+
+// sLock guards all accesses to the variables below.
+android::Mutex sLock;
+// Subscribed to link notifications, which are applied to the map before every lookup.
+int sMonitorSocket = -1;
+// Whether the map reflects the kernel. If not, lookups go to the kernel.
+bool sLoaded = false;
+std::map<std::string, unsigned> sIndices;
+std::map<unsigned, std::string> sNames;
+
+void addLocked(const std::string& name, unsigned index) {
+    // Drop whatever the name or the index referred to before, e.g. after a rename.
+    auto oldIndex = sIndices.find(name);
+    if (oldIndex != sIndices.end()) {
+        sNames.erase(oldIndex->second);
+    }
+    auto oldName = sNames.find(index);
+    if (oldName != sNames.end()) {
+        sIndices.erase(oldName->second);
+    }
+    sIndices[name] = index;
+    sNames[index] = name;
+}
+
+void removeLocked(unsigned index) {
+    auto iter = sNames.find(index);
+    if (iter != sNames.end()) {
+        sIndices.erase(iter->second);
+        sNames.erase(iter);
+    }
+}
+
+// Applies an RTM_NEWLINK or RTM_DELLINK message, which the kernel sends for every link it reports
+// in a dump and for every link that is added, renamed, changed or deleted.
+void applyLinkMessageLocked(const nlmsghdr* nh) {
+    if ((nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) ||
+            nh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+        return;
+    }
+    const ifinfomsg* ifi = static_cast<const ifinfomsg*>(NLMSG_DATA(nh));
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        removeLocked(ifi->ifi_index);
+        return;
+    }
+    int length = IFLA_PAYLOAD(nh);
+    for (const rtattr* rta = IFLA_RTA(ifi); RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == IFLA_IFNAME) {
+            const char* name = static_cast<const char*>(RTA_DATA(rta));
+            addLocked(std::string(name, strnlen(name, RTA_PAYLOAD(rta))), ifi->ifi_index);
+        }
+    }
+}
+
+// Returns a socket subscribed to link notifications, or negative errno on failure.
+int openMonitorSocket() {
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (sock == -1) {
+        return -errno;
+    }
+    sockaddr_nl address = {AF_NETLINK, 0, 0, RTMGRP_LINK};
+    if (bind(sock, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &MONITOR_RECEIVE_BUFFER_SIZE,
+                   sizeof(MONITOR_RECEIVE_BUFFER_SIZE)) == -1) {
+        ALOGW("failed to set link monitor receive buffer size (%s)", strerror(errno));
+    }
+    return sock;
+}
+
+// Reads all interfaces from the kernel into the map.
+// Returns 0 on success or negative errno on failure.
+int dumpLinksLocked() {
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock == -1) {
+        return -errno;
+    }
+
+    struct {
+        nlmsghdr header;
+        rtgenmsg msg;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETLINK;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = 1;
+    request.msg.rtgen_family = AF_UNSPEC;
+    if (send(sock, &request, sizeof(request), 0) == -1) {
+        int ret = -errno;
+        close(sock);
+        return ret;
+    }
+
+    char buffer[NETLINK_BUFFER_SIZE];
+    int ret = -EBADMSG;
+    bool done = false;
+    while (!done) {
+        ssize_t bytesRead = recv(sock, buffer, sizeof(buffer), 0);
+        if (bytesRead == -1) {
+            ret = -errno;
+            break;
+        }
+        size_t offset = 0;
+        while (offset + sizeof(nlmsghdr) <= static_cast<size_t>(bytesRead) && !done) {
+            nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buffer + offset);
+            if (nh->nlmsg_len < sizeof(nlmsghdr) || nh->nlmsg_len > bytesRead - offset) {
+                done = true;
+                break;
+            }
+            offset += NLMSG_ALIGN(nh->nlmsg_len);
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                ret = 0;
+                done = true;
+            } else if (nh->nlmsg_type == NLMSG_ERROR) {
+                ret = static_cast<nlmsgerr*>(NLMSG_DATA(nh))->error;
+                done = true;
+            } else {
+                applyLinkMessageLocked(nh);
+            }
+        }
+    }
+
+    close(sock);
+    return ret;
+}
+
+// Brings the map up to date with the link notifications received since the last call. The kernel
+// queues a notification before the change that caused it completes, so afterwards the map is as
+// current as an ioctl would be. If notifications were lost (the socket buffer overflowed), or the
+// map was never filled, reads all interfaces again. Afterwards, |sLoaded| says whether the map can
+// be trusted.
+void syncLocked() {
+    if (sMonitorSocket == -1) {
+        // Subscribe before dumping, so that no change falls in between.
+        int sock = openMonitorSocket();
+        if (sock < 0) {
+            ALOGE("link monitor socket failed (%s)", strerror(-sock));
+            sLoaded = false;
+            return;
+        }
+        sMonitorSocket = sock;
+        sLoaded = false;
+    }
+
+    char buffer[NETLINK_BUFFER_SIZE];
+    while (true) {
+        ssize_t bytesRead = recv(sMonitorSocket, buffer, sizeof(buffer), 0);
+        if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                sLoaded = false;
+                continue;
+            }
+            ALOGE("link monitor recv failed (%s)", strerror(errno));
+            close(sMonitorSocket);
+            sMonitorSocket = -1;
+            sLoaded = false;
+            return;
+        }
+        if (!sLoaded) {
+            continue;  // The map is going to be read again anyway.
+        }
+        size_t offset = 0;
+        while (offset + sizeof(nlmsghdr) <= static_cast<size_t>(bytesRead)) {
+            nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buffer + offset);
+            if (nh->nlmsg_len < sizeof(nlmsghdr) || nh->nlmsg_len > bytesRead - offset) {
+                break;
+            }
+            offset += NLMSG_ALIGN(nh->nlmsg_len);
+            applyLinkMessageLocked(nh);
+        }
+    }
+
+    if (!sLoaded) {
+        sIndices.clear();
+        sNames.clear();
+        if (int ret = dumpLinksLocked()) {
+            ALOGE("failed to read the interfaces (%s)", strerror(-ret));
+            return;
+        }
+        sLoaded = true;
+    }
+}
+
+}  // namespace
+
+unsigned InterfaceRegistry::nameToIndex(const char* name) {
+    android::Mutex::Autolock lock(sLock);
+    syncLocked();
+    if (!sLoaded) {
+        return if_nametoindex(name);
+    }
+    auto iter = sIndices.find(name);
+    return iter != sIndices.end() ? iter->second : 0;
+}
+
+char* InterfaceRegistry::indexToName(unsigned index, char* name) {
+    android::Mutex::Autolock lock(sLock);
+    syncLocked();
+    if (!sLoaded) {
+        return if_indextoname(index, name);
+    }
+    auto iter = sNames.find(index);
+    if (iter == sNames.end()) {
+        return NULL;
+    }
+    strlcpy(name, iter->second.c_str(), IFNAMSIZ);
+    return name;
+}
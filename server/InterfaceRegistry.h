@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_INTERFACE_REGISTRY_H
+#define NETD_SERVER_INTERFACE_REGISTRY_H
+
+// Process-wide map between interface names and indices, so that looking up an interface doesn't
+// take an ioctl on a throwaway socket as if_nametoindex() does.
+//
+// The map is filled from an RTM_GETLINK dump on first use. It keeps its own rtnetlink socket
+// subscribed to link notifications, and applies whatever has arrived on it (interfaces added,
+// renamed or deleted) before answering a lookup, which costs a single non-blocking recv. If the
+// notifications can't be followed, lookups go to the kernel.
+class InterfaceRegistry {
+public:
+    // Returns the index of the interface |name|, or 0 if there is no such interface.
+    static unsigned nameToIndex(const char* name);
+
+    // Copies the name of the interface |index| to |name|, which must have room for IFNAMSIZ bytes.
+    // Returns |name|, or NULL if there is no such interface.
+    static char* indexToName(unsigned index, char* name);
+};
+
+#endif  // NETD_SERVER_INTERFACE_REGISTRY_H
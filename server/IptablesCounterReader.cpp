@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "IptablesCounterReader.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netfilter_ipv4/ip_tables.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+
+namespace {
+
+// The table can change between IPT_SO_GET_INFO and IPT_SO_GET_ENTRIES, in which case the kernel
+// returns EAGAIN and we have to start over.
+const int GET_ENTRIES_ATTEMPTS = 3;
+
+const char* inIface(const ipt_entry* entry) { return entry->ip.iniface; }
+const char* outIface(const ipt_entry* entry) { return entry->ip.outiface; }
+const char* inIface(const ip6t_entry* entry) { return entry->ipv6.iniface; }
+const char* outIface(const ip6t_entry* entry) { return entry->ipv6.outiface; }
+
+std::string ifaceName(const char* name) {
+    return std::string(name, strnlen(name, IFNAMSIZ));
+}
+
+// Walks the blob returned by the kernel. User-defined chains start with an ERROR target entry that
+// carries the chain name, and end with an unconditional RETURN that isn't a real rule.
+template <typename Entry>
+int parseChain(const unsigned char* table, size_t size, const char* chain,
+               std::vector<IptablesCounterReader::RuleCounters>* rules) {
+    bool found = false;
+    size_t offset = 0;
+    while (offset + sizeof(Entry) <= size) {
+        const Entry* entry = reinterpret_cast<const Entry*>(table + offset);
+        if (entry->next_offset < sizeof(Entry) || entry->target_offset < sizeof(Entry) ||
+                offset + entry->next_offset > size) {
+            ALOGE("malformed iptables entry at offset %zu", offset);
+            return -EBADMSG;
+        }
+        const xt_entry_target* target =
+                reinterpret_cast<const xt_entry_target*>(table + offset + entry->target_offset);
+
+        if (!strcmp(target->u.user.name, XT_ERROR_TARGET)) {
+            if (found) {
+                break;
+            }
+            found = !strcmp(reinterpret_cast<const char*>(target->data), chain);
+        } else if (found) {
+            IptablesCounterReader::RuleCounters counters;
+            counters.inIface = ifaceName(inIface(entry));
+            counters.outIface = ifaceName(outIface(entry));
+            counters.packets = entry->counters.pcnt;
+            counters.bytes = entry->counters.bcnt;
+            rules->push_back(counters);
+        }
+        offset += entry->next_offset;
+    }
+
+    if (!found) {
+        return -ENOENT;
+    }
+    if (!rules->empty()) {
+        rules->pop_back();  // The chain's policy, not a rule.
+    }
+    return 0;
+}
+
+// Returns the names of all user-defined chains in the blob.
+template <typename Entry>
+int parseChainNames(const unsigned char* table, size_t size, std::vector<std::string>* chains) {
+    size_t offset = 0;
+    while (offset + sizeof(Entry) <= size) {
+        const Entry* entry = reinterpret_cast<const Entry*>(table + offset);
+        if (entry->next_offset < sizeof(Entry) || entry->target_offset < sizeof(Entry) ||
+                offset + entry->next_offset > size) {
+            ALOGE("malformed iptables entry at offset %zu", offset);
+            return -EBADMSG;
+        }
+        const xt_entry_target* target =
+                reinterpret_cast<const xt_entry_target*>(table + offset + entry->target_offset);
+        const char* name = reinterpret_cast<const char*>(target->data);
+        // The table itself ends with an ERROR entry named "ERROR".
+        if (!strcmp(target->u.user.name, XT_ERROR_TARGET) && strcmp(name, XT_ERROR_TARGET)) {
+            chains->push_back(name);
+        }
+        offset += entry->next_offset;
+    }
+    return 0;
+}
+
+// Fetches the rules of |table| from the kernel into |blob|.
+template <typename GetInfo, typename GetEntries>
+int getTable(int domain, int level, int getInfo, int getEntries, const char* table,
+             std::vector<unsigned char>* blob) {
+    int sock = socket(domain, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+    if (sock == -1) {
+        return -errno;
+    }
+
+    int ret = -EAGAIN;
+    for (int attempt = 0; attempt < GET_ENTRIES_ATTEMPTS && ret == -EAGAIN; ++attempt) {
+        GetInfo info;
+        memset(&info, 0, sizeof(info));
+        strlcpy(info.name, table, sizeof(info.name));
+        socklen_t infoLength = sizeof(info);
+        if (getsockopt(sock, level, getInfo, &info, &infoLength) == -1) {
+            ret = -errno;
+            break;
+        }
+
+        socklen_t entriesLength = sizeof(GetEntries) + info.size;
+        GetEntries* entries = static_cast<GetEntries*>(calloc(1, entriesLength));
+        if (!entries) {
+            ret = -ENOMEM;
+            break;
+        }
+        strlcpy(entries->name, table, sizeof(entries->name));
+        entries->size = info.size;
+        if (getsockopt(sock, level, getEntries, entries, &entriesLength) == -1) {
+            ret = -errno;
+        } else {
+            const unsigned char* start =
+                    reinterpret_cast<const unsigned char*>(entries->entrytable);
+            blob->assign(start, start + entries->size);
+            ret = 0;
+        }
+        free(entries);
+    }
+
+    close(sock);
+    return ret;
+}
+
+int getTable(IptablesTarget family, const char* table, std::vector<unsigned char>* blob) {
+    switch (family) {
+        case V4:
+            return getTable<ipt_getinfo, ipt_get_entries>(AF_INET, IPPROTO_IP, IPT_SO_GET_INFO,
+                                                          IPT_SO_GET_ENTRIES, table, blob);
+        case V6:
+            return getTable<ip6t_getinfo, ip6t_get_entries>(AF_INET6, IPPROTO_IPV6,
+                                                            IP6T_SO_GET_INFO,
+                                                            IP6T_SO_GET_ENTRIES, table, blob);
+        default:
+            return -EINVAL;
+    }
+}
+
+}  // namespace
+
+int IptablesCounterReader::readChain(IptablesTarget family, const char* table, const char* chain,
+                                     std::vector<RuleCounters>* rules) {
+    rules->clear();
+    std::vector<unsigned char> blob;
+    if (int ret = getTable(family, table, &blob)) {
+        return ret;
+    }
+    if (family == V4) {
+        return parseChain<ipt_entry>(blob.data(), blob.size(), chain, rules);
+    }
+    return parseChain<ip6t_entry>(blob.data(), blob.size(), chain, rules);
+}
+
+int IptablesCounterReader::listChains(IptablesTarget family, const char* table,
+                                      std::vector<std::string>* chains) {
+    chains->clear();
+    std::vector<unsigned char> blob;
+    if (int ret = getTable(family, table, &blob)) {
+        return ret;
+    }
+    if (family == V4) {
+        return parseChainNames<ipt_entry>(blob.data(), blob.size(), chains);
+    }
+    return parseChainNames<ip6t_entry>(blob.data(), blob.size(), chains);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_IPTABLES_COUNTER_READER_H
+#define NETD_SERVER_IPTABLES_COUNTER_READER_H
+
+#include "NetdConstants.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Reads rules and their counters straight from the kernel with getsockopt(IPT_SO_GET_ENTRIES), the same
+// interface libiptc uses, instead of running "iptables -nvx -L" and parsing its output.
+class IptablesCounterReader {
+public:
+    struct RuleCounters {
+        std::string inIface;
+        std::string outIface;
+        uint64_t packets;
+        uint64_t bytes;
+    };
+
+    // Returns the counters of every rule in the user-defined |chain| of |table|, in rule order.
+    // |family| must be V4 or V6. Returns 0 on success, -ENOENT if the chain doesn't exist or
+    // another negative errno on failure.
+    static int readChain(IptablesTarget family, const char* table, const char* chain,
+                         std::vector<RuleCounters>* rules) WARN_UNUSED_RESULT;
+
+    // Returns the names of all user-defined chains in |table|.
+    static int listChains(IptablesTarget family, const char* table,
+                          std::vector<std::string>* chains) WARN_UNUSED_RESULT;
+};
+
+#endif  // NETD_SERVER_IPTABLES_COUNTER_READER_H
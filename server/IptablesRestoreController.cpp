@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "IptablesRestoreController.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+#include "utils/Mutex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const char* const IPTABLES_RESTORE_PATH = "/system/bin/iptables-restore";
+const char* const IP6TABLES_RESTORE_PATH = "/system/bin/ip6tables-restore";
+
+const char PING[] = "#PING\n";
+
+// iptables-restore only understands -w, and so only serializes its commits with other users of
+// the xtables lock, since 1.6.2. Older versions exit on the unknown option.
+const unsigned MIN_RESTORE_VERSION = 10602;
+
+// How long to wait for a newly started child to answer its first ping, and for a block of
+// commands to be processed.
+const int STARTUP_TIMEOUT_MS = 1000;
+const int COMMAND_TIMEOUT_MS = 5000;
+
+struct RestoreProcess {
+    const char* path;
+    bool versionChecked;
+    pid_t pid;
+    int stdIn;
+    int stdOut;
+    int stdErr;
+    // Number of input lines written to the child, which is how iptables-restore numbers the line
+    // it reports an error for.
+    unsigned lines;
+    std::string pendingOutput;
+};
+
+RestoreProcess sProcesses[] = {
+    { IPTABLES_RESTORE_PATH, false, 0, -1, -1, -1, 0, "" },
+    { IP6TABLES_RESTORE_PATH, false, 0, -1, -1, -1, 0, "" },
+};
+
+// Set once a binary has failed its version check or a child its startup handshake. From then on every request falls back to
+// fork/exec; we don't want to keep spawning a binary that can't do what we need.
+bool sDisabled = false;
+
+android::Mutex sLock;
+
+void closeFd(int* fd) {
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+void stopProcess(RestoreProcess* process) {
+    closeFd(&process->stdIn);
+    closeFd(&process->stdOut);
+    closeFd(&process->stdErr);
+    if (process->pid > 0) {
+        kill(process->pid, SIGTERM);
+        TEMP_FAILURE_RETRY(waitpid(process->pid, NULL, 0));
+    }
+    process->pid = 0;
+    process->lines = 0;
+    process->pendingOutput.clear();
+}
+
+// One block of input being sent to one child. The input may contain several "#PING"s.
+struct Exchange {
+    Exchange() : process(NULL), input(NULL), written(0), pings(1), pingsSeen(0),
+                 ret(-EINPROGRESS) {}
+
+    RestoreProcess* process;
+    const std::string* input;
+    size_t written;
+    size_t pings;
+    size_t pingsSeen;
+    std::string errors;
+    int ret;
+};
+
+// Consumes the child's output. Returns true once it has echoed the last "#PING" of the input.
+bool sawPing(Exchange* exchange) {
+    RestoreProcess* process = exchange->process;
+    size_t newline;
+    while ((newline = process->pendingOutput.find('\n')) != std::string::npos) {
+        bool isPing = process->pendingOutput.compare(0, newline + 1, PING) == 0;
+        process->pendingOutput.erase(0, newline + 1);
+        if (isPing && ++exchange->pingsSeen == exchange->pings &&
+                exchange->written == exchange->input->size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the input line numbers in the errors iptables-restore reported, e.g.
+// "iptables-restore: line 12 failed" or "Error occurred at line: 12".
+std::vector<unsigned> getFailedLines(const std::string& errors) {
+    static const char* const FORMATS[][2] = {
+        { "line ", "line %u failed" },
+        { "at line: ", "at line: %u" },
+    };
+    std::vector<unsigned> lines;
+    for (size_t i = 0; i < ARRAY_SIZE(FORMATS); ++i) {
+        for (size_t pos = errors.find(FORMATS[i][0]); pos != std::string::npos;
+             pos = errors.find(FORMATS[i][0], pos + 1)) {
+            unsigned line;
+            if (sscanf(errors.c_str() + pos, FORMATS[i][1], &line) == 1) {
+                lines.push_back(line);
+            }
+        }
+    }
+    return lines;
+}
+
+// Reads whatever the child has written to stderr so far. stderr is non-blocking.
+void drainErrors(Exchange* exchange) {
+    char buffer[512];
+    ssize_t bytes;
+    while ((bytes = TEMP_FAILURE_RETRY(read(exchange->process->stdErr, buffer,
+                                            sizeof(buffer)))) > 0) {
+        exchange->errors.append(buffer, bytes);
+    }
+}
+
+// |broken| means that the child itself can't be used any more (it exited, stopped answering or
+// its pipes failed), as opposed to having rejected a command. Only then is it stopped, to be
+// restarted on the next request; failing "silent" deletes are common and mustn't cost a fork.
+void finishExchange(Exchange* exchange, int ret, bool silent, bool broken) {
+    exchange->ret = ret;
+    if (ret) {
+        if (!silent) {
+            ALOGE("%s failed: %s", exchange->process->path, exchange->errors.c_str());
+        }
+        if (broken) {
+            stopProcess(exchange->process);
+        }
+    }
+}
+
+// Writes the input of each exchange to its child and waits until every child echoes the trailing
+// "#PING", so that the children work in parallel. stdout and stderr are drained while writing, so
+// that a chatty child can't deadlock us by filling up its pipes. Sets each exchange's ret to 0 on
+// success, -ETIMEDOUT if the child didn't respond in time or -EREMOTEIO if a command failed,
+// which iptables-restore reports on stderr and, depending on its version, by exiting.
+void sendAndWaitAll(Exchange* exchanges, size_t count, int timeoutMs, bool silent) {
+    const int FDS_PER_EXCHANGE = 3;
+    std::vector<pollfd> fds(FDS_PER_EXCHANGE * count);
+    while (true) {
+        size_t numFds = 0;
+        for (size_t i = 0; i < count; ++i) {
+            Exchange* exchange = &exchanges[i];
+            if (exchange->ret == -EINPROGRESS && sawPing(exchange)) {
+                // A failing command is reported on stderr before the child reads the next line,
+                // so by the time the ping comes back any complaint is already in the pipe.
+                drainErrors(exchange);
+                finishExchange(exchange, exchange->errors.empty() ? 0 : -EREMOTEIO, silent, false);
+            }
+            // Finished exchanges keep their slots, with fds that poll ignores.
+            bool active = exchange->ret == -EINPROGRESS;
+            bool writing = active && exchange->written < exchange->input->size();
+            RestoreProcess* process = exchange->process;
+            fds[numFds++] = { active ? process->stdOut : -1, POLLIN, 0 };
+            fds[numFds++] = { active ? process->stdErr : -1, POLLIN, 0 };
+            fds[numFds++] = { writing ? process->stdIn : -1, POLLOUT, 0 };
+        }
+
+        bool done = true;
+        for (size_t i = 0; i < count; ++i) {
+            done = done && exchanges[i].ret != -EINPROGRESS;
+        }
+        if (done) {
+            return;
+        }
+
+        int n = TEMP_FAILURE_RETRY(poll(fds.data(), numFds, timeoutMs));
+        if (n <= 0) {
+            int ret = n ? -errno : -ETIMEDOUT;
+            for (size_t i = 0; i < count; ++i) {
+                if (exchanges[i].ret == -EINPROGRESS) {
+                    ALOGE("waiting for %s failed (%s)", exchanges[i].process->path,
+                          strerror(-ret));
+                    finishExchange(&exchanges[i], ret, silent, true);
+                }
+            }
+            return;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            Exchange* exchange = &exchanges[i];
+            RestoreProcess* process = exchange->process;
+            pollfd* processFds = &fds[FDS_PER_EXCHANGE * i];
+            if (exchange->ret != -EINPROGRESS) {
+                continue;
+            }
+
+            char buffer[512];
+            if (processFds[1].revents) {
+                ssize_t bytes = TEMP_FAILURE_RETRY(read(process->stdErr, buffer, sizeof(buffer)));
+                if (bytes > 0) {
+                    exchange->errors.append(buffer, bytes);
+                }
+            }
+            if (processFds[0].revents) {
+                ssize_t bytes = TEMP_FAILURE_RETRY(read(process->stdOut, buffer, sizeof(buffer)));
+                if (bytes <= 0) {
+                    // The child is gone. Pick up whatever it had to say on the way out.
+                    drainErrors(exchange);
+                    finishExchange(exchange, -EREMOTEIO, silent, true);
+                    continue;
+                }
+                process->pendingOutput.append(buffer, bytes);
+            }
+            if (processFds[2].revents) {
+                const std::string& input = *exchange->input;
+                ssize_t bytes = TEMP_FAILURE_RETRY(write(process->stdIn,
+                                                         input.data() + exchange->written,
+                                                         input.size() - exchange->written));
+                if (bytes == -1 && errno != EAGAIN) {
+                    finishExchange(exchange, -EREMOTEIO, silent, true);
+                    continue;
+                }
+                if (bytes > 0) {
+                    process->lines += std::count(input.data() + exchange->written,
+                                                 input.data() + exchange->written + bytes, '\n');
+                    exchange->written += bytes;
+                }
+            }
+        }
+    }
+}
+
+WARN_UNUSED_RESULT int sendAndWait(RestoreProcess* process, const std::string& input,
+                                   int timeoutMs, bool silent) {
+    Exchange exchange;
+    exchange.process = process;
+    exchange.input = &input;
+    sendAndWaitAll(&exchange, 1, timeoutMs, silent);
+    return exchange.ret;
+}
+
+// Runs "|path| --version" and returns the version it prints as major * 10000 + minor * 100 + patch,
+// or 0 if the binary is missing or predates --version.
+unsigned getRestoreVersion(const char* path) {
+    int out[2];
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (dup2(out[1], STDOUT_FILENO) == -1) {
+            _exit(1);
+        }
+        execl(path, path, "--version", NULL);
+        _exit(1);
+    }
+    close(out[1]);
+
+    std::string output;
+    if (pid != -1) {
+        pollfd fd = { out[0], POLLIN, 0 };
+        char buffer[128];
+        ssize_t bytes;
+        while (TEMP_FAILURE_RETRY(poll(&fd, 1, STARTUP_TIMEOUT_MS)) > 0 &&
+               (bytes = TEMP_FAILURE_RETRY(read(out[0], buffer, sizeof(buffer)))) > 0) {
+            output.append(buffer, bytes);
+        }
+        kill(pid, SIGTERM);
+        TEMP_FAILURE_RETRY(waitpid(pid, NULL, 0));
+    }
+    close(out[0]);
+
+    // E.g., "iptables-restore v1.6.2".
+    unsigned major, minor, patch;
+    const char* version = strstr(output.c_str(), " v");
+    if (!version || sscanf(version, " v%u.%u.%u", &major, &minor, &patch) != 3) {
+        return 0;
+    }
+    return major * 10000 + minor * 100 + patch;
+}
+
+WARN_UNUSED_RESULT int startProcess(RestoreProcess* process) {
+    if (!process->versionChecked) {
+        process->versionChecked = true;
+        unsigned version = getRestoreVersion(process->path);
+        if (version < MIN_RESTORE_VERSION) {
+            ALOGW("%s is missing or older than 1.6.2 (version %u), falling back to forking "
+                  "iptables", process->path, version);
+            sDisabled = true;
+            return -EOPNOTSUPP;
+        }
+    }
+
+    int in[2], out[2], err[2];
+    if (pipe2(in, O_CLOEXEC) == -1) {
+        return -errno;
+    }
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        close(in[0]);
+        close(in[1]);
+        return -errno;
+    }
+    if (pipe2(err, O_CLOEXEC) == -1) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -errno;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (dup2(in[0], STDIN_FILENO) == -1 || dup2(out[1], STDOUT_FILENO) == -1 ||
+                dup2(err[1], STDERR_FILENO) == -1) {
+            _exit(1);
+        }
+        execl(process->path, process->path, "--noflush", "-w", "-v", NULL);
+        _exit(1);
+    }
+
+    int ret = pid == -1 ? -errno : 0;
+    close(in[0]);
+    close(out[1]);
+    close(err[1]);
+    if (ret) {
+        close(in[1]);
+        close(out[0]);
+        close(err[0]);
+        return ret;
+    }
+
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    process->pid = pid;
+    process->stdIn = in[1];
+    process->stdOut = out[0];
+    process->stdErr = err[0];
+
+    if ((ret = sendAndWait(process, PING, STARTUP_TIMEOUT_MS, false))) {
+        ALOGW("%s doesn't answer pings, falling back to forking iptables", process->path);
+        sDisabled = true;
+    }
+    return ret;
+}
+
+// Called with sLock held.
+WARN_UNUSED_RESULT bool ensureStarted(RestoreProcess* process) {
+    if (sDisabled) {
+        return false;
+    }
+    if (process->pid > 0) {
+        return true;
+    }
+    return startProcess(process) == 0;
+}
+
+// Restore input is whitespace-separated; anything that would need escaping is left to iptables.
+bool appendArgument(const char* arg, std::string* line) {
+    if (!*arg || strpbrk(arg, "\"'\\\n")) {
+        return false;
+    }
+    if (!line->empty()) {
+        *line += ' ';
+    }
+    if (strpbrk(arg, " \t")) {
+        *line += '"';
+        *line += arg;
+        *line += '"';
+    } else {
+        *line += arg;
+    }
+    return true;
+}
+
+bool isRestorableOperation(const char* arg) {
+    static const char* const OPERATIONS[] = {
+        "-A", "-D", "-E", "-F", "-I", "-N", "-P", "-R", "-X", "-Z",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(OPERATIONS); ++i) {
+        if (!strcmp(arg, OPERATIONS[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+int IptablesRestoreController::execute(IptablesTarget target, const std::string& commands,
+                                       bool silent) {
+    int v4Result = 0, v6Result = 0;
+    int ret = execute(target, commands, silent, &v4Result, &v6Result);
+    if (ret) {
+        return ret;
+    }
+    return v4Result ? v4Result : v6Result;
+}
+
+int IptablesRestoreController::execute(IptablesTarget target, const std::string& commands,
+                                       bool silent, int* v4Result, int* v6Result) {
+    android::Mutex::Autolock lock(sLock);
+
+    RestoreProcess* v4 = (target == V4 || target == V4V6) ? &sProcesses[0] : NULL;
+    RestoreProcess* v6 = (target == V6 || target == V4V6) ? &sProcesses[1] : NULL;
+
+    // Make sure every family we need is available before applying anything, so that callers
+    // falling back to iptables never apply a command twice.
+    if ((v4 && !ensureStarted(v4)) || (v6 && !ensureStarted(v6))) {
+        return -EOPNOTSUPP;
+    }
+
+    // Both families are sent their input before waiting for either of them, so that the two
+    // children apply it concurrently.
+    std::string input = commands + PING;
+    Exchange exchanges[2];
+    size_t count = 0;
+    if (v4) {
+        exchanges[count].process = v4;
+        exchanges[count++].input = &input;
+    }
+    if (v6) {
+        exchanges[count].process = v6;
+        exchanges[count++].input = &input;
+    }
+    sendAndWaitAll(exchanges, count, COMMAND_TIMEOUT_MS, silent);
+
+    *v4Result = v4 ? exchanges[0].ret : 0;
+    *v6Result = v6 ? exchanges[count - 1].ret : 0;
+    return 0;
+}
+
+int IptablesRestoreController::execute(IptablesTarget family,
+                                       const std::vector<std::string>& blocks,
+                                       std::vector<int>* results) {
+    android::Mutex::Autolock lock(sLock);
+
+    RestoreProcess* process = &sProcesses[family == V4 ? 0 : 1];
+    if (!ensureStarted(process)) {
+        return -EOPNOTSUPP;
+    }
+
+    // Every block is followed by a ping, so that we know how far the child got if it exits, and
+    // the number of its last line, so that we know which block an error belongs to.
+    std::string input;
+    std::vector<unsigned> lastLines;
+    unsigned line = process->lines;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        input += blocks[i] + PING;
+        line += std::count(blocks[i].begin(), blocks[i].end(), '\n') + 1;
+        lastLines.push_back(line);
+    }
+
+    Exchange exchange;
+    exchange.process = process;
+    exchange.input = &input;
+    exchange.pings = blocks.size();
+    sendAndWaitAll(&exchange, 1, COMMAND_TIMEOUT_MS, false);
+
+    // A block that wasn't followed by its ping was never committed, and neither was one that an
+    // error was reported for.
+    results->assign(blocks.size(), 0);
+    for (size_t i = exchange.pingsSeen; i < blocks.size(); ++i) {
+        (*results)[i] = exchange.ret ? exchange.ret : -EREMOTEIO;
+    }
+    std::vector<unsigned> failedLines = getFailedLines(exchange.errors);
+    for (size_t i = 0; i < failedLines.size(); ++i) {
+        size_t block = std::lower_bound(lastLines.begin(), lastLines.end(), failedLines[i]) -
+                lastLines.begin();
+        if (block < blocks.size()) {
+            (*results)[block] = -EREMOTEIO;
+        }
+    }
+    return 0;
+}
+
+bool IptablesRestoreController::toRestoreCommands(int argc, const char* argv[],
+                                                  std::string* commands) {
+    std::string table, line;
+    if (!toRestoreLine(argc, argv, &table, &line)) {
+        return false;
+    }
+    *commands = "*" + table + "\n" + line + "\nCOMMIT\n";
+    return true;
+}
+
+bool IptablesRestoreController::toRestoreLine(int argc, const char* argv[], std::string* table,
+                                              std::string* line) {
+    bool haveOperation = false;
+
+    *table = "filter";
+    line->clear();
+    for (int i = 0; i < argc; ++i) {
+        if (!strcmp(argv[i], "-w")) {
+            continue;
+        }
+        if (!strcmp(argv[i], "-t")) {
+            if (++i == argc) {
+                return false;
+            }
+            *table = argv[i];
+            continue;
+        }
+        if (!haveOperation && isRestorableOperation(argv[i])) {
+            haveOperation = true;
+        } else if (!haveOperation && argv[i][0] == '-') {
+            // Something like -L, -S or -C, which only make sense as standalone commands.
+            return false;
+        }
+        if (!appendArgument(argv[i], line)) {
+            return false;
+        }
+    }
+    return haveOperation;
+}
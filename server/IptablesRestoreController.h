@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
+#define NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
+
+#include "NetdConstants.h"
+
+#include <string>
+#include <vector>
+
+// Keeps one long-lived "iptables-restore --noflush" and one "ip6tables-restore --noflush" child
+// process around and streams rules to them over pipes, so that each rule doesn't cost a fork/exec
+// and a separate acquisition of the xtables lock.
+//
+// Every block of input is followed by a "#PING" comment line, which the restore process echoes on
+// stdout once it has processed everything before it. A command that fails is reported on stderr;
+// the child is only replaced if it exits (as older restore binaries do on failure), stops answering
+// or its pipes break. If the restore binary is older than 1.6.2, which added -w, or a freshly
+// started child doesn't answer the initial "#PING" (e.g., because it doesn't echo comments), the
+// backend logs a warning and disables itself for the life of the process, and callers go back to
+// forking iptables for every command.
+class IptablesRestoreController {
+public:
+    // Applies |commands|, which must be in iptables-restore format ("*table" ... "COMMIT"), to the
+    // given families. Returns 0 on success, -EOPNOTSUPP if the backend isn't usable (in which case
+    // nothing has been applied and the caller should fall back to iptables), or another negative
+    // errno if any of the commands failed.
+    static int execute(IptablesTarget target, const std::string& commands,
+                       bool silent) WARN_UNUSED_RESULT;
+
+    // Same as above, but returns the result of each family separately in |v4Result| and
+    // |v6Result|. For V4V6, the two families are applied concurrently. Returns 0 if the commands
+    // were sent, or -EOPNOTSUPP if the backend isn't usable.
+    static int execute(IptablesTarget target, const std::string& commands, bool silent,
+                       int* v4Result, int* v6Result) WARN_UNUSED_RESULT;
+
+    // Applies several blocks, each in iptables-restore format with a single COMMIT, to |family|
+    // (V4 or V6) in one round trip. iptables-restore commits each block on its own, so a failure
+    // doesn't undo the blocks before it. |results| receives 0 for every block that was committed
+    // and a negative errno for every one that wasn't. Returns 0 if the blocks were sent, or
+    // -EOPNOTSUPP if the backend isn't usable.
+    static int execute(IptablesTarget family, const std::vector<std::string>& blocks,
+                       std::vector<int>* results) WARN_UNUSED_RESULT;
+
+    // Translates a single iptables command line (without the binary name) into restore input.
+    // Returns false if the command can't be expressed that way (e.g., listing or checking rules).
+    static bool toRestoreCommands(int argc, const char* argv[], std::string* commands);
+
+    // Like toRestoreCommands(), but returns the table and the rule line separately, so that several
+    // commands for the same table can be combined into one COMMIT block.
+    static bool toRestoreLine(int argc, const char* argv[], std::string* table, std::string* line);
+};
+
+#endif  // NETD_SERVER_IPTABLES_RESTORE_CONTROLLER_H
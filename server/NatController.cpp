@@ -29,11 +29,12 @@
 
 #define LOG_TAG "NatController"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 
 #include "NatController.h"
 #include "NetdConstants.h"
 #include "RouteController.h"
+#include "RuleTransaction.h"
+#include "ShadowRuleStore.h"
 
 const char* NatController::LOCAL_FORWARD = "natctrl_FORWARD";
 const char* NatController::LOCAL_MANGLE_FORWARD = "natctrl_mangle_FORWARD";
@@ -55,7 +56,12 @@ struct CommandsAndArgs {
 int NatController::runCmd(int argc, const char **argv) {
     int res;
 
-    res = android_fork_execvp(argc, (char **)argv, NULL, false, false);
+    // argv[0] is always IPTABLES_PATH, and the command may be padded with NULLs.
+    int count = 1;
+    while (count < argc && argv[count]) {
+        count++;
+    }
+    res = execIptablesArgv(V4, false, count - 1, argv + 1);
 
 #if !LOG_NDEBUG
     std::string full_cmd = argv[0];
@@ -84,22 +90,12 @@ int NatController::setupIptablesHooks() {
 
     struct CommandsAndArgs defaultCommands[] = {
         /*
-         * First chain is for tethering counters.
+         * This chain is for tethering counters.
          * This chain is reached via --goto, and then RETURNS.
-         *
-         * Second chain is used to limit downstream mss to the upstream pmtu
-         * so we don't end up fragmenting every large packet tethered devices
-         * send.  Note this feature requires kernel support with flag
-         * CONFIG_NETFILTER_XT_TARGET_TCPMSS=y, which not all builds will have,
-         * so the final rule is allowed to fail.
-         * Bug 17629786 asks to make the failure more obvious, or even fatal
-         * so that all builds eventually gain the performance improvement.
          */
         {{IPTABLES_PATH, "-F", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
         {{IPTABLES_PATH, "-X", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
         {{IPTABLES_PATH, "-N", LOCAL_TETHER_COUNTERS_CHAIN,}, 1},
-        {{IPTABLES_PATH, "-t", "mangle", "-A", LOCAL_MANGLE_FORWARD, "-p", "tcp", "--tcp-flags",
-                "SYN", "SYN", "-j", "TCPMSS", "--clamp-mss-to-pmtu"}, 0},
     };
     for (unsigned int cmdNum = 0; cmdNum < ARRAY_SIZE(defaultCommands); cmdNum++) {
         if (runCmd(ARRAY_SIZE(defaultCommands[cmdNum].cmd), defaultCommands[cmdNum].cmd) &&
@@ -107,11 +103,53 @@ int NatController::setupIptablesHooks() {
                 return -1;
         }
     }
+    addMssClampingRule();
     ifacePairList.clear();
 
     return 0;
 }
 
+void NatController::addIptablesHooks(IptablesTarget family, RuleTransaction* transaction) {
+    // All the rules are IPv4 only, like the ones of setupIptablesHooks().
+    if (family != V4) {
+        return;
+    }
+    // setDefaults(). The chains it flushes were just recreated, so only the DROP rule is needed.
+    transaction->add((std::string("-w -A ") + LOCAL_FORWARD + " -j DROP").c_str());
+
+    // The tether counters chain isn't a top-level chain, so it may be left over from a previous run.
+    std::vector<std::string> chains = ShadowRuleStore::listChains(V4, "filter",
+                                                                  LOCAL_TETHER_COUNTERS_CHAIN);
+    for (size_t i = 0; i < chains.size(); i++) {
+        if (chains[i] == LOCAL_TETHER_COUNTERS_CHAIN) {
+            transaction->add((std::string("-w -F ") + LOCAL_TETHER_COUNTERS_CHAIN).c_str());
+            transaction->add((std::string("-w -X ") + LOCAL_TETHER_COUNTERS_CHAIN).c_str());
+        }
+    }
+    transaction->add((std::string("-w -N ") + LOCAL_TETHER_COUNTERS_CHAIN).c_str());
+}
+
+void NatController::finishIptablesHooks() {
+    addMssClampingRule();
+    natCount = 0;
+    ifacePairList.clear();
+}
+
+/*
+ * Limits downstream mss to the upstream pmtu, so we don't end up fragmenting every large packet
+ * tethered devices send. This needs kernel support (CONFIG_NETFILTER_XT_TARGET_TCPMSS=y), which not
+ * all builds have, so it's allowed to fail.
+ * Bug 17629786 asks to make the failure more obvious, or even fatal
+ * so that all builds eventually gain the performance improvement.
+ */
+void NatController::addMssClampingRule() {
+    const char* cmd[] = {
+        IPTABLES_PATH, "-t", "mangle", "-A", LOCAL_MANGLE_FORWARD, "-p", "tcp", "--tcp-flags",
+        "SYN", "SYN", "-j", "TCPMSS", "--clamp-mss-to-pmtu"
+    };
+    runCmd(ARRAY_SIZE(cmd), cmd);
+}
+
 int NatController::setDefaults() {
     /*
      * The following only works because:
@@ -224,64 +262,39 @@ bool NatController::checkTetherCountingRuleExist(const char *pair_name) {
     return false;
 }
 
-int NatController::setTetherCountingRules(bool add, const char *intIface, const char *extIface) {
-
-    /* We only ever add tethering quota rules so that they stick. */
-    if (!add) {
-        return 0;
-    }
-    char *pair_name;
-    asprintf(&pair_name, "%s_%s", intIface, extIface);
-
-    if (checkTetherCountingRuleExist(pair_name)) {
-        free(pair_name);
-        return 0;
-    }
-    const char *cmd2b[] = {
-            IPTABLES_PATH,
-            "-A",
-            LOCAL_TETHER_COUNTERS_CHAIN,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-j",
-          "RETURN"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd2b), cmd2b) && add) {
-        free(pair_name);
-        return -1;
-    }
-    ifacePairList.push_front(pair_name);
-    free(pair_name);
-
-    asprintf(&pair_name, "%s_%s", extIface, intIface);
-    if (checkTetherCountingRuleExist(pair_name)) {
-        free(pair_name);
-        return 0;
-    }
-
-    const char *cmd3b[] = {
-            IPTABLES_PATH,
-            "-A",
-            LOCAL_TETHER_COUNTERS_CHAIN,
-            "-i",
-            extIface,
-            "-o",
-            intIface,
-            "-j",
-            "RETURN"
+/*
+ * We only ever add tethering quota rules so that they stick.
+ * The names of the interface pairs whose rules got queued are returned in pairNames, to be
+ * remembered once the transaction has been committed.
+ */
+void NatController::addTetherCountingRules(RuleTransaction *transaction, const char *intIface,
+                                           const char *extIface,
+                                           std::list<std::string> *pairNames) {
+    const char *ifacePairs[][2] = {
+        { intIface, extIface },
+        { extIface, intIface },
     };
 
-    if (runCmd(ARRAY_SIZE(cmd3b), cmd3b) && add) {
-        // unwind what's been done, but don't care about success - what more could we do?
+    for (unsigned int i = 0; i < ARRAY_SIZE(ifacePairs); i++) {
+        char *pair_name;
+        asprintf(&pair_name, "%s_%s", ifacePairs[i][0], ifacePairs[i][1]);
+
+        if (!checkTetherCountingRuleExist(pair_name)) {
+            const char *cmd[] = {
+                    "-A",
+                    LOCAL_TETHER_COUNTERS_CHAIN,
+                    "-i",
+                    ifacePairs[i][0],
+                    "-o",
+                    ifacePairs[i][1],
+                    "-j",
+                    "RETURN"
+            };
+            transaction->add(ARRAY_SIZE(cmd), cmd);
+            pairNames->push_back(pair_name);
+        }
         free(pair_name);
-        return -1;
     }
-    ifacePairList.push_front(pair_name);
-    free(pair_name);
-    return 0;
 }
 
 int NatController::setForwardRules(bool add, const char *intIface, const char *extIface) {
@@ -300,11 +313,6 @@ int NatController::setForwardRules(bool add, const char *intIface, const char *e
             "-g",
             LOCAL_TETHER_COUNTERS_CHAIN
     };
-    int rc = 0;
-
-    if (runCmd(ARRAY_SIZE(cmd1), cmd1) && add) {
-        return -1;
-    }
 
     const char *cmd2[] = {
             IPTABLES_PATH,
@@ -334,32 +342,34 @@ int NatController::setForwardRules(bool add, const char *intIface, const char *e
             LOCAL_TETHER_COUNTERS_CHAIN
     };
 
-    if (runCmd(ARRAY_SIZE(cmd2), cmd2) && add) {
-        // bail on error, but only if adding
-        rc = -1;
-        goto err_invalid_drop;
+    if (!add) {
+        runCmd(ARRAY_SIZE(cmd1), cmd1);
+        runCmd(ARRAY_SIZE(cmd2), cmd2);
+        runCmd(ARRAY_SIZE(cmd3), cmd3);
+        return 0;
     }
 
-    if (runCmd(ARRAY_SIZE(cmd3), cmd3) && add) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        rc = -1;
-        goto err_return;
-    }
+    /*
+     * The forwarding rules only make sense together with the counting rules they jump to, so
+     * apply all of them as a single transaction rather than unwinding by hand on failure.
+     */
+    RuleTransaction transaction(V4);
+    transaction.add(ARRAY_SIZE(cmd1) - 1, cmd1 + 1);
+    transaction.add(ARRAY_SIZE(cmd2) - 1, cmd2 + 1);
+    transaction.add(ARRAY_SIZE(cmd3) - 1, cmd3 + 1);
+
+    std::list<std::string> pairNames;
+    addTetherCountingRules(&transaction, intIface, extIface, &pairNames);
 
-    if (setTetherCountingRules(add, intIface, extIface) && add) {
-        rc = -1;
-        goto err_return;
+    if (transaction.commit()) {
+        return -1;
     }
 
+    std::list<std::string>::iterator it;
+    for (it = pairNames.begin(); it != pairNames.end(); it++) {
+        ifacePairList.push_front(*it);
+    }
     return 0;
-
-err_return:
-    cmd2[1] = "-D";
-    runCmd(ARRAY_SIZE(cmd2), cmd2);
-err_invalid_drop:
-    cmd1[1] = "-D";
-    runCmd(ARRAY_SIZE(cmd1), cmd1);
-    return rc;
 }
 
 int NatController::disableNat(const char* intIface, const char* extIface) {
@@ -21,6 +21,10 @@
 #include <list>
 #include <string>
 
+#include "NetdConstants.h"
+
+class RuleTransaction;
+
 class NatController {
 public:
     NatController();
@@ -30,6 +34,14 @@ public:
     int disableNat(const char* intIface, const char* extIface);
     int setupIptablesHooks();
 
+    // For setting up the hooks of all modules at once at boot, instead of setupIptablesHooks().
+    // addIptablesHooks() queues the rules it would create for |family| on |transaction|, which must
+    // also recreate the natctrl_ top-level chains empty. finishIptablesHooks() adds the MSS clamping
+    // rule, which is allowed to fail and so can't be part of the transaction, and resets the state,
+    // once the transaction is committed.
+    void addIptablesHooks(IptablesTarget family, RuleTransaction* transaction);
+    void finishIptablesHooks();
+
     static const char* LOCAL_FORWARD;
     static const char* LOCAL_MANGLE_FORWARD;
     static const char* LOCAL_NAT_POSTROUTING;
@@ -44,9 +56,11 @@ private:
     bool checkTetherCountingRuleExist(const char *pair_name);
 
     int setDefaults();
+    void addMssClampingRule();
     int runCmd(int argc, const char **argv);
     int setForwardRules(bool set, const char *intIface, const char *extIface);
-    int setTetherCountingRules(bool add, const char *intIface, const char *extIface);
+    void addTetherCountingRules(RuleTransaction *transaction, const char *intIface,
+                                const char *extIface, std::list<std::string> *pairNames);
 };
 
 #endif
@@ -28,7 +28,9 @@
 #include <cutils/log.h>
 #include <logwrap/logwrap.h>
 
+#include "IptablesRestoreController.h"
 #include "NetdConstants.h"
+#include "ShadowRuleStore.h"
 
 const char * const OEM_SCRIPT_PATH = "/system/bin/oem-iptables-init.sh";
 const char * const IPTABLES_PATH = "/system/bin/iptables";
@@ -67,33 +69,85 @@ static int execIptablesCommand(int argc, const char *argv[], bool silent) {
     return WEXITSTATUS(status);
 }
 
+static int forkIptables(IptablesTarget family, bool silent, int argc, const char* args[]) {
+    const char* argv[argc + 2];
+    argv[0] = (family == V4) ? IPTABLES_PATH : IP6TABLES_PATH;
+    for (int i = 0; i < argc; i++) {
+        argv[i + 1] = args[i];
+    }
+    argv[argc + 1] = NULL;
+    return execIptablesCommand(argc + 2, argv, silent);
+}
+
+int execIptablesArgv(IptablesTarget target, bool silent, int argc, const char* args[]) {
+    bool apply[] = { false, false };  // Indexed by V4, V6.
+    int res = 0;
+    for (int family = V4; family <= V6; ++family) {
+        if (target != family && target != V4V6) {
+            continue;
+        }
+        // Don't bother the kernel with commands that the shadow rule store knows change nothing.
+        switch (ShadowRuleStore::check(static_cast<IptablesTarget>(family), argc, args)) {
+            case ShadowRuleStore::SKIP_SUCCESS:
+                break;
+            case ShadowRuleStore::APPLY:
+                apply[family] = true;
+                break;
+        }
+    }
+    if (!apply[V4] && !apply[V6]) {
+        return res;
+    }
+
+    // Prefer the persistent iptables-restore processes, which apply both families concurrently,
+    // and only fork/exec if the command can't be expressed in restore format or the restore
+    // backend isn't available.
+    int results[] = { 0, 0 };
+    bool restored = false;
+    std::string commands;
+    if (IptablesRestoreController::toRestoreCommands(argc, args, &commands)) {
+        IptablesTarget families = (apply[V4] && apply[V6]) ? V4V6 : (apply[V4] ? V4 : V6);
+        restored = IptablesRestoreController::execute(families, commands, silent, &results[V4],
+                                                      &results[V6]) == 0;
+    }
+
+    for (int family = V4; family <= V6; ++family) {
+        if (!apply[family]) {
+            continue;
+        }
+        int ret;
+        if (restored) {
+            // Callers expect an exit status, not an errno.
+            ret = results[family] ? 1 : 0;
+        } else {
+            ret = forkIptables(static_cast<IptablesTarget>(family), silent, argc, args);
+        }
+        if (!ret) {
+            ShadowRuleStore::update(static_cast<IptablesTarget>(family), argc, args);
+        } else {
+            ShadowRuleStore::recordFailure(static_cast<IptablesTarget>(family), argc, args);
+        }
+        res |= ret;
+    }
+    return res;
+}
+
 static int execIptables(IptablesTarget target, bool silent, va_list args) {
     /* Read arguments from incoming va_list; we expect the list to be NULL terminated. */
     std::list<const char*> argsList;
-    argsList.push_back(NULL);
     const char* arg;
-    do {
-        arg = va_arg(args, const char *);
+    while ((arg = va_arg(args, const char *))) {
         argsList.push_back(arg);
-    } while (arg);
+    }
 
     int i = 0;
-    const char* argv[argsList.size()];
+    const char* argv[argsList.size() + 1];
     std::list<const char*>::iterator it;
     for (it = argsList.begin(); it != argsList.end(); it++, i++) {
         argv[i] = *it;
     }
 
-    int res = 0;
-    if (target == V4 || target == V4V6) {
-        argv[0] = IPTABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
-    }
-    if (target == V6 || target == V4V6) {
-        argv[0] = IP6TABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
-    }
-    return res;
+    return execIptablesArgv(target, silent, argsList.size(), argv);
 }
 
 int execIptables(IptablesTarget target, ...) {
@@ -35,6 +35,8 @@ enum IptablesTarget { V4, V6, V4V6 };
 
 int execIptables(IptablesTarget target, ...);
 int execIptablesSilently(IptablesTarget target, ...);
+// Same as execIptables(), with the arguments (not including the iptables binary) in an array.
+int execIptablesArgv(IptablesTarget target, bool silent, int argc, const char* argv[]);
 int writeFile(const char *path, const char *value, int size);
 int readFile(const char *path, char *buf, int *sizep);
 bool isIfaceName(const char *name);
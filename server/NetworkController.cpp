@@ -29,10 +29,15 @@
 //     2. Only CommandListener calls these non-const methods. The others call only const methods.
 //     3. CommandListener only processes one command at a time. I.e., it's serialized.
 // Thus, no other mutation can occur in between the two statements above.
+//
+// The lookups on the path of every connect() and DNS query don't take the lock at all. They read a
+// Snapshot, which is never modified once published; a writer publishes a new one (see
+// SnapshotPublisher) and waits for the readers of the old one to finish before freeing it.
 
 #include "NetworkController.h"
 
 #include "Fwmark.h"
+#include "FwmarkCommand.h"
 #include "LocalNetwork.h"
 #include "PhysicalNetwork.h"
 #include "RouteController.h"
@@ -43,12 +48,25 @@
 #include "log/log.h"
 #include "resolv_netid.h"
 
+#include <algorithm>
+#include <iterator>
+#include <sched.h>
+#include <unistd.h>
+
 namespace {
 
 // Keep these in sync with ConnectivityService.java.
 const unsigned MIN_NET_ID = 100;
 const unsigned MAX_NET_ID = 65535;
 
+// Returns |uids| sorted and without duplicates, ready to be merged into a sorted table.
+std::vector<uid_t> sortUids(const std::vector<uid_t>& uids) {
+    std::vector<uid_t> sortedUids(uids);
+    std::sort(sortedUids.begin(), sortedUids.end());
+    sortedUids.erase(std::unique(sortedUids.begin(), sortedUids.end()), sortedUids.end());
+    return sortedUids;
+}
+
 }  // namespace
 
 const unsigned NetworkController::MIN_OEM_ID   =  1;
@@ -129,23 +147,274 @@ int NetworkController::DelegateImpl::modifyFallthrough(const std::string& physic
     return 0;
 }
 
+// A copy of the state needed by the lock-free lookups.
+struct NetworkController::Snapshot {
+    struct NetworkInfo {
+        NetworkInfo() : permission(PERMISSION_NONE), hasDns(false), secure(false) {}
+
+        Network::Type type;
+        Permission permission;  // Only for physical networks.
+        bool hasDns;            // Only for virtual networks.
+        bool secure;            // Only for virtual networks.
+        UidRanges uidRanges;    // Only for virtual networks.
+    };
+
+    // UIDs |first| to |last| (inclusive) are subject to the VPN with NetId |netId|.
+    struct VpnUidRange {
+        uid_t first;
+        uid_t last;
+        unsigned netId;
+    };
+
+    const NetworkInfo* getNetwork(unsigned netId) const;
+    // Returns the NetId of the VPN that applies to |uid|, or NETID_UNSET if there is none.
+    unsigned getVirtualNetworkForUser(uid_t uid) const;
+    unsigned getNetworkForUser(uid_t uid) const;
+    unsigned getNetworkForConnect(uid_t uid) const;
+    bool isVirtualNetwork(unsigned netId) const;
+    Permission getPermissionForUser(uid_t uid) const;
+    int checkUserNetworkAccess(uid_t uid, unsigned netId) const;
+    bool canProtect(uid_t uid) const;
+
+    // Fills in |vpnUidRanges| from the UID ranges of the virtual networks in |networks|.
+    void indexVpnUidRanges();
+
+    unsigned defaultNetId;
+    std::map<unsigned, NetworkInfo> networks;  // Map keys are NetIds.
+    std::vector<std::pair<uid_t, Permission>> users;  // Sorted by UID.
+    std::vector<uid_t> protectableUsers;              // Sorted.
+    // Sorted and disjoint. If several VPNs apply to a UID, only the one with the lowest NetId is
+    // listed, since that is the one that getVirtualNetworkForUser() has always picked.
+    std::vector<VpnUidRange> vpnUidRanges;
+};
+
+const NetworkController::Snapshot::NetworkInfo* NetworkController::Snapshot::getNetwork(
+        unsigned netId) const {
+    auto iter = networks.find(netId);
+    return iter == networks.end() ? NULL : &iter->second;
+}
+
+unsigned NetworkController::Snapshot::getVirtualNetworkForUser(uid_t uid) const {
+    // Find the last range that starts at or before |uid|.
+    auto iter = std::upper_bound(vpnUidRanges.begin(), vpnUidRanges.end(), uid,
+                                 [](uid_t value, const VpnUidRange& range) {
+                                     return value < range.first;
+                                 });
+    if (iter == vpnUidRanges.begin()) {
+        return NETID_UNSET;
+    }
+    --iter;
+    return uid <= iter->last ? iter->netId : NETID_UNSET;
+}
+
+// Returns the NetId that a given UID would use if no network is explicitly selected. Specifically,
+// the VPN that applies to the UID if any; otherwise, the default network.
+unsigned NetworkController::Snapshot::getNetworkForUser(uid_t uid) const {
+    unsigned vpnNetId = getVirtualNetworkForUser(uid);
+    if (vpnNetId != NETID_UNSET) {
+        return vpnNetId;
+    }
+    return defaultNetId;
+}
+
+// Returns the NetId that will be set when a socket connect()s. This is the bypassable VPN that
+// applies to the user if any; otherwise, the default network.
+//
+// In general, we prefer to always set the default network's NetId in connect(), so that if the VPN
+// is a split-tunnel and disappears later, the socket continues working (since the default network's
+// NetId is still valid). Secure VPNs will correctly grab the socket's traffic since they have a
+// high-priority routing rule that doesn't care what NetId the socket has.
+//
+// But bypassable VPNs have a very low priority rule, so we need to mark the socket with the
+// bypassable VPN's NetId if we expect it to get any traffic at all. If the bypassable VPN is a
+// split-tunnel, that's okay, because we have fallthrough rules that will direct the fallthrough
+// traffic to the default network. But it does mean that if the bypassable VPN goes away (and thus
+// the fallthrough rules also go away), the socket that used to fallthrough to the default network
+// will stop working.
+unsigned NetworkController::Snapshot::getNetworkForConnect(uid_t uid) const {
+    unsigned vpnNetId = getVirtualNetworkForUser(uid);
+    const NetworkInfo* virtualNetwork = getNetwork(vpnNetId);
+    if (virtualNetwork && !virtualNetwork->secure) {
+        return vpnNetId;
+    }
+    return defaultNetId;
+}
+
+bool NetworkController::Snapshot::isVirtualNetwork(unsigned netId) const {
+    const NetworkInfo* network = getNetwork(netId);
+    return network && network->type == Network::VIRTUAL;
+}
+
+void NetworkController::Snapshot::indexVpnUidRanges() {
+    // Maps the first UID of each range to its last UID and NetId. Networks are visited in NetId
+    // order, and each only gets the UIDs that no earlier network has taken.
+    std::map<uid_t, std::pair<uid_t, unsigned>> ranges;
+    for (const auto& entry : networks) {
+        if (entry.second.type != Network::VIRTUAL) {
+            continue;
+        }
+        for (const UidRanges::Range& range : entry.second.uidRanges.getRanges()) {
+            // The first UID of |range| not covered yet. 64 bits, so that it can go past the end.
+            uint64_t next = range.first;
+            auto iter = ranges.upper_bound(range.first);
+            if (iter != ranges.begin()) {
+                auto previous = std::prev(iter);
+                if (previous->second.first >= range.first) {
+                    next = static_cast<uint64_t>(previous->second.first) + 1;
+                }
+            }
+            while (next <= range.second) {
+                if (iter == ranges.end() || iter->first > range.second) {
+                    ranges[next] = std::make_pair(range.second, entry.first);
+                    break;
+                }
+                if (iter->first > next) {
+                    ranges[next] = std::make_pair(iter->first - 1, entry.first);
+                }
+                next = static_cast<uint64_t>(iter->second.first) + 1;
+                ++iter;
+            }
+        }
+    }
+
+    vpnUidRanges.clear();
+    for (const auto& entry : ranges) {
+        if (!vpnUidRanges.empty() && vpnUidRanges.back().netId == entry.second.second &&
+                static_cast<uint64_t>(vpnUidRanges.back().last) + 1 == entry.first) {
+            vpnUidRanges.back().last = entry.second.first;
+            continue;
+        }
+        VpnUidRange range = { entry.first, entry.second.first, entry.second.second };
+        vpnUidRanges.push_back(range);
+    }
+}
+
+Permission NetworkController::Snapshot::getPermissionForUser(uid_t uid) const {
+    auto iter = std::lower_bound(users.begin(), users.end(), uid,
+                                 [](const std::pair<uid_t, Permission>& user, uid_t value) {
+                                     return user.first < value;
+                                 });
+    if (iter != users.end() && iter->first == uid) {
+        return iter->second;
+    }
+    return uid < FIRST_APPLICATION_UID ? PERMISSION_SYSTEM : PERMISSION_NONE;
+}
+
+int NetworkController::Snapshot::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
+    const NetworkInfo* network = getNetwork(netId);
+    if (!network) {
+        return -ENONET;
+    }
+
+    // If uid is INVALID_UID, this likely means that we were unable to retrieve the UID of the peer
+    // (using SO_PEERCRED). Be safe and deny access to the network, even if it's valid.
+    if (uid == INVALID_UID) {
+        return -EREMOTEIO;
+    }
+    Permission userPermission = getPermissionForUser(uid);
+    if ((userPermission & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
+        return 0;
+    }
+    if (network->type == Network::VIRTUAL) {
+        return network->uidRanges.hasUid(uid) ? 0 : -EPERM;
+    }
+    const NetworkInfo* virtualNetwork = getNetwork(getVirtualNetworkForUser(uid));
+    if (virtualNetwork && virtualNetwork->secure &&
+            !std::binary_search(protectableUsers.begin(), protectableUsers.end(), uid)) {
+        return -EPERM;
+    }
+    Permission networkPermission = network->permission;
+    return ((userPermission & networkPermission) == networkPermission) ? 0 : -EACCES;
+}
+
+bool NetworkController::Snapshot::canProtect(uid_t uid) const {
+    return ((getPermissionForUser(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
+           std::binary_search(protectableUsers.begin(), protectableUsers.end(), uid);
+}
+
+// Gives access to the current snapshot for as long as it's alive, without taking any lock.
+class NetworkController::SnapshotReader {
+public:
+    explicit SnapshotReader(const NetworkController* networkController);
+    ~SnapshotReader();
+
+    const Snapshot* operator->() const { return mSnapshot; }
+
+private:
+    std::atomic<unsigned>* mReaderCount;
+    const Snapshot* mSnapshot;
+};
+
+NetworkController::SnapshotReader::SnapshotReader(const NetworkController* networkController) {
+    // Threads are spread over the slots so that they rarely write to the same cache line.
+    unsigned slot = static_cast<unsigned>(gettid()) % SNAPSHOT_READER_SLOTS;
+    while (true) {
+        unsigned generation = networkController->mSnapshotGeneration.load();
+        mReaderCount = &networkController->mSnapshotReaders[generation % 2][slot].count;
+        mReaderCount->fetch_add(1);
+        // Once registered in a generation that's still current, any writer that replaces the
+        // snapshot loaded below waits for this reader before freeing it. If a writer moved to the
+        // next generation in the meantime, it might not, so register again.
+        if (networkController->mSnapshotGeneration.load() == generation) {
+            break;
+        }
+        mReaderCount->fetch_sub(1);
+    }
+    mSnapshot = networkController->mSnapshot.load();
+}
+
+NetworkController::SnapshotReader::~SnapshotReader() {
+    mReaderCount->fetch_sub(1);
+}
+
+// Publishes a new snapshot when it goes out of scope, even if the change it covers failed halfway.
+// Must be created after taking the write lock, so that it's destroyed before releasing it.
+class NetworkController::SnapshotPublisher {
+public:
+    explicit SnapshotPublisher(NetworkController* networkController) :
+            mNetworkController(networkController) {}
+    ~SnapshotPublisher() { mNetworkController->publishSnapshotLocked(); }
+
+private:
+    NetworkController* const mNetworkController;
+};
+
 NetworkController::NetworkController() :
-        mDelegateImpl(new NetworkController::DelegateImpl(this)), mDefaultNetId(NETID_UNSET) {
+        mDelegateImpl(new NetworkController::DelegateImpl(this)), mDefaultNetId(NETID_UNSET),
+        mSnapshot(NULL), mSnapshotGeneration(0) {
+    for (auto& generation : mSnapshotReaders) {
+        for (ReaderCount& readerCount : generation) {
+            readerCount.count = 0;
+        }
+    }
+    android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     mNetworks[LOCAL_NET_ID] = new LocalNetwork(LOCAL_NET_ID);
 }
 
 unsigned NetworkController::getDefaultNetwork() const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return mDefaultNetId;
+    SnapshotReader snapshot(this);
+    return snapshot->defaultNetId;
 }
 
 int NetworkController::setDefaultNetwork(unsigned netId) {
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
 
     if (netId == mDefaultNetId) {
         return 0;
     }
 
+    // Send the rule changes to the kernel in two batches. The new default network's rules are
+    // added before the old one's are deleted. Since rules of the same priority are evaluated in the
+    // order they were added, the old network keeps matching until its rules are gone, and the new
+    // one matches right after, so there's no window without a default network. The additions are
+    // committed by themselves, because the kernel carries out every request of a batch even if an
+    // earlier one fails, and the old network must keep its rules if the new one couldn't be added.
+    // Either way, a batch that fails half-way is cleaned up, so that only one network is left with
+    // default network rules.
+    RouteController::Batch batch;
+
     if (netId != NETID_UNSET) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -156,7 +425,17 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
             ALOGE("cannot set default to non-physical network with netId %u", netId);
             return -EINVAL;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->addAsDefault()) {
+        PhysicalNetwork* physicalNetwork = static_cast<PhysicalNetwork*>(network);
+        if (int ret = physicalNetwork->addAsDefault()) {
+            return ret;
+        }
+        if (int ret = batch.commit()) {
+            ALOGE("failed to add netId %u as the default network", netId);
+            // Delete the rules that did go in, or adding them again later would fail.
+            if (physicalNetwork->removeAsDefault() || batch.commitIgnoringMissing()) {
+                ALOGE("netId %u may have default network rules left over", netId);
+            }
+            physicalNetwork->restoreIsDefault(false);
             return ret;
         }
     }
@@ -167,9 +446,27 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
             ALOGE("cannot find previously set default network with netId %u", mDefaultNetId);
             return -ESRCH;
         }
-        if (int ret = static_cast<PhysicalNetwork*>(network)->removeAsDefault()) {
-            return ret;
+        PhysicalNetwork* physicalNetwork = static_cast<PhysicalNetwork*>(network);
+        int ret = physicalNetwork->removeAsDefault();
+        if (!ret) {
+            ret = batch.commit();
+        }
+        if (ret) {
+            // The new network is the default already, so the old one can't stay one. Try the
+            // deletions once more, this time skipping the rules that are already gone.
+            ALOGE("failed to remove netId %u as the default network, retrying", mDefaultNetId);
+            physicalNetwork->restoreIsDefault(true);
+            ret = physicalNetwork->removeAsDefault();
+            if (!ret) {
+                ret = batch.commitIgnoringMissing();
+            }
+            if (ret) {
+                ALOGE("netId %u may have default network rules left over", mDefaultNetId);
+            }
+            physicalNetwork->restoreIsDefault(false);
         }
+        mDefaultNetId = netId;
+        return ret;
     }
 
     mDefaultNetId = netId;
@@ -177,11 +474,11 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
 }
 
 uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
+    SnapshotReader snapshot(this);
     Fwmark fwmark;
     fwmark.protectedFromVpn = true;
     fwmark.permission = PERMISSION_SYSTEM;
-    if (checkUserNetworkAccessLocked(uid, *netId) == 0) {
+    if (snapshot->checkUserNetworkAccess(uid, *netId) == 0) {
         // If a non-zero NetId was explicitly specified, and the user has permission for that
         // network, use that network's DNS servers. Do not fall through to the default network even
         // if the explicitly selected network is a split tunnel VPN or a VPN without DNS servers.
@@ -190,48 +487,26 @@ uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
         // If the user is subject to a VPN and the VPN provides DNS servers, use those servers
         // (possibly falling through to the default network if the VPN doesn't provide a route to
         // them). Otherwise, use the default network's DNS servers.
-        VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-        if (virtualNetwork && virtualNetwork->getHasDns()) {
-            *netId = virtualNetwork->getNetId();
+        unsigned vpnNetId = snapshot->getVirtualNetworkForUser(uid);
+        const Snapshot::NetworkInfo* virtualNetwork = snapshot->getNetwork(vpnNetId);
+        if (virtualNetwork && virtualNetwork->hasDns) {
+            *netId = vpnNetId;
         } else {
-            *netId = mDefaultNetId;
+            *netId = snapshot->defaultNetId;
         }
     }
     fwmark.netId = *netId;
     return fwmark.intValue;
 }
 
-// Returns the NetId that a given UID would use if no network is explicitly selected. Specifically,
-// the VPN that applies to the UID if any; otherwise, the default network.
 unsigned NetworkController::getNetworkForUser(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    if (VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid)) {
-        return virtualNetwork->getNetId();
-    }
-    return mDefaultNetId;
+    SnapshotReader snapshot(this);
+    return snapshot->getNetworkForUser(uid);
 }
 
-// Returns the NetId that will be set when a socket connect()s. This is the bypassable VPN that
-// applies to the user if any; otherwise, the default network.
-//
-// In general, we prefer to always set the default network's NetId in connect(), so that if the VPN
-// is a split-tunnel and disappears later, the socket continues working (since the default network's
-// NetId is still valid). Secure VPNs will correctly grab the socket's traffic since they have a
-// high-priority routing rule that doesn't care what NetId the socket has.
-//
-// But bypassable VPNs have a very low priority rule, so we need to mark the socket with the
-// bypassable VPN's NetId if we expect it to get any traffic at all. If the bypassable VPN is a
-// split-tunnel, that's okay, because we have fallthrough rules that will direct the fallthrough
-// traffic to the default network. But it does mean that if the bypassable VPN goes away (and thus
-// the fallthrough rules also go away), the socket that used to fallthrough to the default network
-// will stop working.
 unsigned NetworkController::getNetworkForConnect(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && !virtualNetwork->isSecure()) {
-        return virtualNetwork->getNetId();
-    }
-    return mDefaultNetId;
+    SnapshotReader snapshot(this);
+    return snapshot->getNetworkForConnect(uid);
 }
 
 unsigned NetworkController::getNetworkForInterface(const char* interface) const {
@@ -245,9 +520,118 @@ unsigned NetworkController::getNetworkForInterface(const char* interface) const
 }
 
 bool NetworkController::isVirtualNetwork(unsigned netId) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    Network* network = getNetworkLocked(netId);
-    return network && network->getType() == Network::VIRTUAL;
+    SnapshotReader snapshot(this);
+    return snapshot->isVirtualNetwork(netId);
+}
+
+int NetworkController::resolveFwmark(uid_t uid, const FwmarkCommand& command,
+                                     Fwmark* fwmark) const {
+    SnapshotReader snapshot(this);
+    Permission permission = snapshot->getPermissionForUser(uid);
+
+    switch (command.cmdId) {
+        case FwmarkCommand::ON_ACCEPT: {
+            // Called after a socket accept(). The kernel would've marked the NetId and necessary
+            // permissions bits, so we just add the rest of the user's permissions here.
+            permission = static_cast<Permission>(permission | fwmark->permission);
+            break;
+        }
+
+        case FwmarkCommand::ON_CONNECT: {
+            // Called before a socket connect() happens. Set an appropriate NetId into the fwmark so
+            // that the socket routes consistently over that network. Do this even if the socket
+            // already has a NetId, so that calling connect() multiple times still works.
+            //
+            // But if the explicit bit was set, the existing NetId was explicitly preferred (and not
+            // a case of connect() being called multiple times). Don't reset the NetId in that case.
+            //
+            // An "appropriate" NetId is the NetId of a bypassable VPN that applies to the user, or
+            // failing that, the default network. We'll never set the NetId of a secure VPN here.
+            // See the comments in the implementation of getNetworkForConnect() for more details.
+            //
+            // If the protect bit is set, this could be either a system proxy (e.g.: the dns proxy
+            // or the download manager) acting on behalf of another user, or a VPN provider. If it's
+            // a proxy, we shouldn't reset the NetId. If it's a VPN provider, we should set the
+            // default network's NetId.
+            //
+            // There's no easy way to tell the difference between a proxy and a VPN app. We can't
+            // use PERMISSION_SYSTEM to identify the proxy because a VPN app may also have those
+            // permissions. So we use the following heuristic:
+            //
+            // If it's a proxy, but the existing NetId is not a VPN, that means the user (that the
+            // proxy is acting on behalf of) is not subject to a VPN, so the proxy must have picked
+            // the default network's NetId. So, it's okay to replace that with the current default
+            // network's NetId (which in all likelihood is the same).
+            //
+            // Conversely, if it's a VPN provider, the existing NetId cannot be a VPN. The only time
+            // we set a VPN's NetId into a socket without setting the explicit bit is here, in
+            // ON_CONNECT, but we won't do that if the socket has the protect bit set. If the VPN
+            // provider connect()ed (and got the VPN NetId set) and then called protect(), we
+            // would've unset the NetId in PROTECT_FROM_VPN below.
+            //
+            // So, overall (when the explicit bit is not set but the protect bit is set), if the
+            // existing NetId is a VPN, don't reset it. Else, set the default network's NetId.
+            if (!fwmark->explicitlySelected) {
+                if (!fwmark->protectedFromVpn) {
+                    fwmark->netId = snapshot->getNetworkForConnect(uid);
+                } else if (!snapshot->isVirtualNetwork(fwmark->netId)) {
+                    fwmark->netId = snapshot->defaultNetId;
+                }
+            }
+            break;
+        }
+
+        case FwmarkCommand::SELECT_NETWORK: {
+            fwmark->netId = command.netId;
+            if (command.netId == NETID_UNSET) {
+                fwmark->explicitlySelected = false;
+                fwmark->protectedFromVpn = false;
+                permission = PERMISSION_NONE;
+            } else {
+                if (int ret = snapshot->checkUserNetworkAccess(uid, command.netId)) {
+                    return ret;
+                }
+                fwmark->explicitlySelected = true;
+                fwmark->protectedFromVpn = snapshot->canProtect(uid);
+            }
+            break;
+        }
+
+        case FwmarkCommand::PROTECT_FROM_VPN: {
+            if (!snapshot->canProtect(uid)) {
+                return -EPERM;
+            }
+            // If a bypassable VPN's provider app calls connect() and then protect(), it will end up
+            // with a socket that looks like that of a system proxy but is not (see comments for
+            // ON_CONNECT above). So, reset the NetId.
+            //
+            // In any case, it's appropriate that if the socket has an implicit VPN NetId mark, the
+            // PROTECT_FROM_VPN command should unset it.
+            if (!fwmark->explicitlySelected && snapshot->isVirtualNetwork(fwmark->netId)) {
+                fwmark->netId = snapshot->defaultNetId;
+            }
+            fwmark->protectedFromVpn = true;
+            permission = static_cast<Permission>(permission | fwmark->permission);
+            break;
+        }
+
+        case FwmarkCommand::SELECT_FOR_USER: {
+            if ((permission & PERMISSION_SYSTEM) != PERMISSION_SYSTEM) {
+                return -EPERM;
+            }
+            fwmark->netId = snapshot->getNetworkForUser(command.uid);
+            fwmark->protectedFromVpn = true;
+            break;
+        }
+
+        default: {
+            // unknown command
+            return -EPROTO;
+        }
+    }
+
+    fwmark->permission = permission;
+    return 0;
 }
 
 int NetworkController::createPhysicalNetwork(unsigned netId, Permission permission) {
@@ -270,6 +654,7 @@ int NetworkController::createPhysicalNetwork(unsigned netId, Permission permissi
     }
 
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     mNetworks[netId] = physicalNetwork;
     return 0;
 }
@@ -286,6 +671,7 @@ int NetworkController::createVirtualNetwork(unsigned netId, bool hasDns, bool se
     }
 
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     if (int ret = modifyFallthroughLocked(netId, true)) {
         return ret;
     }
@@ -306,6 +692,7 @@ int NetworkController::destroyNetwork(unsigned netId) {
     // TODO: ioctl(SIOCKILLADDR, ...) to kill all sockets on the old network.
 
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     Network* network = getNetworkLocked(netId);
 
     // If we fail to destroy a network, things will get stuck badly. Therefore, unlike most of the
@@ -361,26 +748,42 @@ int NetworkController::removeInterfaceFromNetwork(unsigned netId, const char* in
 }
 
 Permission NetworkController::getPermissionForUser(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return getPermissionForUserLocked(uid);
+    SnapshotReader snapshot(this);
+    return snapshot->getPermissionForUser(uid);
 }
 
 void NetworkController::setPermissionForUsers(Permission permission,
                                               const std::vector<uid_t>& uids) {
+    std::vector<uid_t> sortedUids = sortUids(uids);
+
     android::RWLock::AutoWLock lock(mRWLock);
-    for (uid_t uid : uids) {
-        mUsers[uid] = permission;
+    SnapshotPublisher publisher(this);
+    // Merge the sorted batch into the sorted table in a single pass.
+    std::vector<std::pair<uid_t, Permission>> users;
+    users.reserve(mUsers.size() + sortedUids.size());
+    auto iter = mUsers.begin();
+    for (uid_t uid : sortedUids) {
+        while (iter != mUsers.end() && iter->first < uid) {
+            users.push_back(*iter++);
+        }
+        if (iter != mUsers.end() && iter->first == uid) {
+            ++iter;
+        }
+        users.push_back(std::make_pair(uid, permission));
     }
+    users.insert(users.end(), iter, mUsers.end());
+    mUsers.swap(users);
 }
 
 int NetworkController::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return checkUserNetworkAccessLocked(uid, netId);
+    SnapshotReader snapshot(this);
+    return snapshot->checkUserNetworkAccess(uid, netId);
 }
 
 int NetworkController::setPermissionForNetworks(Permission permission,
                                                 const std::vector<unsigned>& netIds) {
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     for (unsigned netId : netIds) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -403,6 +806,7 @@ int NetworkController::setPermissionForNetworks(Permission permission,
 
 int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRanges) {
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     Network* network = getNetworkLocked(netId);
     if (!network) {
         ALOGE("no such netId %u", netId);
@@ -420,6 +824,7 @@ int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRan
 
 int NetworkController::removeUsersFromNetwork(unsigned netId, const UidRanges& uidRanges) {
     android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
     Network* network = getNetworkLocked(netId);
     if (!network) {
         ALOGE("no such netId %u", netId);
@@ -435,32 +840,104 @@ int NetworkController::removeUsersFromNetwork(unsigned netId, const UidRanges& u
     return 0;
 }
 
+int NetworkController::setUsersForNetwork(unsigned netId, const UidRanges& uidRanges) {
+    android::RWLock::AutoWLock lock(mRWLock);
+    SnapshotPublisher publisher(this);
+    Network* network = getNetworkLocked(netId);
+    if (!network) {
+        ALOGE("no such netId %u", netId);
+        return -ENONET;
+    }
+    if (network->getType() != Network::VIRTUAL) {
+        ALOGE("cannot set users of non-virtual network with netId %u", netId);
+        return -EINVAL;
+    }
+    if (int ret = static_cast<VirtualNetwork*>(network)->setUsers(uidRanges)) {
+        return ret;
+    }
+    return 0;
+}
+
+int NetworkController::getRoutes(unsigned netId, std::vector<std::string>* routes) const {
+    android::RWLock::AutoRLock lock(mRWLock);
+    Network* network = getNetworkLocked(netId);
+    if (!network) {
+        ALOGE("no such netId %u", netId);
+        return -ENONET;
+    }
+    for (const std::string& interface : network->getInterfaces()) {
+        const char* name = interface.c_str();
+        if (netId == LOCAL_NET_ID) {
+            if (int ret = RouteController::getRoutes(name, RouteController::LOCAL_NETWORK, routes)) {
+                return ret;
+            }
+            continue;
+        }
+        if (int ret = RouteController::getRoutes(name, RouteController::INTERFACE, routes)) {
+            return ret;
+        }
+        if (int ret = RouteController::getRoutes(name, RouteController::LEGACY_NETWORK, routes)) {
+            return ret;
+        }
+        if (int ret = RouteController::getRoutes(name, RouteController::LEGACY_SYSTEM, routes)) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 int NetworkController::addRoute(unsigned netId, const char* interface, const char* destination,
-                                const char* nexthop, bool legacy, uid_t uid) {
-    return modifyRoute(netId, interface, destination, nexthop, true, legacy, uid);
+                                const char* nexthop, bool legacy, uid_t uid, uint32_t metric) {
+    return modifyRoute(netId, interface, destination, nexthop, NULL, metric, true, legacy, uid);
 }
 
 int NetworkController::removeRoute(unsigned netId, const char* interface, const char* destination,
-                                   const char* nexthop, bool legacy, uid_t uid) {
-    return modifyRoute(netId, interface, destination, nexthop, false, legacy, uid);
+                                   const char* nexthop, bool legacy, uid_t uid, uint32_t metric) {
+    return modifyRoute(netId, interface, destination, nexthop, NULL, metric, false, legacy, uid);
+}
+
+int NetworkController::addMultipathRoute(unsigned netId, const char* interface,
+                                         const char* destination,
+                                         const std::vector<RouteController::Nexthop>& nexthops,
+                                         bool legacy, uid_t uid, uint32_t metric) {
+    return modifyRoute(netId, interface, destination, NULL, &nexthops, metric, true, legacy, uid);
+}
+
+int NetworkController::removeMultipathRoute(unsigned netId, const char* interface,
+                                            const char* destination,
+                                            const std::vector<RouteController::Nexthop>& nexthops,
+                                            bool legacy, uid_t uid, uint32_t metric) {
+    return modifyRoute(netId, interface, destination, NULL, &nexthops, metric, false, legacy,
+                       uid);
 }
 
 bool NetworkController::canProtect(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
-           mProtectableUsers.find(uid) != mProtectableUsers.end();
+    SnapshotReader snapshot(this);
+    return snapshot->canProtect(uid);
 }
 
 void NetworkController::allowProtect(const std::vector<uid_t>& uids) {
+    std::vector<uid_t> sortedUids = sortUids(uids);
+
     android::RWLock::AutoWLock lock(mRWLock);
-    mProtectableUsers.insert(uids.begin(), uids.end());
+    SnapshotPublisher publisher(this);
+    std::vector<uid_t> protectableUsers;
+    protectableUsers.reserve(mProtectableUsers.size() + sortedUids.size());
+    std::set_union(mProtectableUsers.begin(), mProtectableUsers.end(), sortedUids.begin(),
+                   sortedUids.end(), std::back_inserter(protectableUsers));
+    mProtectableUsers.swap(protectableUsers);
 }
 
 void NetworkController::denyProtect(const std::vector<uid_t>& uids) {
+    std::vector<uid_t> sortedUids = sortUids(uids);
+
     android::RWLock::AutoWLock lock(mRWLock);
-    for (uid_t uid : uids) {
-        mProtectableUsers.erase(uid);
-    }
+    SnapshotPublisher publisher(this);
+    std::vector<uid_t> protectableUsers;
+    protectableUsers.reserve(mProtectableUsers.size());
+    std::set_difference(mProtectableUsers.begin(), mProtectableUsers.end(), sortedUids.begin(),
+                        sortedUids.end(), std::back_inserter(protectableUsers));
+    mProtectableUsers.swap(protectableUsers);
 }
 
 bool NetworkController::isValidNetwork(unsigned netId) const {
@@ -473,67 +950,62 @@ Network* NetworkController::getNetworkLocked(unsigned netId) const {
     return iter == mNetworks.end() ? NULL : iter->second;
 }
 
-VirtualNetwork* NetworkController::getVirtualNetworkForUserLocked(uid_t uid) const {
+void NetworkController::publishSnapshotLocked() {
+    Snapshot* snapshot = new Snapshot;
+    snapshot->defaultNetId = mDefaultNetId;
     for (const auto& entry : mNetworks) {
-        if (entry.second->getType() == Network::VIRTUAL) {
+        Snapshot::NetworkInfo& info = snapshot->networks[entry.first];
+        info.type = entry.second->getType();
+        if (info.type == Network::PHYSICAL) {
+            info.permission = static_cast<PhysicalNetwork*>(entry.second)->getPermission();
+        } else if (info.type == Network::VIRTUAL) {
             VirtualNetwork* virtualNetwork = static_cast<VirtualNetwork*>(entry.second);
-            if (virtualNetwork->appliesToUser(uid)) {
-                return virtualNetwork;
-            }
+            info.hasDns = virtualNetwork->getHasDns();
+            info.secure = virtualNetwork->isSecure();
+            info.uidRanges = virtualNetwork->getUidRanges();
         }
     }
-    return NULL;
-}
-
-Permission NetworkController::getPermissionForUserLocked(uid_t uid) const {
-    auto iter = mUsers.find(uid);
-    if (iter != mUsers.end()) {
-        return iter->second;
-    }
-    return uid < FIRST_APPLICATION_UID ? PERMISSION_SYSTEM : PERMISSION_NONE;
-}
-
-int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const {
-    Network* network = getNetworkLocked(netId);
-    if (!network) {
-        return -ENONET;
-    }
-
-    // If uid is INVALID_UID, this likely means that we were unable to retrieve the UID of the peer
-    // (using SO_PEERCRED). Be safe and deny access to the network, even if it's valid.
-    if (uid == INVALID_UID) {
-        return -EREMOTEIO;
-    }
-    Permission userPermission = getPermissionForUserLocked(uid);
-    if ((userPermission & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
-        return 0;
-    }
-    if (network->getType() == Network::VIRTUAL) {
-        return static_cast<VirtualNetwork*>(network)->appliesToUser(uid) ? 0 : -EPERM;
-    }
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && virtualNetwork->isSecure() &&
-            mProtectableUsers.find(uid) == mProtectableUsers.end()) {
-        return -EPERM;
+    snapshot->indexVpnUidRanges();
+    snapshot->users = mUsers;
+    snapshot->protectableUsers = mProtectableUsers;
+
+    const Snapshot* oldSnapshot = mSnapshot.exchange(snapshot);
+    unsigned oldGeneration = mSnapshotGeneration.fetch_add(1);
+
+    // Readers that registered since the increment see the new snapshot. Wait for the ones that
+    // registered before it; they only hold the snapshot for the duration of a lookup.
+    for (ReaderCount& readerCount : mSnapshotReaders[oldGeneration % 2]) {
+        while (readerCount.count.load()) {
+            sched_yield();
+        }
     }
-    Permission networkPermission = static_cast<PhysicalNetwork*>(network)->getPermission();
-    return ((userPermission & networkPermission) == networkPermission) ? 0 : -EACCES;
+    delete oldSnapshot;
 }
 
 int NetworkController::modifyRoute(unsigned netId, const char* interface, const char* destination,
-                                   const char* nexthop, bool add, bool legacy, uid_t uid) {
+                                   const char* nexthop,
+                                   const std::vector<RouteController::Nexthop>* nexthops,
+                                   uint32_t metric, bool add, bool legacy, uid_t uid) {
     if (!isValidNetwork(netId)) {
         ALOGE("no such netId %u", netId);
         return -ENONET;
     }
-    unsigned existingNetId = getNetworkForInterface(interface);
-    if (existingNetId == NETID_UNSET) {
-        ALOGE("interface %s not assigned to any netId", interface);
-        return -ENODEV;
+    std::vector<const char*> interfaces(1, interface);
+    if (nexthops) {
+        for (const RouteController::Nexthop& hop : *nexthops) {
+            interfaces.push_back(hop.interface);
+        }
     }
-    if (existingNetId != netId) {
-        ALOGE("interface %s assigned to netId %u, not %u", interface, existingNetId, netId);
-        return -ENOENT;
+    for (const char* name : interfaces) {
+        unsigned existingNetId = getNetworkForInterface(name);
+        if (existingNetId == NETID_UNSET) {
+            ALOGE("interface %s not assigned to any netId", name);
+            return -ENODEV;
+        }
+        if (existingNetId != netId) {
+            ALOGE("interface %s assigned to netId %u, not %u", name, existingNetId, netId);
+            return -ENOENT;
+        }
     }
 
     RouteController::TableType tableType;
@@ -549,8 +1021,14 @@ int NetworkController::modifyRoute(unsigned netId, const char* interface, const
         tableType = RouteController::INTERFACE;
     }
 
-    return add ? RouteController::addRoute(interface, destination, nexthop, tableType) :
-                 RouteController::removeRoute(interface, destination, nexthop, tableType);
+    if (nexthops) {
+        return add ? RouteController::addMultipathRoute(interface, destination, *nexthops,
+                                                        tableType, metric) :
+                     RouteController::removeMultipathRoute(interface, destination, *nexthops,
+                                                           tableType, metric);
+    }
+    return add ? RouteController::addRoute(interface, destination, nexthop, tableType, metric) :
+                 RouteController::removeRoute(interface, destination, nexthop, tableType, metric);
 }
 
 int NetworkController::modifyFallthroughLocked(unsigned vpnNetId, bool add) {
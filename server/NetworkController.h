@@ -19,18 +19,22 @@
 
 #include "NetdConstants.h"
 #include "Permission.h"
+#include "RouteController.h"
 
 #include "utils/RWLock.h"
 
+#include <atomic>
 #include <list>
 #include <map>
-#include <set>
 #include <sys/types.h>
+#include <utility>
 #include <vector>
 
 class Network;
 class UidRanges;
 class VirtualNetwork;
+struct FwmarkCommand;
+union Fwmark;
 
 /*
  * Keeps track of default, per-pid, and per-uid-range network selection, as
@@ -58,6 +62,12 @@ public:
     unsigned getNetworkForInterface(const char* interface) const;
     bool isVirtualNetwork(unsigned netId) const;
 
+    // Updates |*fwmark|, the current mark of a socket of |uid|, to the mark that |command| should
+    // set on it. All the decisions are made against the same state, so a concurrent change can't
+    // be seen half-applied. Returns 0 on success or a negative errno value on failure.
+    int resolveFwmark(uid_t uid, const FwmarkCommand& command,
+                      Fwmark* fwmark) const WARN_UNUSED_RESULT;
+
     int createPhysicalNetwork(unsigned netId, Permission permission) WARN_UNUSED_RESULT;
     int createVirtualNetwork(unsigned netId, bool hasDns, bool secure) WARN_UNUSED_RESULT;
     int destroyNetwork(unsigned netId) WARN_UNUSED_RESULT;
@@ -73,30 +83,54 @@ public:
 
     int addUsersToNetwork(unsigned netId, const UidRanges& uidRanges) WARN_UNUSED_RESULT;
     int removeUsersFromNetwork(unsigned netId, const UidRanges& uidRanges) WARN_UNUSED_RESULT;
+    int setUsersForNetwork(unsigned netId, const UidRanges& uidRanges) WARN_UNUSED_RESULT;
 
     // |nexthop| can be NULL (to indicate a directly-connected route), "unreachable" (to indicate a
     // route that's blocked), "throw" (to indicate the lack of a match), or a regular IP address.
     //
     // Routes are added to tables determined by the interface, so only |interface| is actually used.
     // |netId| is given only to sanity check that the interface has the correct netId.
+    // Appends to |routes| the routes of all the interfaces of |netId|, including legacy routes.
+    int getRoutes(unsigned netId, std::vector<std::string>* routes) const WARN_UNUSED_RESULT;
+
     int addRoute(unsigned netId, const char* interface, const char* destination,
-                 const char* nexthop, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
+                 const char* nexthop, bool legacy, uid_t uid, uint32_t metric) WARN_UNUSED_RESULT;
     int removeRoute(unsigned netId, const char* interface, const char* destination,
-                    const char* nexthop, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
+                    const char* nexthop, bool legacy, uid_t uid,
+                    uint32_t metric) WARN_UNUSED_RESULT;
+
+    // The interfaces of all the nexthops must belong to |netId| too.
+    int addMultipathRoute(unsigned netId, const char* interface, const char* destination,
+                          const std::vector<RouteController::Nexthop>& nexthops, bool legacy,
+                          uid_t uid, uint32_t metric) WARN_UNUSED_RESULT;
+    int removeMultipathRoute(unsigned netId, const char* interface, const char* destination,
+                             const std::vector<RouteController::Nexthop>& nexthops, bool legacy,
+                             uid_t uid, uint32_t metric) WARN_UNUSED_RESULT;
 
     bool canProtect(uid_t uid) const;
     void allowProtect(const std::vector<uid_t>& uids);
     void denyProtect(const std::vector<uid_t>& uids);
 
 private:
+    // The lookups made for every connect() and DNS query (getDefaultNetwork(), getNetworkFor*()
+    // except getNetworkForInterface(), isVirtualNetwork(), resolveFwmark(), getPermissionForUser(),
+    // checkUserNetworkAccess() and canProtect()) don't take mRWLock. They read an immutable
+    // Snapshot of the state they need instead, which writers replace after every change.
+    struct Snapshot;
+    class SnapshotReader;
+    class SnapshotPublisher;
+
+    // Replaces the current snapshot with one made from the current state, and frees the old one
+    // once no reader can be using it anymore. Must be called with the write lock held.
+    void publishSnapshotLocked();
+
     bool isValidNetwork(unsigned netId) const;
     Network* getNetworkLocked(unsigned netId) const;
-    VirtualNetwork* getVirtualNetworkForUserLocked(uid_t uid) const;
-    Permission getPermissionForUserLocked(uid_t uid) const;
-    int checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const;
 
+    // |nexthops| is NULL for a route with a single |nexthop|.
     int modifyRoute(unsigned netId, const char* interface, const char* destination,
-                    const char* nexthop, bool add, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
+                    const char* nexthop, const std::vector<RouteController::Nexthop>* nexthops,
+                    uint32_t metric, bool add, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
     int modifyFallthroughLocked(unsigned vpnNetId, bool add) WARN_UNUSED_RESULT;
 
     class DelegateImpl;
@@ -106,8 +140,24 @@ private:
     mutable android::RWLock mRWLock;
     unsigned mDefaultNetId;
     std::map<unsigned, Network*> mNetworks;  // Map keys are NetIds.
-    std::map<uid_t, Permission> mUsers;
-    std::set<uid_t> mProtectableUsers;
+    // Both sorted by UID. Flat arrays rather than trees, since they are looked up far more often
+    // than they change, and are copied into every snapshot.
+    std::vector<std::pair<uid_t, Permission>> mUsers;
+    std::vector<uid_t> mProtectableUsers;
+
+    // The number of readers of the snapshot in one of SNAPSHOT_READER_SLOTS slots, padded to a
+    // cache line so that readers on different CPUs don't write to the same one.
+    struct ReaderCount {
+        std::atomic<unsigned> count;
+        char padding[64 - sizeof(std::atomic<unsigned>)];
+    };
+    static const unsigned SNAPSHOT_READER_SLOTS = 8;
+
+    std::atomic<const Snapshot*> mSnapshot;
+    // Incremented every time a snapshot is published. Readers register in the counts of the
+    // current generation's parity, so that a writer only waits for those that started before it.
+    std::atomic<unsigned> mSnapshotGeneration;
+    mutable ReaderCount mSnapshotReaders[2][SNAPSHOT_READER_SLOTS];
 };
 
 #endif  // NETD_SERVER_NETWORK_CONTROLLER_H
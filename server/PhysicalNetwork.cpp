@@ -117,6 +117,10 @@ int PhysicalNetwork::removeAsDefault() {
     return 0;
 }
 
+void PhysicalNetwork::restoreIsDefault(bool isDefault) {
+    mIsDefault = isDefault;
+}
+
 Network::Type PhysicalNetwork::getType() const {
     return PHYSICAL;
 }
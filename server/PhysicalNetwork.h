@@ -41,6 +41,9 @@ public:
 
     int addAsDefault() WARN_UNUSED_RESULT;
     int removeAsDefault() WARN_UNUSED_RESULT;
+    // Sets the bookkeeping of addAsDefault() and removeAsDefault(), e.g. to undo one made in a
+    // RouteController::Batch whose commit failed. Doesn't change any rules.
+    void restoreIsDefault(bool isDefault);
 
 private:
     Type getType() const override;
@@ -34,51 +34,67 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
+#include <sys/socket.h>
 #include <sys/types.h>
 
 #include <cutils/log.h>
 #include "QcRouteController.h"
+#include "RouteController.h"
 
 const char *TAG = "QcRouteController";
-static char IP_PATH[] = "/system/bin/ip";
 const char *QcRouteController::MAIN_TABLE = "254";
-const char *QcRouteController::SOURCE_POLICY_RULE_PRIO = "150";
-const int MAXSIZE = 256;
-
+const uint32_t QcRouteController::SOURCE_POLICY_RULE_PRIO = 150;
+// Writing to this is what "ip route flush cached" does for IPv4.
+static const char ROUTE_FLUSH_PATH[] = "/proc/sys/net/ipv4/route/flush";
+
+// Returns the address family for an "ip" style version flag ("-4" or "-6"), or AF_UNSPEC.
+static uint8_t getFamily(const char *ipver) {
+    if (!strcmp(ipver, "-4"))
+        return AF_INET;
+    if (!strcmp(ipver, "-6"))
+        return AF_INET6;
+    return AF_UNSPEC;
+}
 
-QcRouteController::QcRouteController() {
+// Parses a table number. Returns 0 if it isn't one.
+static uint32_t getTable(const char *table) {
+    char *end;
+    unsigned long value = strtoul(table, &end, 10);
+    return (*table && !*end && value <= UINT32_MAX) ? value : 0;
 }
 
-QcRouteController::~QcRouteController() {
+// Returns |address| as a prefix, adding a host prefix length if it has none, as "ip" does.
+static std::string getPrefix(const char *address) {
+    std::string prefix = address;
+    if (!strchr(address, '/'))
+        prefix += strchr(address, ':') ? "/128" : "/32";
+    return prefix;
 }
 
-std::string QcRouteController::_runIpCmd(const char * cmd) {
-    FILE *fp = NULL;
-    char line[MAXSIZE];
-    std::string res, buffer;
+static const char *getDefaultPrefix(uint8_t family) {
+    return (family == AF_INET6) ? "::/0" : "0.0.0.0/0";
+}
 
-    if (strlen(cmd) > 255) {
-        return std::string(strerror(E2BIG));
-    }
+QcRouteController::QcRouteController() {
+}
 
-    buffer = IP_PATH;
-    buffer += " ";
-    buffer += cmd;
-    buffer += " 2>&1"; //capture stderr
+QcRouteController::~QcRouteController() {
+}
 
-    ALOGV(TAG,"%s", buffer.c_str());
+// All the route and rule operations go through RouteController's netlink socket and return
+// negative errno on failure. This turns that into the message reported to the framework, or an
+// empty string on success.
+std::string QcRouteController::_result(const char *operation, int ret) {
+    std::string res;
 
-    if ((fp = popen(buffer.c_str(),"r")) == NULL) {
-        ALOGE(TAG, "failed to popen: %s", strerror(errno));
-        res = (strerror(errno));
-    } else if (fgets(line, sizeof line, fp)) {
-        ALOGV(TAG, "%s", line);
-        res = cmd;
+    if (ret) {
+        ALOGV("%s failed (%s)", operation, strerror(-ret));
+        res = operation;
         res += ": ";
-        res += line;
+        res += strerror(-ret);
     }
-    pclose(fp);
 
     return res;
 }
@@ -127,23 +143,20 @@ std::string QcRouteController::addDstRoute
     const char *table
 )
 {
-    char buffer[255];
-
-    if (gateway) {
-        snprintf(buffer, sizeof buffer,
-                 "route add %s via %s dev %s table %s metric %d",
-                 dstPrefix, gateway, iface, table, metric);
-    } else {
-        snprintf(buffer, sizeof buffer,
-                 "route add %s dev %s table %s metric %d",
-                 dstPrefix, iface, table, metric);
-    }
+    uint32_t tableNum = getTable(table);
+    if (!tableNum)
+        return _result("route add: invalid table", -EINVAL);
 
     //blindly delete an indentical route if it exists.
     _delHostRoute(dstPrefix, table);
 
-    std::string res  = _runIpCmd(buffer);
-    if (res.empty() || (res.find("exists") != std::string::npos))
+    int ret = RouteController::addExternalRoute(tableNum, iface, getPrefix(dstPrefix).c_str(),
+                                                gateway, metric, false);
+    if (ret == -EEXIST)
+        ret = 0;
+
+    std::string res = _result("route add", ret);
+    if (res.empty())
         res = _flushCache();
 
     return res;
@@ -168,11 +181,12 @@ std::string QcRouteController::_delHostRoute
     const char *table
 )
 {
-    char buffer[255];
-    snprintf(buffer, sizeof buffer, "route del %s table %s",
-             dstPrefix, table);
+    uint32_t tableNum = getTable(table);
+    if (!tableNum)
+        return _result("route del: invalid table", -EINVAL);
 
-    return _runIpCmd(buffer);
+    return _result("route del", RouteController::removeExternalRoute(
+            tableNum, NULL, getPrefix(dstPrefix).c_str()));
 }
 
 std::string QcRouteController::replaceDefRoute
@@ -197,19 +211,13 @@ std::string QcRouteController::_repDefRoute
     const char *ipver
 )
 {
-    char buffer[255];
-
-    if (gateway) {
-        snprintf(buffer, sizeof buffer,
-                 "%s route replace default via %s dev %s scope global table %s",
-                 ipver, gateway, iface, table);
-    } else {
-        snprintf(buffer, sizeof buffer,
-                 "%s route replace default dev %s table %s",
-                 ipver, iface, table);
-    }
+    uint8_t family = getFamily(ipver);
+    uint32_t tableNum = getTable(table);
+    if (family == AF_UNSPEC || !tableNum)
+        return _result("route replace default", -EINVAL);
 
-    return _runIpCmd(buffer);
+    return _result("route replace default", RouteController::addExternalRoute(
+            tableNum, iface, getDefaultPrefix(family), gateway, 0, true));
 }
 
 std::string QcRouteController::_delDefRoute
@@ -219,18 +227,13 @@ std::string QcRouteController::_delDefRoute
     const char *iface
 )
 {
-    char buffer[255];
-
-    if (iface) {
-        snprintf(buffer, sizeof buffer,
-                "%s route del default dev %s table %s",
-                ipver, iface, table);
-    } else {
-        snprintf(buffer, sizeof buffer,
-                "%s route del default table %s", ipver, table);
-    }
+    uint8_t family = getFamily(ipver);
+    uint32_t tableNum = getTable(table);
+    if (family == AF_UNSPEC || !tableNum)
+        return _result("route del default", -EINVAL);
 
-    return _runIpCmd(buffer);
+    return _result("route del default", RouteController::removeExternalRoute(
+            tableNum, iface, getDefaultPrefix(family)));
 }
 
 std::string QcRouteController::addDefRoute
@@ -242,22 +245,16 @@ std::string QcRouteController::addDefRoute
     const char *table
 )
 {
-    char buffer[255];
+    uint8_t family = getFamily(ipver);
+    uint32_t tableNum = getTable(table);
+    if (family == AF_UNSPEC || !tableNum)
+        return _result("route add default", -EINVAL);
 
     //remove existing def route for an iface before adding one with new metric
     _delDefRoute(table, ipver, iface);
 
-    if (gateway) {
-        snprintf(buffer, sizeof buffer,
-                 "%s route add default via %s dev %s table %s metric %d",
-                 ipver, gateway, iface, table, metric);
-    } else {
-        snprintf(buffer, sizeof buffer,
-                 "%s route add default dev %s table %s metric %d",
-                 ipver, iface, table, metric);
-    }
-
-    std::string res = _runIpCmd(buffer);
+    std::string res = _result("route add default", RouteController::addExternalRoute(
+            tableNum, iface, getDefaultPrefix(family), gateway, metric, false));
     if (res.empty())
         res = _flushCache();
 
@@ -265,11 +262,18 @@ std::string QcRouteController::addDefRoute
 }
 
 std::string QcRouteController::_flushCache() {
-    char buffer[255];
+    int ret = 0;
 
-    snprintf(buffer, sizeof buffer, "route flush cached");
+    int fd = open(ROUTE_FLUSH_PATH, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ret = -errno;
+    } else {
+        if (write(fd, "-1", 2) == -1)
+            ret = -errno;
+        close(fd);
+    }
 
-    return _runIpCmd(buffer);
+    return _result("route flush cached", ret);
 }
 
 std::string QcRouteController::_addRule
@@ -279,13 +283,13 @@ std::string QcRouteController::_addRule
     const char *ipver
 )
 {
-    char buffer[255];
-
-    snprintf(buffer, sizeof buffer,
-            "%s rule add from %s lookup %s prio %s", ipver, address, table,
-             SOURCE_POLICY_RULE_PRIO);
+    uint8_t family = getFamily(ipver);
+    uint32_t tableNum = getTable(table);
+    if (family == AF_UNSPEC || !tableNum)
+        return _result("rule add", -EINVAL);
 
-    return _runIpCmd(buffer);
+    return _result("rule add", RouteController::addExternalSourceRule(
+            family, SOURCE_POLICY_RULE_PRIO, tableNum, getPrefix(address).c_str()));
 }
 
 std::string QcRouteController::_delRule
@@ -294,10 +298,10 @@ std::string QcRouteController::_delRule
     const char *ipver
 )
 {
-    char buffer[255];
-
-    snprintf(buffer, sizeof buffer,
-             "%s rule del table %s", ipver, table);
+    uint8_t family = getFamily(ipver);
+    uint32_t tableNum = getTable(table);
+    if (family == AF_UNSPEC || !tableNum)
+        return _result("rule del", -EINVAL);
 
-    return _runIpCmd(buffer);
+    return _result("rule del", RouteController::removeExternalTableRule(family, tableNum));
 }
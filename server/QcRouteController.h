@@ -30,6 +30,7 @@
 #ifndef _QCROUTE_CONTROLLER_H
 #define _QCROUTE_CONTROLLER_H
 
+#include <stdint.h>
 #include <string.h>
 #include <string>
 
@@ -81,10 +82,11 @@ public:
 
 private:
     const static char *MAIN_TABLE;
-    const static char *SOURCE_POLICY_RULE_PRIO;
-    std::string _runIpCmd
+    const static uint32_t SOURCE_POLICY_RULE_PRIO;
+    std::string _result
     (
-        const char *cmd
+        const char *operation,
+        int ret
     );
     std::string _flushCache();
     std::string _repDefRoute
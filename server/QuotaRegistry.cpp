@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "QuotaRegistry.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+const char QUOTA_DIR[] = "/proc/net/xt_quota/";
+
+int openQuota(const std::string& name) {
+    std::string path = QUOTA_DIR + name;
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    return fd == -1 ? -errno : fd;
+}
+
+int readQuota(int fd, int64_t* bytes) {
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n == -1) {
+        return -errno;
+    }
+    buf[n] = '\0';
+    char* end;
+    *bytes = strtoll(buf, &end, 10);
+    return (end == buf) ? -EBADMSG : 0;
+}
+
+int writeQuota(int fd, int64_t bytes) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%" PRId64 "\n", bytes);
+    ssize_t n = pwrite(fd, buf, len, 0);
+    if (n == -1) {
+        return -errno;
+    }
+    return (n == len) ? 0 : -EIO;
+}
+
+}  // namespace
+
+QuotaRegistry::QuotaRegistry() {
+}
+
+QuotaRegistry::~QuotaRegistry() {
+    clear();
+}
+
+void QuotaRegistry::add(const std::string& name) {
+    mFds.insert(std::make_pair(name, -1));
+}
+
+void QuotaRegistry::remove(const std::string& name) {
+    std::map<std::string, int>::iterator it = mFds.find(name);
+    if (it == mFds.end()) {
+        return;
+    }
+    if (it->second != -1) {
+        close(it->second);
+    }
+    mFds.erase(it);
+}
+
+void QuotaRegistry::clear() {
+    for (std::map<std::string, int>::iterator it = mFds.begin(); it != mFds.end(); ++it) {
+        if (it->second != -1) {
+            close(it->second);
+        }
+    }
+    mFds.clear();
+}
+
+// Returns the cached descriptor of a tracked counter, opening it if needed.
+int QuotaRegistry::getFd(const std::string& name, bool reopen) {
+    std::map<std::string, int>::iterator it = mFds.find(name);
+    if (it == mFds.end()) {
+        return -ENOENT;
+    }
+    if (reopen && it->second != -1) {
+        close(it->second);
+        it->second = -1;
+    }
+    if (it->second == -1) {
+        int fd = openQuota(name);
+        if (fd < 0) {
+            return fd;
+        }
+        it->second = fd;
+    }
+    return it->second;
+}
+
+int QuotaRegistry::get(const std::string& name, int64_t* bytes) {
+    if (!mFds.count(name)) {
+        int fd = openQuota(name);
+        if (fd < 0) {
+            return fd;
+        }
+        int ret = readQuota(fd, bytes);
+        close(fd);
+        return ret;
+    }
+    int fd = getFd(name, false);
+    int ret = (fd < 0) ? fd : readQuota(fd, bytes);
+    if (ret) {
+        fd = getFd(name, true);
+        ret = (fd < 0) ? fd : readQuota(fd, bytes);
+    }
+    return ret;
+}
+
+int QuotaRegistry::set(const std::string& name, int64_t bytes) {
+    if (!mFds.count(name)) {
+        int fd = openQuota(name);
+        if (fd < 0) {
+            return fd;
+        }
+        int ret = writeQuota(fd, bytes);
+        close(fd);
+        return ret;
+    }
+    int fd = getFd(name, false);
+    int ret = (fd < 0) ? fd : writeQuota(fd, bytes);
+    if (ret) {
+        fd = getFd(name, true);
+        ret = (fd < 0) ? fd : writeQuota(fd, bytes);
+    }
+    return ret;
+}
+
+void QuotaRegistry::snapshot(std::vector<std::pair<std::string, int64_t> >* quotas) {
+    for (std::map<std::string, int>::const_iterator it = mFds.begin(); it != mFds.end(); ++it) {
+        int64_t bytes;
+        int ret = get(it->first, &bytes);
+        if (ret) {
+            ALOGE("Reading quota %s failed (%s)", it->first.c_str(), strerror(-ret));
+            continue;
+        }
+        quotas->push_back(std::make_pair(it->first, bytes));
+    }
+}
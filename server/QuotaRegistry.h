@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_QUOTA_REGISTRY_H
+#define NETD_SERVER_QUOTA_REGISTRY_H
+
+#include "NetdConstants.h"
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Keeps /proc/net/xt_quota/<name> open for every active quota2 counter (quotas and alerts alike),
+// so that reading and updating a counter is a single pread() or pwrite().
+//
+// The kernel removes the file when the last rule using the counter is deleted, and creates a new
+// one if a rule with the same name is added again, so a descriptor that stops working is reopened
+// once before giving up.
+class QuotaRegistry {
+public:
+    QuotaRegistry();
+    ~QuotaRegistry();
+
+    // Starts tracking the counter |name|. The file is opened on first use.
+    void add(const std::string& name);
+    // Stops tracking the counter |name| and closes its file.
+    void remove(const std::string& name);
+    // Stops tracking all counters.
+    void clear();
+
+    // Reads the remaining bytes of |name|. Counters that aren't tracked are read through a
+    // temporary descriptor. Returns 0 on success or a negative errno on failure.
+    int get(const std::string& name, int64_t* bytes) WARN_UNUSED_RESULT;
+    // Sets the remaining bytes of |name|. Returns 0 on success or a negative errno on failure.
+    int set(const std::string& name, int64_t bytes) WARN_UNUSED_RESULT;
+
+    // Reads all tracked counters, sorted by name. Counters that can't be read are skipped.
+    void snapshot(std::vector<std::pair<std::string, int64_t> >* quotas);
+
+private:
+    int getFd(const std::string& name, bool reopen);
+
+    // Tracked counters and their descriptors, or -1 if not open yet.
+    std::map<std::string, int> mFds;
+
+    // Not copyable.
+    QuotaRegistry(const QuotaRegistry&);
+    QuotaRegistry& operator=(const QuotaRegistry&);
+};
+
+#endif  // NETD_SERVER_QUOTA_REGISTRY_H
@@ -30,6 +30,11 @@ public:
     static const int TtyListResult             = 113;
     static const int TetheringStatsListResult  = 114;
     static const int TetherDnsFwdNetIdResult   = 115;
+    static const int IptablesDumpResult        = 116;
+    static const int BandwidthUnchangedUidsResult = 117;
+    static const int QuotaListResult           = 118;
+    static const int TetheringStatsBinaryResult = 119;
+    static const int RouteListResult           = 120;
 
     // 200 series - Requested action has been successfully completed
     static const int CommandOkay               = 200;
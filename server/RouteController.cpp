@@ -17,19 +17,27 @@
 #include "RouteController.h"
 
 #include "Fwmark.h"
+#include "InterfaceRegistry.h"
 #include "UidRanges.h"
 
 #define LOG_TAG "Netd"
 #include "log/log.h"
-#include "logwrap/logwrap.h"
 #include "resolv_netid.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <functional>
 #include <linux/fib_rules.h>
 #include <map>
 #include <net/if.h>
+#include <pthread.h>
+#include <set>
 #include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+#include <utils/Mutex.h>
+#include <vector>
 
 namespace {
 
@@ -79,8 +87,6 @@ const sockaddr_nl NETLINK_ADDRESS = {AF_NETLINK, 0, 0, 0};
 
 const uint8_t AF_FAMILIES[] = {AF_INET, AF_INET6};
 
-const char* const IP_VERSIONS[] = {"-4", "-6"};
-
 const uid_t UID_ROOT = 0;
 const char* const IIF_NONE = NULL;
 const char* const OIF_NONE = NULL;
@@ -89,11 +95,32 @@ const bool ACTION_DEL = false;
 const bool MODIFY_NON_UID_BASED_RULES = true;
 
 const char* const RT_TABLES_PATH = "/data/misc/net/rt_tables";
+const char* const RT_TABLES_TEMP_PATH = "/data/misc/net/rt_tables.tmp";
 const int RT_TABLES_FLAGS = O_CREAT | O_TRUNC | O_WRONLY | O_NOFOLLOW | O_CLOEXEC;
 const mode_t RT_TABLES_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;  // mode 0644, rw-r--r--
+// Updates scheduled within this long of each other are written to the file together.
+const useconds_t RT_TABLES_WRITE_DELAY_US = 100 * 1000;
 
 const unsigned ROUTE_FLUSH_ATTEMPTS = 2;
 
+// Large enough for a dump reply; the kernel fills dump datagrams up to a page (NLMSG_GOODSIZE).
+const size_t NETLINK_BUFFER_SIZE = 8192;
+// Maximum number of requests sent in one datagram.
+const size_t NETLINK_MAX_BATCH_SIZE = 64;
+// Maximum number of requests whose ACKs haven't been read yet. Together with the receive buffer
+// size, keeps the kernel from dropping ACKs (which it does if the receive buffer is full).
+const size_t NETLINK_MAX_IN_FLIGHT = 256;
+const int NETLINK_RECEIVE_BUFFER_SIZE = 512 * 1024;
+
+// The metric the kernel gives IPv6 routes added without one (IP6_RT_PRIO_USER).
+const uint32_t IPV6_DEFAULT_ROUTE_METRIC = 1024;
+
+// Notifications the route cache listens to. Link and IPv4 address notifications are needed because
+// the kernel deletes the IPv4 routes of an interface that goes down or loses its addresses without
+// sending RTM_DELROUTE.
+const uint32_t ROUTE_MONITOR_GROUPS = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE |
+                                      RTMGRP_IPV6_ROUTE;
+
 // Avoids "non-constant-expression cannot be narrowed from type 'unsigned int' to 'unsigned short'"
 // warnings when using RTA_LENGTH(x) inside static initializers (even when x is already uint16_t).
 constexpr uint16_t U16_RTA_LENGTH(uint16_t x) {
@@ -111,6 +138,7 @@ rtattr FRATTR_UID_END   = { U16_RTA_LENGTH(sizeof(uid_t)),    FRA_UID_END };
 
 rtattr RTATTR_TABLE     = { U16_RTA_LENGTH(sizeof(uint32_t)), RTA_TABLE };
 rtattr RTATTR_OIF       = { U16_RTA_LENGTH(sizeof(uint32_t)), RTA_OIF };
+rtattr RTATTR_PRIORITY  = { U16_RTA_LENGTH(sizeof(uint32_t)), RTA_PRIORITY };
 
 uint8_t PADDING_BUFFER[RTA_ALIGNTO] = {0, 0, 0, 0};
 
@@ -119,14 +147,90 @@ uint8_t PADDING_BUFFER[RTA_ALIGNTO] = {0, 0, 0, 0};
 // No locks needed because RouteController is accessed only from one thread (in CommandListener).
 std::map<std::string, uint32_t> interfaceToTable;
 
+// The netlink socket used for all rule and route requests, or -1 if not open yet. Kept open so that
+// each request doesn't have to create, connect and close a socket of its own.
+int netlinkSocket = -1;
+// Sequence number of the last request sent on |netlinkSocket|.
+uint32_t netlinkSequence = 0;
+
+// The batch that currently queues netlink requests, or NULL if requests are sent right away.
+RouteController::Batch* activeBatch = NULL;
+
+// Hands the table names file contents over to the thread that writes them (see
+// updateTableNamesFile()). Everything below is protected by |tableNamesLock|.
+android::Mutex tableNamesLock;
+std::string pendingTableNames;
+// Incremented every time |pendingTableNames| changes.
+uint64_t tableNamesGeneration = 0;
+bool tableNamesWriterRunning = false;
+
+// One of the nexthops of a multipath route in the route cache.
+struct CachedNexthop {
+    bool operator<(const CachedNexthop& other) const {
+        auto lhs = std::tie(ifindex, weight);
+        auto rhs = std::tie(other.ifindex, other.weight);
+        if (lhs != rhs) {
+            return lhs < rhs;
+        }
+        return memcmp(gateway, other.gateway, sizeof(gateway)) < 0;
+    }
+
+    uint32_t ifindex;
+    unsigned weight;                   // 1 to 256, as given to RouteController.
+    uint8_t gateway[sizeof(in6_addr)];  // All zeros if there is no gateway.
+};
+
+// A route in the route cache. Only the attributes that tell the routes of a table apart are kept.
+// Others, like the protocol and the scope, are ignored since netd always sets them the same way.
+struct CachedRoute {
+    CachedRoute() : family(AF_UNSPEC), type(RTN_UNSPEC), prefixLength(0), ifindex(0), priority(0) {
+        memset(destination, 0, sizeof(destination));
+        memset(gateway, 0, sizeof(gateway));
+    }
+
+    bool operator<(const CachedRoute& other) const {
+        auto lhs = std::tie(family, type, prefixLength, ifindex, priority);
+        auto rhs = std::tie(other.family, other.type, other.prefixLength, other.ifindex,
+                            other.priority);
+        if (lhs != rhs) {
+            return lhs < rhs;
+        }
+        if (int diff = memcmp(destination, other.destination, sizeof(destination))) {
+            return diff < 0;
+        }
+        if (int diff = memcmp(gateway, other.gateway, sizeof(gateway))) {
+            return diff < 0;
+        }
+        return nexthops < other.nexthops;
+    }
+
+    uint8_t family;
+    uint8_t type;
+    uint8_t prefixLength;
+    uint32_t ifindex;                      // 0 if there is no outgoing interface.
+    uint32_t priority;                     // The metric, as the kernel reports it.
+    uint8_t destination[sizeof(in6_addr)];  // Host bits are cleared.
+    uint8_t gateway[sizeof(in6_addr)];      // All zeros if there is no gateway.
+    std::vector<CachedNexthop> nexthops;   // Sorted. Empty unless this is a multipath route.
+};
+
+// The routes in the tables managed by netd, by table. Updated by netd's own route changes as they
+// are made, and reconciled with the route notifications of the kernel in syncRouteCache().
+std::map<uint32_t, std::set<CachedRoute>> routeCache;
+// The socket that receives ROUTE_MONITOR_GROUPS notifications, or -1 if not open yet.
+int routeMonitorSocket = -1;
+// Whether |routeCache| matches the kernel. False until the first dump, and whenever notifications
+// have been lost.
+bool routeCacheValid = false;
+
 uint32_t getRouteTableForInterface(const char* interface) {
-    uint32_t index = if_nametoindex(interface);
+    uint32_t index = InterfaceRegistry::nameToIndex(interface);
     if (index) {
         index += RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX;
         interfaceToTable[interface] = index;
         return index;
     }
-    // If the interface goes away if_nametoindex() will return 0 but we still need to know
+    // If the interface goes away nameToIndex() will return 0 but we still need to know
     // the index so we can remove the rules and routes.
     auto iter = interfaceToTable.find(interface);
     if (iter == interfaceToTable.end()) {
@@ -145,7 +249,93 @@ void addTableName(uint32_t table, const std::string& name, std::string* contents
     *contents += "\n";
 }
 
+// Reads the current contents of the table names file, so that a restarted netd doesn't rewrite
+// an identical file. Returns an empty string if the file can't be read.
+std::string readTableNamesFile() {
+    std::string contents;
+    int fd = open(RT_TABLES_PATH, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return contents;
+    }
+    char buffer[1024];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, bytesRead);
+    }
+    close(fd);
+    return bytesRead == 0 ? contents : std::string();
+}
+
+// Writes the table names file through a temporary file, so that readers never see a partially
+// written file. Only called from the writer thread, or with no writer thread running.
+void writeTableNamesFile(const std::string& contents) {
+    static bool initialized = false;
+    static std::string written;
+    if (!initialized) {
+        written = readTableNamesFile();
+        initialized = true;
+    }
+    if (contents == written) {
+        return;
+    }
+
+    int fd = open(RT_TABLES_TEMP_PATH, RT_TABLES_FLAGS, RT_TABLES_MODE);
+    if (fd == -1) {
+        ALOGE("failed to create %s (%s)", RT_TABLES_TEMP_PATH, strerror(errno));
+        return;
+    }
+    // File creation is affected by umask, so make sure the right mode bits are set.
+    if (fchmod(fd, RT_TABLES_MODE) == -1) {
+        ALOGE("failed to set mode 0%o on %s (%s)", RT_TABLES_MODE, RT_TABLES_TEMP_PATH,
+              strerror(errno));
+    }
+    ssize_t bytesWritten = write(fd, contents.data(), contents.size());
+    if (bytesWritten != static_cast<ssize_t>(contents.size())) {
+        ALOGE("failed to write to %s (%zd vs %zu bytes) (%s)", RT_TABLES_TEMP_PATH, bytesWritten,
+              contents.size(), strerror(errno));
+        close(fd);
+        unlink(RT_TABLES_TEMP_PATH);
+        return;
+    }
+    // Without this, a crash right after the rename could leave an empty file behind.
+    if (fsync(fd) == -1) {
+        ALOGE("failed to sync %s (%s)", RT_TABLES_TEMP_PATH, strerror(errno));
+    }
+    close(fd);
+    if (rename(RT_TABLES_TEMP_PATH, RT_TABLES_PATH) == -1) {
+        ALOGE("failed to rename %s to %s (%s)", RT_TABLES_TEMP_PATH, RT_TABLES_PATH,
+              strerror(errno));
+        unlink(RT_TABLES_TEMP_PATH);
+        return;
+    }
+    written = contents;
+}
+
+// Waits for more updates to come in, writes the latest contents, and exits once nothing new has
+// been scheduled during the write. At most one writer thread runs at a time.
+void* tableNamesWriterThread(void*) {
+    for (;;) {
+        usleep(RT_TABLES_WRITE_DELAY_US);
+
+        std::string contents;
+        uint64_t generation;
+        {
+            android::Mutex::Autolock lock(tableNamesLock);
+            contents = pendingTableNames;
+            generation = tableNamesGeneration;
+        }
+        writeTableNamesFile(contents);
+
+        android::Mutex::Autolock lock(tableNamesLock);
+        if (generation == tableNamesGeneration) {
+            tableNamesWriterRunning = false;
+            return NULL;
+        }
+    }
+}
+
 // Doesn't return success/failure as the file is optional; it's okay if we fail to update it.
+// The write itself is deferred, so that adding several interfaces in a row writes the file once.
 void updateTableNamesFile() {
     std::string contents;
 
@@ -160,26 +350,155 @@ void updateTableNamesFile() {
         addTableName(entry.second, entry.first, &contents);
     }
 
-    int fd = open(RT_TABLES_PATH, RT_TABLES_FLAGS, RT_TABLES_MODE);
-    if (fd == -1) {
-        ALOGE("failed to create %s (%s)", RT_TABLES_PATH, strerror(errno));
+    android::Mutex::Autolock lock(tableNamesLock);
+    pendingTableNames.swap(contents);
+    ++tableNamesGeneration;
+    if (tableNamesWriterRunning) {
         return;
     }
-    // File creation is affected by umask, so make sure the right mode bits are set.
-    if (fchmod(fd, RT_TABLES_MODE) == -1) {
-        ALOGE("failed to set mode 0%o on %s (%s)", RT_TABLES_MODE, RT_TABLES_PATH, strerror(errno));
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, tableNamesWriterThread, NULL)) {
+        ALOGE("failed to start the %s writer, writing it now", RT_TABLES_PATH);
+        writeTableNamesFile(pendingTableNames);
+        return;
     }
-    ssize_t bytesWritten = write(fd, contents.data(), contents.size());
-    if (bytesWritten != static_cast<ssize_t>(contents.size())) {
-        ALOGE("failed to write to %s (%zd vs %zu bytes) (%s)", RT_TABLES_PATH, bytesWritten,
-              contents.size(), strerror(errno));
+    pthread_detach(thread);
+    tableNamesWriterRunning = true;
+}
+
+// Opens a NETLINK_ROUTE socket connected to the kernel.
+// Returns the socket on success or negative errno on failure.
+WARN_UNUSED_RESULT int openNetlinkSocket() {
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock == -1) {
+        int ret = -errno;
+        ALOGE("netlink socket failed (%s)", strerror(-ret));
+        return ret;
     }
-    close(fd);
+    if (connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
+                sizeof(NETLINK_ADDRESS)) == -1) {
+        int ret = -errno;
+        ALOGE("netlink connect failed (%s)", strerror(-ret));
+        close(sock);
+        return ret;
+    }
+    // Large batches need more room for ACKs than the default. SO_RCVBUFFORCE ignores rmem_max, but
+    // needs CAP_NET_ADMIN; if it fails, batches still work, just with the default buffer size.
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &NETLINK_RECEIVE_BUFFER_SIZE,
+                   sizeof(NETLINK_RECEIVE_BUFFER_SIZE)) == -1) {
+        ALOGW("failed to set netlink receive buffer size (%s)", strerror(errno));
+    }
+    return sock;
+}
+
+// Returns the shared netlink socket, opening it if needed, or negative errno on failure.
+WARN_UNUSED_RESULT int getNetlinkSocket() {
+    if (netlinkSocket == -1) {
+        int sock = openNetlinkSocket();
+        if (sock < 0) {
+            return sock;
+        }
+        netlinkSocket = sock;
+    }
+    return netlinkSocket;
+}
+
+// Closes the shared netlink socket after an error, so that no stale replies are left in it. The
+// next request opens a new one.
+void closeNetlinkSocket() {
+    if (netlinkSocket != -1) {
+        close(netlinkSocket);
+        netlinkSocket = -1;
+    }
+}
+
+// Returns the next netlink message in |buffer| at |*offset| and advances |*offset| past it, or
+// NULL once the buffer is exhausted or if the message is truncated.
+nlmsghdr* nextNetlinkMessage(char* buffer, size_t length, size_t* offset) {
+    if (*offset + sizeof(nlmsghdr) > length) {
+        return NULL;
+    }
+    nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(buffer + *offset);
+    if (nh->nlmsg_len < sizeof(nlmsghdr) || nh->nlmsg_len > length - *offset) {
+        ALOGE("truncated netlink message (%u vs %zu bytes)", nh->nlmsg_len, length - *offset);
+        return NULL;
+    }
+    *offset += NLMSG_ALIGN(nh->nlmsg_len);
+    return nh;
+}
+
+// Sends |requests| on the shared netlink socket and waits for all of their ACKs, which are matched
+// to the requests by sequence number. Up to NETLINK_MAX_BATCH_SIZE requests are sent per datagram,
+// and further datagrams are sent without waiting for the ACKs of the previous ones, as long as no
+// more than NETLINK_MAX_IN_FLIGHT requests are outstanding. No more datagrams are sent after a
+// request fails.
+// If |ignoreMissing| is true, requests that fail because the object doesn't exist (e.g., a route
+// that someone else already deleted) are considered successful.
+// Returns 0 on success or the first error (negative errno) reported by the socket or the kernel.
+WARN_UNUSED_RESULT int sendNetlinkRequests(std::vector<std::string>* requests,
+                                           bool ignoreMissing) {
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+
+    std::vector<char> buffer(NETLINK_BUFFER_SIZE);
+    const uint32_t firstSeq = netlinkSequence + 1;
+    size_t sent = 0;
+    size_t acked = 0;
+    int ret = 0;
+    while (acked < sent || (sent < requests->size() && !ret)) {
+        while (sent < requests->size() && !ret &&
+               sent - acked + NETLINK_MAX_BATCH_SIZE <= NETLINK_MAX_IN_FLIGHT) {
+            size_t end = std::min(sent + NETLINK_MAX_BATCH_SIZE, requests->size());
+            std::string datagram;
+            for (size_t i = sent; i < end; ++i) {
+                std::string& request = (*requests)[i];
+                reinterpret_cast<nlmsghdr*>(&request[0])->nlmsg_seq = ++netlinkSequence;
+                datagram += request;
+                datagram.resize(NLMSG_ALIGN(datagram.size()));
+            }
+            if (send(sock, datagram.data(), datagram.size(), 0) == -1) {
+                ret = -errno;
+                ALOGE("netlink send failed (%s)", strerror(-ret));
+                closeNetlinkSocket();
+                return ret;
+            }
+            sent = end;
+        }
+
+        // The kernel processes every request in a datagram, even after one of them fails, and
+        // sends one ACK for each.
+        ssize_t bytesRead = recv(sock, &buffer[0], buffer.size(), 0);
+        if (bytesRead == -1) {
+            ret = -errno;
+            ALOGE("netlink recv failed (%s)", strerror(-ret));
+            closeNetlinkSocket();
+            return ret;
+        }
+        size_t offset = 0;
+        while (nlmsghdr* nh = nextNetlinkMessage(&buffer[0], bytesRead, &offset)) {
+            if (nh->nlmsg_type != NLMSG_ERROR || nh->nlmsg_seq - firstSeq >= sent) {
+                continue;
+            }
+            ++acked;
+            int error = static_cast<nlmsgerr*>(NLMSG_DATA(nh))->error;  // Negative errno.
+            if (!error || (ignoreMissing && (error == -ESRCH || error == -ENOENT))) {
+                continue;
+            }
+            ALOGE("netlink response contains error (%s)", strerror(-error));
+            if (!ret) {
+                ret = error;
+            }
+        }
+    }
+    return ret;
 }
 
 // Sends a netlink request and expects an ack.
 // |iov| is an array of struct iovec that contains the netlink message payload.
 // The netlink header is generated by this function based on |action| and |flags|.
+// If a RouteController::Batch is active, the request is only queued, and errors are returned by its commit().
 // Returns -errno if there was an error or if the kernel reported an error.
 WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec* iov, int iovlen) {
     nlmsghdr nlmsg = {
@@ -192,37 +511,450 @@ WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec
         nlmsg.nlmsg_len += iov[i].iov_len;
     }
 
-    int ret;
+    std::string request;
+    request.reserve(nlmsg.nlmsg_len);
+    for (int i = 0; i < iovlen; ++i) {
+        request.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+
+    if (activeBatch) {
+        activeBatch->add(request);
+        return 0;
+    }
+    std::vector<std::string> requests(1, request);
+    return sendNetlinkRequests(&requests, false);
+}
+
+// Returns the attribute of type |type| in |nh|, whose payload is a fixed header of |headerSize|
+// bytes (an rtmsg or a fib_rule_hdr) followed by attributes, or NULL if there is no such attribute.
+rtattr* findNetlinkAttribute(nlmsghdr* nh, size_t headerSize, uint16_t type) {
+    int length = nh->nlmsg_len - NLMSG_LENGTH(headerSize);
+    rtattr* rta = reinterpret_cast<rtattr*>(static_cast<char*>(NLMSG_DATA(nh)) +
+                                            NLMSG_ALIGN(headerSize));
+    for (; RTA_OK(rta, length); rta = RTA_NEXT(rta, length)) {
+        if (rta->rta_type == type) {
+            return rta;
+        }
+    }
+    return NULL;
+}
+
+// Dumps all routes or rules (depending on |getAction|) of |family| and appends to |matches| a copy
+// of each one that |shouldFlush| accepts.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int dumpNetlinkObjects(uint16_t getAction, uint8_t family,
+                                          const std::function<bool(nlmsghdr*)>& shouldFlush,
+                                          std::vector<std::string>* matches) {
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+    uint32_t seq = ++netlinkSequence;
+
+    // A fib_rule_hdr starts with the family just like an rtmsg, so this works for rules too.
     struct {
-        nlmsghdr msg;
-        nlmsgerr err;
-    } response;
-
-    int sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
-    if (sock != -1 &&
-            connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
-                    sizeof(NETLINK_ADDRESS)) != -1 &&
-            writev(sock, iov, iovlen) != -1 &&
-            (ret = recv(sock, &response, sizeof(response), 0)) != -1) {
-        if (ret == sizeof(response)) {
-            ret = response.err.error;  // Netlink errors are negative errno.
-            if (ret) {
-                ALOGE("netlink response contains error (%s)", strerror(-ret));
+        nlmsghdr header;
+        rtmsg route;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = getAction;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = seq;
+    request.route.rtm_family = family;
+
+    if (send(sock, &request, sizeof(request), 0) == -1) {
+        int ret = -errno;
+        ALOGE("netlink dump request failed (%s)", strerror(-ret));
+        closeNetlinkSocket();
+        return ret;
+    }
+
+    std::vector<char> buffer(NETLINK_BUFFER_SIZE);
+    while (true) {
+        ssize_t bytesRead = recv(sock, &buffer[0], buffer.size(), 0);
+        if (bytesRead == -1) {
+            int ret = -errno;
+            ALOGE("netlink dump recv failed (%s)", strerror(-ret));
+            // Don't leave the rest of the dump in the socket.
+            closeNetlinkSocket();
+            return ret;
+        }
+        size_t offset = 0;
+        while (nlmsghdr* nh = nextNetlinkMessage(&buffer[0], bytesRead, &offset)) {
+            if (nh->nlmsg_seq != seq) {
+                continue;
+            }
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                int ret = static_cast<nlmsgerr*>(NLMSG_DATA(nh))->error;
+                ALOGE("netlink dump failed (%s)", strerror(-ret));
+                return ret ? ret : -EBADMSG;
+            }
+            if (shouldFlush(nh)) {
+                matches->push_back(std::string(reinterpret_cast<char*>(nh), nh->nlmsg_len));
             }
-        } else {
-            ALOGE("bad netlink response message size (%d != %zu)", ret, sizeof(response));
-            ret = -EBADMSG;
         }
-    } else {
-        ALOGE("netlink socket/connect/writev/recv failed (%s)", strerror(errno));
-        ret = -errno;
     }
+}
+
+// Deletes all routes or rules of |family| that |shouldFlush| accepts.
+// A flush works by dumping the objects and deleting each one, and it can fail if something else
+// modifies them between the dump and the delete. Objects that disappear in the meantime are
+// ignored; any other failure causes the whole flush to be retried, and only an error in the last
+// attempt is returned.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int flushNetlinkObjects(uint16_t getAction, uint16_t delAction, uint8_t family,
+                                           const std::function<bool(nlmsghdr*)>& shouldFlush) {
+    int ret = 0;
+    for (unsigned attempts = 0; attempts < ROUTE_FLUSH_ATTEMPTS; ++attempts) {
+        std::vector<std::string> objects;
+        ret = dumpNetlinkObjects(getAction, family, shouldFlush, &objects);
+        if (ret) {
+            continue;
+        }
+        // A dumped object is also a valid request to delete that object, so just send it back
+        // with a different message type (like "ip route flush" and "ip rule flush" do).
+        for (std::string& object : objects) {
+            nlmsghdr* nh = reinterpret_cast<nlmsghdr*>(&object[0]);
+            nh->nlmsg_type = delAction;
+            nh->nlmsg_flags = NETLINK_REQUEST_FLAGS;
+            nh->nlmsg_pid = 0;
+        }
+        ret = sendNetlinkRequests(&objects, true);
+        if (!ret) {
+            break;
+        }
+    }
+    return ret;
+}
+
+// Returns the table of the route in |nh|. Tables above 255 don't fit in rtm_table, so the kernel
+// reports them in RTA_TABLE.
+uint32_t getRouteTable(nlmsghdr* nh) {
+    rtattr* rtaTable = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_TABLE);
+    return rtaTable ? *static_cast<uint32_t*>(RTA_DATA(rtaTable)) :
+                      static_cast<rtmsg*>(NLMSG_DATA(nh))->rtm_table;
+}
+
+bool isNetdRouteTable(uint32_t table) {
+    return table == ROUTE_TABLE_LOCAL_NETWORK || table == ROUTE_TABLE_LEGACY_NETWORK ||
+           table == ROUTE_TABLE_LEGACY_SYSTEM ||
+           table >= static_cast<uint32_t>(RouteController::ROUTE_TABLE_OFFSET_FROM_INDEX);
+}
+
+// Fills in the fields of |route| that identify it, in the same way for routes added by netd and
+// routes reported by the kernel (which, for example, reports IPv6 unreachable routes as going
+// through the loopback interface, and IPv6 routes without a metric as having the default one).
+void makeCachedRoute(uint8_t family, uint8_t type, const uint8_t* destination,
+                     uint8_t prefixLength, const uint8_t* gateway, uint32_t ifindex,
+                     uint32_t priority, CachedRoute* route) {
+    size_t length = (family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+    route->family = family;
+    route->type = type;
+    route->prefixLength = prefixLength;
+    route->priority = (family == AF_INET6 && !priority) ? IPV6_DEFAULT_ROUTE_METRIC : priority;
+    if (destination) {
+        memcpy(route->destination, destination, length);
+        for (size_t bit = prefixLength; bit < length * 8; ++bit) {
+            route->destination[bit / 8] &= ~(0x80 >> (bit % 8));
+        }
+    }
+    if (type == RTN_UNICAST) {
+        if (gateway) {
+            memcpy(route->gateway, gateway, length);
+        }
+        route->ifindex = ifindex;
+    }
+}
+
+// Parses the RTA_MULTIPATH attribute |rta| of a route of |family| into |nexthops|. Returns false
+// if the attribute is malformed.
+bool parseCachedNexthops(rtattr* rta, uint8_t family, std::vector<CachedNexthop>* nexthops) {
+    size_t length = (family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+    rtnexthop* rtnh = static_cast<rtnexthop*>(RTA_DATA(rta));
+    int remaining = RTA_PAYLOAD(rta);
+    while (RTNH_OK(rtnh, remaining)) {
+        CachedNexthop nexthop;
+        memset(&nexthop, 0, sizeof(nexthop));
+        nexthop.ifindex = rtnh->rtnh_ifindex;
+        nexthop.weight = rtnh->rtnh_hops + 1;
+        int attributesLength = rtnh->rtnh_len - sizeof(*rtnh);
+        for (rtattr* attribute = RTNH_DATA(rtnh); RTA_OK(attribute, attributesLength);
+             attribute = RTA_NEXT(attribute, attributesLength)) {
+            if (attribute->rta_type == RTA_GATEWAY) {
+                if (RTA_PAYLOAD(attribute) != length) {
+                    return false;
+                }
+                memcpy(nexthop.gateway, RTA_DATA(attribute), length);
+            }
+        }
+        nexthops->push_back(nexthop);
+        remaining -= RTNH_ALIGN(rtnh->rtnh_len);
+        rtnh = RTNH_NEXT(rtnh);
+    }
+    std::sort(nexthops->begin(), nexthops->end());
+    return true;
+}
 
-    if (sock != -1) {
+// Parses the route in |nh| into |table| and |route|. Returns false if the message is malformed or
+// the route isn't one that the cache keeps.
+bool parseCachedRoute(nlmsghdr* nh, uint32_t* table, CachedRoute* route) {
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(rtmsg))) {
+        return false;
+    }
+    rtmsg* rtm = static_cast<rtmsg*>(NLMSG_DATA(nh));
+    if ((rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6) ||
+            (rtm->rtm_flags & RTM_F_CLONED)) {
+        return false;
+    }
+    *table = getRouteTable(nh);
+    if (!isNetdRouteTable(*table)) {
+        return false;
+    }
+
+    size_t length = (rtm->rtm_family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
+    rtattr* rtaDst = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_DST);
+    rtattr* rtaGateway = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_GATEWAY);
+    rtattr* rtaOif = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_OIF);
+    rtattr* rtaPriority = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_PRIORITY);
+    rtattr* rtaMultipath = findNetlinkAttribute(nh, sizeof(rtmsg), RTA_MULTIPATH);
+    if ((rtaDst && RTA_PAYLOAD(rtaDst) != length) ||
+            (rtaGateway && RTA_PAYLOAD(rtaGateway) != length) ||
+            (rtaOif && RTA_PAYLOAD(rtaOif) != sizeof(uint32_t)) ||
+            (rtaPriority && RTA_PAYLOAD(rtaPriority) != sizeof(uint32_t))) {
+        return false;
+    }
+    makeCachedRoute(rtm->rtm_family, rtm->rtm_type,
+                    rtaDst ? static_cast<uint8_t*>(RTA_DATA(rtaDst)) : NULL, rtm->rtm_dst_len,
+                    rtaGateway ? static_cast<uint8_t*>(RTA_DATA(rtaGateway)) : NULL,
+                    rtaOif ? *static_cast<uint32_t*>(RTA_DATA(rtaOif)) : 0,
+                    rtaPriority ? *static_cast<uint32_t*>(RTA_DATA(rtaPriority)) : 0, route);
+    if (rtaMultipath && !parseCachedNexthops(rtaMultipath, rtm->rtm_family, &route->nexthops)) {
+        return false;
+    }
+    return true;
+}
+
+// Returns true if |route| sends packets through the interface with index |ifindex|.
+bool routeUsesInterface(const CachedRoute& route, uint32_t ifindex) {
+    if (route.ifindex == ifindex) {
+        return true;
+    }
+    for (const CachedNexthop& nexthop : route.nexthops) {
+        if (nexthop.ifindex == ifindex) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void addCachedRoute(uint32_t table, const CachedRoute& route) {
+    routeCache[table].insert(route);
+}
+
+void removeCachedRoute(uint32_t table, const CachedRoute& route) {
+    auto iter = routeCache.find(table);
+    if (iter != routeCache.end()) {
+        iter->second.erase(route);
+        if (iter->second.empty()) {
+            routeCache.erase(iter);
+        }
+    }
+}
+
+// Applies a route or link notification (or a route from a dump) to the route cache.
+void applyRouteNotification(nlmsghdr* nh) {
+    if (nh->nlmsg_type == RTM_NEWROUTE || nh->nlmsg_type == RTM_DELROUTE) {
+        uint32_t table;
+        CachedRoute route;
+        if (parseCachedRoute(nh, &table, &route)) {
+            if (nh->nlmsg_type == RTM_NEWROUTE) {
+                addCachedRoute(table, route);
+            } else {
+                removeCachedRoute(table, route);
+            }
+        }
+    } else if (nh->nlmsg_type == RTM_NEWLINK || nh->nlmsg_type == RTM_DELLINK) {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+            return;
+        }
+        ifinfomsg* ifi = static_cast<ifinfomsg*>(NLMSG_DATA(nh));
+        if (nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP)) {
+            return;
+        }
+        // The interface is down or gone. The kernel has silently deleted its IPv4 routes.
+        uint32_t ifindex = ifi->ifi_index;
+        for (auto iter = routeCache.begin(); iter != routeCache.end();) {
+            std::set<CachedRoute>& routes = iter->second;
+            for (auto route = routes.begin(); route != routes.end();) {
+                if (route->family == AF_INET && !route->nexthops.empty() &&
+                        routeUsesInterface(*route, ifindex)) {
+                    // A multipath route is only deleted once all of its nexthops are down, which
+                    // the cache can't tell. Have syncRouteCache() rebuild it instead.
+                    routeCacheValid = false;
+                    return;
+                }
+                if (route->family == AF_INET && route->ifindex == ifindex) {
+                    route = routes.erase(route);
+                } else {
+                    ++route;
+                }
+            }
+            iter = routes.empty() ? routeCache.erase(iter) : ++iter;
+        }
+    } else if (nh->nlmsg_type == RTM_DELADDR) {
+        if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(ifaddrmsg))) {
+            return;
+        }
+        // Deleting an IPv4 address takes the routes through its subnet with it, and deleting the
+        // last one all the routes of the interface. Neither is notified, and which routes are gone
+        // depends on the remaining addresses, so have syncRouteCache() rebuild the cache.
+        if (static_cast<ifaddrmsg*>(NLMSG_DATA(nh))->ifa_family == AF_INET) {
+            routeCacheValid = false;
+        }
+    }
+}
+
+// Returns a socket subscribed to ROUTE_MONITOR_GROUPS, or negative errno on failure.
+WARN_UNUSED_RESULT int openRouteMonitorSocket() {
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (sock == -1) {
+        int ret = -errno;
+        ALOGE("route monitor socket failed (%s)", strerror(-ret));
+        return ret;
+    }
+    sockaddr_nl address = {AF_NETLINK, 0, 0, ROUTE_MONITOR_GROUPS};
+    if (bind(sock, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1) {
+        int ret = -errno;
+        ALOGE("route monitor bind failed (%s)", strerror(-ret));
         close(sock);
+        return ret;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &NETLINK_RECEIVE_BUFFER_SIZE,
+                   sizeof(NETLINK_RECEIVE_BUFFER_SIZE)) == -1) {
+        ALOGW("failed to set route monitor receive buffer size (%s)", strerror(errno));
     }
+    return sock;
+}
 
-    return ret;
+// Brings the route cache up to date with the notifications received since the last call. If
+// notifications were lost (the socket buffer overflowed), or the cache was never filled, rebuilds it
+// from a dump of all routes. Afterwards, |routeCacheValid| says whether the cache can be trusted.
+void syncRouteCache() {
+    if (routeMonitorSocket == -1) {
+        int sock = openRouteMonitorSocket();
+        if (sock < 0) {
+            routeCacheValid = false;
+            return;
+        }
+        routeMonitorSocket = sock;
+        routeCacheValid = false;
+    }
+
+    std::vector<char> buffer(NETLINK_BUFFER_SIZE);
+    while (true) {
+        ssize_t bytesRead = recv(routeMonitorSocket, &buffer[0], buffer.size(), 0);
+        if (bytesRead == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == ENOBUFS) {
+                routeCacheValid = false;
+                continue;
+            }
+            ALOGE("route monitor recv failed (%s)", strerror(errno));
+            close(routeMonitorSocket);
+            routeMonitorSocket = -1;
+            routeCacheValid = false;
+            return;
+        }
+        if (!routeCacheValid) {
+            continue;  // The cache is going to be rebuilt anyway.
+        }
+        size_t offset = 0;
+        while (nlmsghdr* nh = nextNetlinkMessage(&buffer[0], bytesRead, &offset)) {
+            applyRouteNotification(nh);
+        }
+    }
+
+    if (!routeCacheValid) {
+        routeCache.clear();
+        auto addRoute = [](nlmsghdr* nh) {
+            applyRouteNotification(nh);
+            return false;
+        };
+        std::vector<std::string> unused;
+        for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+            if (dumpNetlinkObjects(RTM_GETROUTE, AF_FAMILIES[i], addRoute, &unused)) {
+                ALOGE("failed to fill the route cache");
+                return;
+            }
+        }
+        routeCacheValid = true;
+    }
+}
+
+// Returns the " via <gateway> dev <interface>" part of a route description, leaving out what isn't
+// there.
+std::string describeNexthop(uint8_t family, const uint8_t* gateway, uint32_t ifindex) {
+    std::string description;
+    static const uint8_t NO_GATEWAY[sizeof(in6_addr)] = {};
+    if (memcmp(gateway, NO_GATEWAY, sizeof(NO_GATEWAY))) {
+        char address[INET6_ADDRSTRLEN];
+        inet_ntop(family, gateway, address, sizeof(address));
+        description += " via ";
+        description += address;
+    }
+
+    if (ifindex) {
+        char name[IFNAMSIZ];
+        if (!InterfaceRegistry::indexToName(ifindex, name)) {
+            snprintf(name, sizeof(name), "if%u", ifindex);
+        }
+        description += " dev ";
+        description += name;
+    }
+    return description;
+}
+
+// Returns a description of |route| in the style of "ip route".
+std::string describeCachedRoute(const CachedRoute& route) {
+    std::string description;
+    if (route.type == RTN_UNREACHABLE) {
+        description += "unreachable ";
+    } else if (route.type == RTN_THROW) {
+        description += "throw ";
+    }
+
+    char address[INET6_ADDRSTRLEN];
+    inet_ntop(route.family, route.destination, address, sizeof(address));
+    char prefixLength[4];
+    snprintf(prefixLength, sizeof(prefixLength), "%u", route.prefixLength);
+    description += address;
+    description += "/";
+    description += prefixLength;
+
+    if (route.nexthops.empty()) {
+        description += describeNexthop(route.family, route.gateway, route.ifindex);
+    }
+    if (route.priority) {
+        char priority[UINT32_STRLEN];
+        snprintf(priority, sizeof(priority), "%u", route.priority);
+        description += " metric ";
+        description += priority;
+    }
+    for (const CachedNexthop& nexthop : route.nexthops) {
+        char weight[4];
+        snprintf(weight, sizeof(weight), "%u", nexthop.weight);
+        description += " nexthop";
+        description += describeNexthop(route.family, nexthop.gateway, nexthop.ifindex);
+        description += " weight ";
+        description += weight;
+    }
+    return description;
 }
 
 // Returns 0 on success or negative errno on failure.
@@ -314,6 +1046,7 @@ WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint32_t
     };
 
     uint16_t flags = (action == RTM_NEWRULE) ? NETLINK_CREATE_REQUEST_FLAGS : NETLINK_REQUEST_FLAGS;
+    RouteController::Batch batch;
     for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
         rule.family = AF_FAMILIES[i];
         if (int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov))) {
@@ -321,7 +1054,7 @@ WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint32_t
         }
     }
 
-    return 0;
+    return batch.commit();
 }
 
 WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint32_t table,
@@ -330,10 +1063,57 @@ WARN_UNUSED_RESULT int modifyIpRule(uint16_t action, uint32_t priority, uint32_t
                         INVALID_UID);
 }
 
-// Adds or deletes an IPv4 or IPv6 route.
+// Adds or deletes a rule of |family| that looks up |table| for packets from |source|, the way
+// "ip rule" would. When deleting, |source| and |priority| can be NULL and 0 to match any rule
+// that looks up |table|.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyExternalIpRule(uint16_t action, uint8_t family, uint32_t priority,
+                                            uint32_t table, const char* source) {
+    uint8_t rawSource[sizeof(in6_addr)];
+    uint8_t sourceLength = 0;
+    int rawLength = 0;
+    if (source) {
+        uint8_t sourceFamily;
+        rawLength = parsePrefix(source, &sourceFamily, rawSource, sizeof(rawSource),
+                                &sourceLength);
+        if (rawLength < 0) {
+            ALOGE("parsePrefix failed for source %s (%s)", source, strerror(-rawLength));
+            return rawLength;
+        }
+        if (sourceFamily != family) {
+            ALOGE("source %s doesn't match the address family %u", source, family);
+            return -EAFNOSUPPORT;
+        }
+    }
+
+    fib_rule_hdr rule = {
+        .family = family,
+        .src_len = sourceLength,
+        .action = FR_ACT_TO_TBL,
+    };
+
+    rtattr fraSrc = { U16_RTA_LENGTH(rawLength), FRA_SRC };
+
+    iovec iov[] = {
+        { NULL,             0 },
+        { &rule,            sizeof(rule) },
+        { &FRATTR_PRIORITY, priority ? sizeof(FRATTR_PRIORITY) : 0 },
+        { &priority,        priority ? sizeof(priority) : 0 },
+        { &FRATTR_TABLE,    sizeof(FRATTR_TABLE) },
+        { &table,           sizeof(table) },
+        { &fraSrc,          source ? sizeof(fraSrc) : 0 },
+        { rawSource,        static_cast<size_t>(rawLength) },
+    };
+
+    uint16_t flags = (action == RTM_NEWRULE) ? NETLINK_CREATE_REQUEST_FLAGS : NETLINK_REQUEST_FLAGS;
+    return sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov));
+}
+
+// Adds or deletes an IPv4 or IPv6 route. |metric| 0 means the kernel default.
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char* interface,
-                                     const char* destination, const char* nexthop) {
+                                     const char* destination, const char* nexthop,
+                                     uint32_t metric) {
     // At least the destination must be non-null.
     if (!destination) {
         ALOGE("null destination");
@@ -374,7 +1154,7 @@ WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char
     } else {
         // If an interface was specified, find the ifindex.
         if (interface != OIF_NONE) {
-            ifindex = if_nametoindex(interface);
+            ifindex = InterfaceRegistry::nameToIndex(interface);
             if (!ifindex) {
                 ALOGE("cannot find interface %s", interface);
                 return -ENODEV;
@@ -401,20 +1181,206 @@ WARN_UNUSED_RESULT int modifyIpRoute(uint16_t action, uint32_t table, const char
     rtattr rtaGateway = { U16_RTA_LENGTH(rawLength), RTA_GATEWAY };
 
     iovec iov[] = {
-        { NULL,          0 },
-        { &route,        sizeof(route) },
-        { &RTATTR_TABLE, sizeof(RTATTR_TABLE) },
-        { &table,        sizeof(table) },
-        { &rtaDst,       sizeof(rtaDst) },
-        { rawAddress,    static_cast<size_t>(rawLength) },
-        { &RTATTR_OIF,   interface != OIF_NONE ? sizeof(RTATTR_OIF) : 0 },
-        { &ifindex,      interface != OIF_NONE ? sizeof(ifindex) : 0 },
-        { &rtaGateway,   nexthop ? sizeof(rtaGateway) : 0 },
-        { rawNexthop,    nexthop ? static_cast<size_t>(rawLength) : 0 },
+        { NULL,             0 },
+        { &route,           sizeof(route) },
+        { &RTATTR_TABLE,    sizeof(RTATTR_TABLE) },
+        { &table,           sizeof(table) },
+        { &rtaDst,          sizeof(rtaDst) },
+        { rawAddress,       static_cast<size_t>(rawLength) },
+        { &RTATTR_OIF,      interface != OIF_NONE ? sizeof(RTATTR_OIF) : 0 },
+        { &ifindex,         interface != OIF_NONE ? sizeof(ifindex) : 0 },
+        { &rtaGateway,      nexthop ? sizeof(rtaGateway) : 0 },
+        { rawNexthop,       nexthop ? static_cast<size_t>(rawLength) : 0 },
+        { &RTATTR_PRIORITY, metric ? sizeof(RTATTR_PRIORITY) : 0 },
+        { &metric,          metric ? sizeof(metric) : 0 },
     };
 
+    // Whether the route already exists is left to the kernel (NLM_F_EXCL), rather than answered
+    // from the route cache, which a route the kernel deleted without notice may linger in.
+    CachedRoute cachedRoute;
+    makeCachedRoute(family, type, rawAddress, prefixLength, nexthop ? rawNexthop : NULL,
+                    interface != OIF_NONE ? ifindex : 0, metric, &cachedRoute);
+
     uint16_t flags = (action == RTM_NEWROUTE) ? NETLINK_CREATE_REQUEST_FLAGS :
                                                 NETLINK_REQUEST_FLAGS;
+    if (int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov))) {
+        return ret;
+    }
+
+    // If the request is in a batch, it hasn't actually been made yet. The notification of the
+    // kernel will update the cache once it is.
+    if (!activeBatch) {
+        if (action == RTM_NEWROUTE) {
+            addCachedRoute(table, cachedRoute);
+        } else {
+            removeCachedRoute(table, cachedRoute);
+        }
+    }
+    return 0;
+}
+
+// Adds or deletes an IPv4 or IPv6 route that spreads flows over |nexthops| in proportion to their
+// weights. The kernel doesn't report such routes the way they were requested (e.g., IPv6 splits them
+// into one route per nexthop), so the route cache is updated from the notifications of the kernel
+// rather than from the request.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyIpMultipathRoute(uint16_t action, uint32_t table,
+                                              const char* destination,
+                                              const std::vector<RouteController::Nexthop>& nexthops,
+                                              uint32_t metric) {
+    if (!destination) {
+        ALOGE("null destination");
+        return -EFAULT;
+    }
+    if (nexthops.empty()) {
+        ALOGE("no nexthops for multipath route to %s", destination);
+        return -EINVAL;
+    }
+
+    uint8_t rawAddress[sizeof(in6_addr)];
+    uint8_t family;
+    uint8_t prefixLength;
+    int rawLength = parsePrefix(destination, &family, rawAddress, sizeof(rawAddress),
+                                &prefixLength);
+    if (rawLength < 0) {
+        ALOGE("parsePrefix failed for destination %s (%s)", destination, strerror(-rawLength));
+        return rawLength;
+    }
+
+    // The payload of RTA_MULTIPATH: an rtnexthop for each nexthop, followed by its gateway.
+    std::string multipath;
+    bool hasGateway = false;
+    for (const RouteController::Nexthop& nexthop : nexthops) {
+        if (nexthop.weight < 1 || nexthop.weight > 256) {
+            ALOGE("invalid weight %u for nexthop through %s", nexthop.weight, nexthop.interface);
+            return -ERANGE;
+        }
+        uint32_t ifindex = InterfaceRegistry::nameToIndex(nexthop.interface);
+        if (!ifindex) {
+            ALOGE("cannot find interface %s", nexthop.interface);
+            return -ENODEV;
+        }
+        uint8_t rawGateway[sizeof(in6_addr)];
+        if (nexthop.gateway && inet_pton(family, nexthop.gateway, rawGateway) <= 0) {
+            ALOGE("inet_pton failed for gateway %s", nexthop.gateway);
+            return -EINVAL;
+        }
+
+        rtnexthop rtnh = {
+            .rtnh_len = static_cast<unsigned short>(
+                    RTNH_LENGTH(nexthop.gateway ? RTA_SPACE(rawLength) : 0)),
+            .rtnh_hops = static_cast<unsigned char>(nexthop.weight - 1),
+            .rtnh_ifindex = static_cast<int>(ifindex),
+        };
+        multipath.append(reinterpret_cast<const char*>(&rtnh), sizeof(rtnh));
+        if (nexthop.gateway) {
+            rtattr rtaGateway = { U16_RTA_LENGTH(rawLength), RTA_GATEWAY };
+            multipath.append(reinterpret_cast<const char*>(&rtaGateway), sizeof(rtaGateway));
+            multipath.append(reinterpret_cast<const char*>(rawGateway), rawLength);
+            hasGateway = true;
+        }
+    }
+
+    rtmsg route = {
+        .rtm_protocol = RTPROT_STATIC,
+        .rtm_type = RTN_UNICAST,
+        .rtm_family = family,
+        .rtm_dst_len = prefixLength,
+        .rtm_scope = static_cast<uint8_t>(hasGateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK),
+    };
+
+    rtattr rtaDst       = { U16_RTA_LENGTH(rawLength), RTA_DST };
+    rtattr rtaMultipath = { U16_RTA_LENGTH(multipath.size()), RTA_MULTIPATH };
+
+    iovec iov[] = {
+        { NULL,             0 },
+        { &route,           sizeof(route) },
+        { &RTATTR_TABLE,    sizeof(RTATTR_TABLE) },
+        { &table,           sizeof(table) },
+        { &rtaDst,          sizeof(rtaDst) },
+        { rawAddress,       static_cast<size_t>(rawLength) },
+        { &rtaMultipath,    sizeof(rtaMultipath) },
+        { &multipath[0],    multipath.size() },
+        { &RTATTR_PRIORITY, metric ? sizeof(RTATTR_PRIORITY) : 0 },
+        { &metric,          metric ? sizeof(metric) : 0 },
+    };
+
+    uint16_t flags = (action == RTM_NEWROUTE) ? NETLINK_CREATE_REQUEST_FLAGS :
+                                                NETLINK_REQUEST_FLAGS;
+    if (int ret = sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov))) {
+        return ret;
+    }
+
+    // The kernel sends its notifications before the ACK, so they are already waiting to be read.
+    if (!activeBatch) {
+        syncRouteCache();
+    }
+    return 0;
+}
+
+// Adds or deletes a route in a table that netd doesn't manage, the way "ip route" would. Unlike
+// modifyIpRoute(), a delete only matches the fields that are given (e.g., no interface means any
+// interface), whatever the protocol and scope of the route. |metric| 0 means the kernel default.
+// The route cache doesn't track these tables, so it's not consulted or updated.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyExternalIpRoute(uint16_t action, uint16_t flags, uint32_t table,
+                                             const char* interface, const char* destination,
+                                             const char* gateway, uint32_t metric) {
+    uint8_t rawAddress[sizeof(in6_addr)];
+    uint8_t family;
+    uint8_t prefixLength;
+    int rawLength = parsePrefix(destination, &family, rawAddress, sizeof(rawAddress),
+                                &prefixLength);
+    if (rawLength < 0) {
+        ALOGE("parsePrefix failed for destination %s (%s)", destination, strerror(-rawLength));
+        return rawLength;
+    }
+
+    uint32_t ifindex = 0;
+    if (interface) {
+        ifindex = InterfaceRegistry::nameToIndex(interface);
+        if (!ifindex) {
+            ALOGE("cannot find interface %s", interface);
+            return -ENODEV;
+        }
+    }
+
+    uint8_t rawGateway[sizeof(in6_addr)];
+    if (gateway && inet_pton(family, gateway, rawGateway) <= 0) {
+        ALOGE("inet_pton failed for gateway %s", gateway);
+        return -EINVAL;
+    }
+
+    rtmsg route = {
+        .rtm_family = family,
+        .rtm_dst_len = prefixLength,
+    };
+    if (action == RTM_NEWROUTE) {
+        route.rtm_protocol = RTPROT_STATIC;
+        route.rtm_scope = static_cast<uint8_t>(gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK);
+        route.rtm_type = RTN_UNICAST;
+    } else {
+        route.rtm_scope = RT_SCOPE_NOWHERE;
+    }
+
+    rtattr rtaDst     = { U16_RTA_LENGTH(rawLength), RTA_DST };
+    rtattr rtaGateway = { U16_RTA_LENGTH(rawLength), RTA_GATEWAY };
+
+    iovec iov[] = {
+        { NULL,             0 },
+        { &route,           sizeof(route) },
+        { &RTATTR_TABLE,    sizeof(RTATTR_TABLE) },
+        { &table,           sizeof(table) },
+        { &rtaDst,          sizeof(rtaDst) },
+        { rawAddress,       static_cast<size_t>(rawLength) },
+        { &RTATTR_OIF,      interface ? sizeof(RTATTR_OIF) : 0 },
+        { &ifindex,         interface ? sizeof(ifindex) : 0 },
+        { &rtaGateway,      gateway ? sizeof(rtaGateway) : 0 },
+        { rawGateway,       gateway ? static_cast<size_t>(rawLength) : 0 },
+        { &RTATTR_PRIORITY, metric ? sizeof(RTATTR_PRIORITY) : 0 },
+        { &metric,          metric ? sizeof(metric) : 0 },
+    };
+
     return sendNetlinkRequest(action, flags, iov, ARRAY_SIZE(iov));
 }
 
@@ -687,6 +1653,7 @@ WARN_UNUSED_RESULT int modifyPhysicalNetwork(unsigned netId, const char* interfa
     if (int ret = modifyIncomingPacketMark(netId, interface, permission, add)) {
         return ret;
     }
+    RouteController::Batch batch;
     if (int ret = modifyExplicitNetworkRule(netId, table, permission, INVALID_UID, INVALID_UID,
                                             add)) {
         return ret;
@@ -695,17 +1662,19 @@ WARN_UNUSED_RESULT int modifyPhysicalNetwork(unsigned netId, const char* interfa
                                             add)) {
         return ret;
     }
-    return modifyImplicitNetworkRule(netId, table, permission, add);
-}
-
-WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interface,
-                                            const UidRanges& uidRanges, bool secure, bool add,
-                                            bool modifyNonUidBasedRules) {
-    uint32_t table = getRouteTableForInterface(interface);
-    if (table == RT_TABLE_UNSPEC) {
-        return -ESRCH;
+    if (int ret = modifyImplicitNetworkRule(netId, table, permission, add)) {
+        return ret;
     }
+    return batch.commit();
+}
 
+// Adds or removes the per-UID-range rules of a VPN for all of |uidRanges|. The rules of all ranges
+// and both address families are sent to the kernel as one batch, which is much faster than a round
+// trip per rule when a VPN applies to many users.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyUidRangeRules(unsigned netId, const char* interface, uint32_t table,
+                                           const UidRanges& uidRanges, bool secure, bool add) {
+    RouteController::Batch batch;
     for (const UidRanges::Range& range : uidRanges.getRanges()) {
         if (int ret = modifyVpnUidRangeRule(table, range.first, range.second, secure, add)) {
             return ret;
@@ -719,21 +1688,43 @@ WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interfac
             return ret;
         }
     }
+    return batch.commit();
+}
+
+WARN_UNUSED_RESULT int modifyVirtualNetwork(unsigned netId, const char* interface,
+                                            const UidRanges& uidRanges, bool secure, bool add,
+                                            bool modifyNonUidBasedRules) {
+    uint32_t table = getRouteTableForInterface(interface);
+    if (table == RT_TABLE_UNSPEC) {
+        return -ESRCH;
+    }
 
     if (modifyNonUidBasedRules) {
         if (int ret = modifyIncomingPacketMark(netId, interface, PERMISSION_NONE, add)) {
             return ret;
         }
+    }
+
+    // Queue all the rules, so that they take a single round trip to the kernel.
+    RouteController::Batch batch;
+    if (int ret = modifyUidRangeRules(netId, interface, table, uidRanges, secure, add)) {
+        return ret;
+    }
+
+    if (modifyNonUidBasedRules) {
         if (int ret = modifyVpnOutputToLocalRule(interface, add)) {
             return ret;
         }
         if (int ret = modifyVpnSystemPermissionRule(netId, table, secure, add)) {
             return ret;
         }
-        return modifyExplicitNetworkRule(netId, table, PERMISSION_NONE, UID_ROOT, UID_ROOT, add);
+        if (int ret = modifyExplicitNetworkRule(netId, table, PERMISSION_NONE, UID_ROOT, UID_ROOT,
+                                                add)) {
+            return ret;
+        }
     }
 
-    return 0;
+    return batch.commit();
 }
 
 WARN_UNUSED_RESULT int modifyDefaultNetwork(uint16_t action, const char* interface,
@@ -767,52 +1758,55 @@ WARN_UNUSED_RESULT int modifyTetheredNetwork(uint16_t action, const char* inputI
                         inputInterface, OIF_NONE, INVALID_UID, INVALID_UID);
 }
 
+// Deletes all routing rules except the ones with priority 0 (i.e., the local table rule), just like
+// "ip rule flush".
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int flushRules() {
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "rule",
-            "flush",
-        };
-        if (android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv), NULL, false, false)) {
-            ALOGE("failed to flush rules");
-            return -EREMOTEIO;
+    auto shouldFlush = [](nlmsghdr* nh) {
+        rtattr* priority = findNetlinkAttribute(nh, sizeof(fib_rule_hdr), FRA_PRIORITY);
+        return priority && *static_cast<uint32_t*>(RTA_DATA(priority));
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        if (int ret = flushNetlinkObjects(RTM_GETRULE, RTM_DELRULE, AF_FAMILIES[i], shouldFlush)) {
+            ALOGE("failed to flush rules (%s)", strerror(-ret));
+            return ret;
         }
     }
     return 0;
 }
 
-// Adds or removes an IPv4 or IPv6 route to the specified table and, if it's a directly-connected
-// route, to the main table as well.
-// Returns 0 on success or negative errno on failure.
-WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const char* destination,
-                                   const char* nexthop, RouteController::TableType tableType) {
-    uint32_t table;
+// Returns the table used for routes of |tableType| through |interface|, or RT_TABLE_UNSPEC if
+// |interface| has no table.
+uint32_t getRouteTableForType(const char* interface, RouteController::TableType tableType) {
     switch (tableType) {
         case RouteController::INTERFACE: {
-            table = getRouteTableForInterface(interface);
-            if (table == RT_TABLE_UNSPEC) {
-                return -ESRCH;
-            }
-            break;
+            return getRouteTableForInterface(interface);
         }
         case RouteController::LOCAL_NETWORK: {
-            table = ROUTE_TABLE_LOCAL_NETWORK;
-            break;
+            return ROUTE_TABLE_LOCAL_NETWORK;
         }
         case RouteController::LEGACY_NETWORK: {
-            table = ROUTE_TABLE_LEGACY_NETWORK;
-            break;
+            return ROUTE_TABLE_LEGACY_NETWORK;
         }
         case RouteController::LEGACY_SYSTEM: {
-            table = ROUTE_TABLE_LEGACY_SYSTEM;
-            break;
+            return ROUTE_TABLE_LEGACY_SYSTEM;
         }
     }
+    return RT_TABLE_UNSPEC;
+}
+
+// Adds or removes an IPv4 or IPv6 route to the specified table and, if it's a directly-connected
+// route, to the main table as well.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const char* destination,
+                                   const char* nexthop, RouteController::TableType tableType,
+                                   uint32_t metric) {
+    uint32_t table = getRouteTableForType(interface, tableType);
+    if (table == RT_TABLE_UNSPEC) {
+        return -ESRCH;
+    }
 
-    int ret = modifyIpRoute(action, table, interface, destination, nexthop);
+    int ret = modifyIpRoute(action, table, interface, destination, nexthop, metric);
     // Trying to add a route that already exists shouldn't cause an error.
     if (ret && !(action == RTM_NEWROUTE && ret == -EEXIST)) {
         return ret;
@@ -821,6 +1815,27 @@ WARN_UNUSED_RESULT int modifyRoute(uint16_t action, const char* interface, const
     return 0;
 }
 
+// Like modifyRoute(), but for a multipath route. It goes in the table that |tableType| selects for
+// |interface|, whatever interfaces its nexthops go through.
+// Returns 0 on success or negative errno on failure.
+WARN_UNUSED_RESULT int modifyMultipathRoute(uint16_t action, const char* interface,
+                                            const char* destination,
+                                            const std::vector<RouteController::Nexthop>& nexthops,
+                                            RouteController::TableType tableType,
+                                            uint32_t metric) {
+    uint32_t table = getRouteTableForType(interface, tableType);
+    if (table == RT_TABLE_UNSPEC) {
+        return -ESRCH;
+    }
+
+    int ret = modifyIpMultipathRoute(action, table, destination, nexthops, metric);
+    if (ret && !(action == RTM_NEWROUTE && ret == -EEXIST)) {
+        return ret;
+    }
+
+    return 0;
+}
+
 // Returns 0 on success or negative errno on failure.
 WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
     uint32_t table = getRouteTableForInterface(interface);
@@ -828,37 +1843,17 @@ WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
         return -ESRCH;
     }
 
-    char tableString[UINT32_STRLEN];
-    snprintf(tableString, sizeof(tableString), "%u", table);
+    auto shouldFlush = [table](nlmsghdr* nh) {
+        return getRouteTable(nh) == table;
+    };
 
     int ret = 0;
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "route",
-            "flush",
-            "table",
-            tableString,
-        };
-
-        // A flush works by dumping routes and deleting each route as it's returned, and it can
-        // fail if something else deletes the route between the dump and the delete. This can
-        // happen, for example, if an interface goes down while we're trying to flush its routes.
-        // So try multiple times and only return an error if the last attempt fails.
-        //
-        // TODO: replace this with our own netlink code.
-        unsigned attempts = 0;
-        int err;
-        do {
-            err = android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv),
-                                      NULL, false, false);
-            ++attempts;
-        } while (err != 0 && attempts < ROUTE_FLUSH_ATTEMPTS);
-        if (err) {
-            ALOGE("failed to flush %s routes in table %s after %d attempts",
-                  IP_VERSIONS[i], tableString, attempts);
-            ret = -EREMOTEIO;
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        if (int err = flushNetlinkObjects(RTM_GETROUTE, RTM_DELROUTE, AF_FAMILIES[i],
+                                          shouldFlush)) {
+            ALOGE("failed to flush IPv%d routes in table %u (%s)",
+                  AF_FAMILIES[i] == AF_INET ? 4 : 6, table, strerror(-err));
+            ret = err;
         }
     }
 
@@ -866,6 +1861,7 @@ WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
     // track of its name.
     if (!ret) {
         interfaceToTable.erase(interface);
+        routeCache.erase(table);
     }
 
     return ret;
@@ -873,10 +1869,45 @@ WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
 
 }  // namespace
 
+RouteController::Batch::Batch() : mOwner(activeBatch == NULL) {
+    if (mOwner) {
+        activeBatch = this;
+    }
+}
+
+RouteController::Batch::~Batch() {
+    if (mOwner) {
+        activeBatch = NULL;
+    }
+}
+
+void RouteController::Batch::add(const std::string& request) {
+    mRequests.push_back(request);
+}
+
+int RouteController::Batch::commit() {
+    if (!mOwner) {
+        return 0;
+    }
+    int ret = sendNetlinkRequests(&mRequests, false);
+    mRequests.clear();
+    return ret;
+}
+
+int RouteController::Batch::commitIgnoringMissing() {
+    if (!mOwner) {
+        return 0;
+    }
+    int ret = sendNetlinkRequests(&mRequests, true);
+    mRequests.clear();
+    return ret;
+}
+
 int RouteController::Init(unsigned localNetId) {
     if (int ret = flushRules()) {
         return ret;
     }
+    Batch batch;
     if (int ret = addLegacyRouteRules()) {
         return ret;
     }
@@ -889,6 +1920,11 @@ int RouteController::Init(unsigned localNetId) {
     if (int ret = addUnreachableRule()) {
         return ret;
     }
+    if (int ret = batch.commit()) {
+        return ret;
+    }
+    // Start listening to route notifications, so that the route cache is filled from here on.
+    syncRouteCache();
     updateTableNamesFile();
     return 0;
 }
@@ -977,13 +2013,91 @@ int RouteController::removeInterfaceFromDefaultNetwork(const char* interface,
 }
 
 int RouteController::addRoute(const char* interface, const char* destination, const char* nexthop,
-                              TableType tableType) {
-    return modifyRoute(RTM_NEWROUTE, interface, destination, nexthop, tableType);
+                              TableType tableType, uint32_t metric) {
+    return modifyRoute(RTM_NEWROUTE, interface, destination, nexthop, tableType, metric);
 }
 
 int RouteController::removeRoute(const char* interface, const char* destination,
-                                 const char* nexthop, TableType tableType) {
-    return modifyRoute(RTM_DELROUTE, interface, destination, nexthop, tableType);
+                                 const char* nexthop, TableType tableType, uint32_t metric) {
+    return modifyRoute(RTM_DELROUTE, interface, destination, nexthop, tableType, metric);
+}
+
+int RouteController::addMultipathRoute(const char* interface, const char* destination,
+                                       const std::vector<Nexthop>& nexthops, TableType tableType,
+                                       uint32_t metric) {
+    return modifyMultipathRoute(RTM_NEWROUTE, interface, destination, nexthops, tableType, metric);
+}
+
+int RouteController::removeMultipathRoute(const char* interface, const char* destination,
+                                          const std::vector<Nexthop>& nexthops,
+                                          TableType tableType, uint32_t metric) {
+    return modifyMultipathRoute(RTM_DELROUTE, interface, destination, nexthops, tableType,
+                                metric);
+}
+
+int RouteController::getRoutes(const char* interface, TableType tableType,
+                               std::vector<std::string>* routes) {
+    uint32_t table = getRouteTableForType(interface, tableType);
+    if (table == RT_TABLE_UNSPEC) {
+        return -ESRCH;
+    }
+    syncRouteCache();
+    if (!routeCacheValid) {
+        return -EAGAIN;
+    }
+    auto iter = routeCache.find(table);
+    if (iter == routeCache.end()) {
+        return 0;
+    }
+
+    const char* tableName = interface;
+    switch (tableType) {
+        case INTERFACE:      tableName = interface;                        break;
+        case LOCAL_NETWORK:  tableName = ROUTE_TABLE_NAME_LOCAL_NETWORK;   break;
+        case LEGACY_NETWORK: tableName = ROUTE_TABLE_NAME_LEGACY_NETWORK;  break;
+        case LEGACY_SYSTEM:  tableName = ROUTE_TABLE_NAME_LEGACY_SYSTEM;   break;
+    }
+    // Only interface tables belong to one interface. The others are shared by all the interfaces
+    // of a network (or all networks), so pick the routes that go through |interface|. Index 0
+    // would match every route without an interface, such as unreachable and throw routes.
+    uint32_t ifindex = 0;
+    if (tableType != INTERFACE) {
+        ifindex = InterfaceRegistry::nameToIndex(interface);
+        if (!ifindex) {
+            return -ENODEV;
+        }
+    }
+    for (const CachedRoute& route : iter->second) {
+        if (tableType != INTERFACE && !routeUsesInterface(route, ifindex)) {
+            continue;
+        }
+        routes->push_back(describeCachedRoute(route) + " table " + tableName);
+    }
+    return 0;
+}
+
+int RouteController::addExternalRoute(uint32_t table, const char* interface,
+                                      const char* destination, const char* gateway,
+                                      uint32_t metric, bool replace) {
+    uint16_t flags = replace ? NETLINK_REQUEST_FLAGS | NLM_F_CREATE | NLM_F_REPLACE :
+                               NETLINK_CREATE_REQUEST_FLAGS;
+    return modifyExternalIpRoute(RTM_NEWROUTE, flags, table, interface, destination, gateway,
+                                 metric);
+}
+
+int RouteController::removeExternalRoute(uint32_t table, const char* interface,
+                                         const char* destination) {
+    return modifyExternalIpRoute(RTM_DELROUTE, NETLINK_REQUEST_FLAGS, table, interface,
+                                 destination, NULL, 0);
+}
+
+int RouteController::addExternalSourceRule(uint8_t family, uint32_t priority, uint32_t table,
+                                           const char* source) {
+    return modifyExternalIpRule(RTM_NEWRULE, family, priority, table, source);
+}
+
+int RouteController::removeExternalTableRule(uint8_t family, uint32_t table) {
+    return modifyExternalIpRule(RTM_DELRULE, family, 0, table, NULL);
 }
 
 int RouteController::enableTethering(const char* inputInterface, const char* outputInterface) {
@@ -20,7 +20,9 @@
 #include "NetdConstants.h"
 #include "Permission.h"
 
+#include <string>
 #include <sys/types.h>
+#include <vector>
 
 class UidRanges;
 
@@ -36,6 +38,42 @@ public:
 
     static const int ROUTE_TABLE_OFFSET_FROM_INDEX = 1000;
 
+    // A nexthop of a multipath route. |gateway| can be NULL for a directly-connected nexthop.
+    // |weight| (1 to 256) is the share of flows that go through it, relative to the others.
+    struct Nexthop {
+        const char* interface;
+        const char* gateway;
+        unsigned weight;
+    };
+
+    // Queues the netlink requests of all the calls below made while it's alive, so that commit()
+    // can send them to the kernel together, in order, and match the ACKs back to them. Until then,
+    // those calls only report errors detected before talking to the kernel. Batches can be nested;
+    // only the outermost one sends anything. Requests that haven't been committed when the
+    // outermost batch goes away are dropped.
+    class Batch {
+    public:
+        Batch();
+        ~Batch();
+
+        // Returns 0 on success or the first error (negative errno) of the queued requests.
+        int commit() WARN_UNUSED_RESULT;
+        // Same, but deleting something that doesn't exist isn't an error. Meant for cleaning up
+        // after a commit that failed half-way.
+        int commitIgnoringMissing() WARN_UNUSED_RESULT;
+
+        // Used internally to queue a request.
+        void add(const std::string& request);
+
+    private:
+        const bool mOwner;
+        std::vector<std::string> mRequests;
+
+        // Not copyable.
+        Batch(const Batch&);
+        Batch& operator=(const Batch&);
+    };
+
     static int Init(unsigned localNetId) WARN_UNUSED_RESULT;
 
     static int addInterfaceToLocalNetwork(unsigned netId, const char* interface) WARN_UNUSED_RESULT;
@@ -68,10 +106,39 @@ public:
 
     // |nexthop| can be NULL (to indicate a directly-connected route), "unreachable" (to indicate a
     // route that's blocked), "throw" (to indicate the lack of a match), or a regular IP address.
+    // |metric| 0 means the kernel default.
     static int addRoute(const char* interface, const char* destination, const char* nexthop,
-                        TableType tableType) WARN_UNUSED_RESULT;
+                        TableType tableType, uint32_t metric) WARN_UNUSED_RESULT;
     static int removeRoute(const char* interface, const char* destination, const char* nexthop,
-                           TableType tableType) WARN_UNUSED_RESULT;
+                           TableType tableType, uint32_t metric) WARN_UNUSED_RESULT;
+
+    // Multipath (ECMP) routes spread flows over several nexthops, possibly through different
+    // interfaces. The route goes in the table that |tableType| selects for |interface|.
+    static int addMultipathRoute(const char* interface, const char* destination,
+                                 const std::vector<Nexthop>& nexthops, TableType tableType,
+                                 uint32_t metric) WARN_UNUSED_RESULT;
+    static int removeMultipathRoute(const char* interface, const char* destination,
+                                    const std::vector<Nexthop>& nexthops, TableType tableType,
+                                    uint32_t metric) WARN_UNUSED_RESULT;
+
+    // Appends to |routes| the routes of |tableType| through |interface|, in the style of "ip route".
+    // Served from a cache that is kept in sync with the kernel, so it doesn't need to dump routes.
+    static int getRoutes(const char* interface, TableType tableType,
+                         std::vector<std::string>* routes) WARN_UNUSED_RESULT;
+
+    // Operations on route tables that netd doesn't manage, for vendor source routing (see
+    // QcRouteController). |destination| and |source| are prefixes, |interface| and |gateway| can
+    // be NULL, and |metric| 0 means the kernel default. removeExternalRoute() removes the first
+    // route that matches the fields given, and removeExternalTableRule() the first rule that looks
+    // up |table|.
+    static int addExternalRoute(uint32_t table, const char* interface, const char* destination,
+                                const char* gateway, uint32_t metric,
+                                bool replace) WARN_UNUSED_RESULT;
+    static int removeExternalRoute(uint32_t table, const char* interface,
+                                   const char* destination) WARN_UNUSED_RESULT;
+    static int addExternalSourceRule(uint8_t family, uint32_t priority, uint32_t table,
+                                     const char* source) WARN_UNUSED_RESULT;
+    static int removeExternalTableRule(uint8_t family, uint32_t table) WARN_UNUSED_RESULT;
 
     static int enableTethering(const char* inputInterface,
                                const char* outputInterface) WARN_UNUSED_RESULT;
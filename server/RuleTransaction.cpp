@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "RuleTransaction.h"
+
+#include "IptablesRestoreController.h"
+#include "ShadowRuleStore.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+namespace {
+
+std::vector<const char*> toArgv(const std::vector<std::string>& command) {
+    std::vector<const char*> argv;
+    for (size_t i = 0; i < command.size(); ++i) {
+        argv.push_back(command[i].c_str());
+    }
+    argv.push_back(NULL);
+    return argv;
+}
+
+std::string toString(const std::vector<std::string>& command) {
+    std::string s;
+    for (size_t i = 0; i < command.size(); ++i) {
+        if (i) {
+            s += ' ';
+        }
+        s += command[i];
+    }
+    return s;
+}
+
+// Computes the command that undoes |command|. Only additions can be undone: appended and inserted
+// rules are deleted again, and created chains are removed.
+bool invertCommand(const std::vector<std::string>& command, std::vector<std::string>* inverse) {
+    for (size_t i = 0; i < command.size(); ++i) {
+        const std::string& arg = command[i];
+        if (arg == "-w") {
+            continue;
+        }
+        if (arg == "-t") {
+            ++i;
+            continue;
+        }
+        *inverse = command;
+        if (arg == "-A" || arg == "-I") {
+            (*inverse)[i] = "-D";
+            // "-I chain N rule..." inserts at position N; the deletion has to match the rule only.
+            if (arg == "-I" && i + 2 < command.size() && isdigit(command[i + 2][0])) {
+                inverse->erase(inverse->begin() + i + 2);
+            }
+            return true;
+        }
+        if (arg == "-N") {
+            (*inverse)[i] = "-X";
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
+}  // namespace
+
+RuleTransaction::RuleTransaction(IptablesTarget target) : mTarget(target) {
+}
+
+void RuleTransaction::add(const char* command) {
+    Command args;
+    std::string cmd(command);
+    size_t start = 0;
+    while (start < cmd.size()) {
+        size_t end = cmd.find(' ', start);
+        if (end == std::string::npos) {
+            end = cmd.size();
+        }
+        if (end > start) {
+            args.push_back(cmd.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    mCommands.push_back(args);
+}
+
+void RuleTransaction::add(int argc, const char* argv[]) {
+    Command args;
+    for (int i = 0; i < argc && argv[i]; ++i) {
+        args.push_back(argv[i]);
+    }
+    mCommands.push_back(args);
+}
+
+int RuleTransaction::commit() {
+    return commit(false);
+}
+
+int RuleTransaction::commitInOneRestore() {
+    return commit(true);
+}
+
+int RuleTransaction::commit(bool oneRestore) {
+    std::vector<IptablesTarget> families;
+    if (mTarget == V4 || mTarget == V4V6) {
+        families.push_back(V4);
+    }
+    if (mTarget == V6 || mTarget == V4V6) {
+        families.push_back(V6);
+    }
+
+    int ret = 0;
+    std::vector<std::vector<size_t> > applied(families.size());
+    for (size_t i = 0; i < families.size(); ++i) {
+        if ((ret = apply(families[i], oneRestore, &applied[i]))) {
+            // The failing family has already rolled itself back. Undo what the ones before it did.
+            for (size_t j = 0; j < i; ++j) {
+                rollback(families[j], applied[j]);
+            }
+            break;
+        }
+    }
+
+    mCommands.clear();
+    return ret;
+}
+
+// Applies all commands to a single family and returns the indices of those that were applied in
+// |applied|. On failure, the family is left as it was, as far as rollback allows.
+int RuleTransaction::apply(IptablesTarget family, bool oneRestore,
+                           std::vector<size_t>* applied) const {
+    // One COMMIT block per table, in the order in which the tables are first used.
+    std::vector<std::string> tables;
+    std::vector<std::string> blocks;
+    std::vector<std::vector<size_t> > blockCommands;
+
+    for (size_t i = 0; i < mCommands.size(); ++i) {
+        std::vector<const char*> argv = toArgv(mCommands[i]);
+        std::string table, line;
+        if (!IptablesRestoreController::toRestoreLine(argv.size() - 1, argv.data(), &table,
+                                                      &line)) {
+            return applyOneByOne(family, applied);
+        }
+        size_t t = 0;
+        while (t < tables.size() && tables[t] != table) {
+            ++t;
+        }
+        if (t == tables.size()) {
+            tables.push_back(table);
+            blocks.push_back("*" + table + "\n");
+            blockCommands.push_back(std::vector<size_t>());
+        }
+        blocks[t] += line + "\n";
+        blockCommands[t].push_back(i);
+    }
+
+    // In one-restore mode, all blocks are sent at once, but iptables-restore still commits them
+    // one by one, so a failure leaves the blocks before it in place. Either way, exactly the
+    // tables that were committed are recorded and, on failure, rolled back.
+    std::vector<int> results;
+    if (oneRestore) {
+        std::vector<std::string> commitBlocks;
+        for (size_t t = 0; t < blocks.size(); ++t) {
+            commitBlocks.push_back(blocks[t] + "COMMIT\n");
+        }
+        if (IptablesRestoreController::execute(family, commitBlocks, &results) == -EOPNOTSUPP) {
+            return applyOneByOne(family, applied);
+        }
+    }
+
+    applied->clear();
+    int ret = 0;
+    for (size_t t = 0; t < blocks.size(); ++t) {
+        int result;
+        if (oneRestore) {
+            result = results[t];
+        } else {
+            result = IptablesRestoreController::execute(family, blocks[t] + "COMMIT\n", false);
+            if (result == -EOPNOTSUPP && t == 0) {
+                return applyOneByOne(family, applied);
+            }
+        }
+        if (result) {
+            if (!ret) {
+                ALOGE("failed to commit %s table, rolling back", tables[t].c_str());
+                ret = result;
+            }
+            if (oneRestore) {
+                // The blocks after it may still have been committed.
+                continue;
+            }
+            break;
+        }
+        for (size_t j = 0; j < blockCommands[t].size(); ++j) {
+            std::vector<const char*> argv = toArgv(mCommands[blockCommands[t][j]]);
+            ShadowRuleStore::update(family, argv.size() - 1, argv.data());
+        }
+        applied->insert(applied->end(), blockCommands[t].begin(), blockCommands[t].end());
+    }
+    if (ret) {
+        rollback(family, *applied);
+        applied->clear();
+    }
+    return ret;
+}
+
+int RuleTransaction::applyOneByOne(IptablesTarget family, std::vector<size_t>* applied) const {
+    applied->clear();
+    for (size_t i = 0; i < mCommands.size(); ++i) {
+        std::vector<const char*> argv = toArgv(mCommands[i]);
+        if (execIptablesArgv(family, false, argv.size() - 1, argv.data())) {
+            ALOGE("failed to apply \"%s\", rolling back", toString(mCommands[i]).c_str());
+            rollback(family, *applied);
+            applied->clear();
+            return -EREMOTEIO;
+        }
+        applied->push_back(i);
+    }
+    return 0;
+}
+
+void RuleTransaction::rollback(IptablesTarget family, const std::vector<size_t>& applied) const {
+    for (std::vector<size_t>::const_reverse_iterator it = applied.rbegin(); it != applied.rend();
+         ++it) {
+        Command inverse;
+        if (!invertCommand(mCommands[*it], &inverse)) {
+            ALOGW("can't roll back \"%s\"", toString(mCommands[*it]).c_str());
+            continue;
+        }
+        std::vector<const char*> argv = toArgv(inverse);
+        execIptablesArgv(family, true, argv.size() - 1, argv.data());
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_RULE_TRANSACTION_H
+#define NETD_SERVER_RULE_TRANSACTION_H
+
+#include "NetdConstants.h"
+
+#include <string>
+#include <vector>
+
+// Collects a sequence of dependent iptables commands and applies them as a unit.
+//
+// On commit, the commands are grouped into one iptables-restore COMMIT block per table and family.
+// The kernel replaces a table in one go when a block is committed, so a failing command leaves that
+// table untouched. If a later block fails, the blocks that were already committed are rolled back:
+// appended or inserted rules are deleted and newly created chains are removed. Flushes and
+// deletions can't be undone this way, so callers should keep those at the start of a transaction,
+// in the same table as the rules that replace them.
+//
+// If the restore backend isn't available, the commands are run one by one and rolled back the same
+// way if one of them fails.
+class RuleTransaction {
+public:
+    explicit RuleTransaction(IptablesTarget target);
+
+    // Queues an iptables command line, without the binary name, with arguments separated by single
+    // spaces (e.g., "-w -t raw -A bw_raw_PREROUTING -m owner --socket-exists").
+    void add(const char* command);
+    // Same, with the arguments given separately. |argv| may be padded with NULLs after the last
+    // argument, like the command tables in NatController.
+    void add(int argc, const char* argv[]);
+
+    // Applies all queued commands. Returns 0 on success or a negative errno on failure, in which
+    // case the changes have been rolled back as described above. The transaction is empty again
+    // afterwards and may be reused.
+    int commit() WARN_UNUSED_RESULT;
+
+    // Same, but sends the blocks of all tables to the restore process at once, which costs one
+    // round trip per family instead of one per table. The blocks are still committed one by one,
+    // and on failure the tables that were committed are rolled back as above.
+    int commitInOneRestore() WARN_UNUSED_RESULT;
+
+private:
+    typedef std::vector<std::string> Command;
+
+    int commit(bool oneRestore) WARN_UNUSED_RESULT;
+    int apply(IptablesTarget family, bool oneRestore,
+              std::vector<size_t>* applied) const WARN_UNUSED_RESULT;
+    int applyOneByOne(IptablesTarget family,
+                      std::vector<size_t>* applied) const WARN_UNUSED_RESULT;
+    void rollback(IptablesTarget family, const std::vector<size_t>& applied) const;
+
+    const IptablesTarget mTarget;
+    std::vector<Command> mCommands;
+};
+
+#endif  // NETD_SERVER_RULE_TRANSACTION_H
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ShadowRuleStore.h"
+
+#include "IptablesCounterReader.h"
+
+#define LOG_TAG "Netd"
+#include "log/log.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <utils/Mutex.h>
+
+namespace {
+
+const char* const OWNED_PREFIXES[] = {
+    "bw_",
+    "natctrl_",
+    "fw_",
+    "idletimer_",
+    "oem_",
+};
+
+// iptables accepts both spellings of these, so rules are stored with the short one.
+const char* const LONG_OPTIONS[][2] = {
+    {"--jump", "-j"},
+    {"--goto", "-g"},
+    {"--in-interface", "-i"},
+    {"--out-interface", "-o"},
+    {"--protocol", "-p"},
+    {"--match", "-m"},
+    {"--source", "-s"},
+    {"--destination", "-d"},
+};
+
+struct Chain {
+    Chain() : complete(false) {}
+
+    // Whether |rules| is known to match the kernel.
+    bool complete;
+    std::vector<std::string> rules;
+};
+
+struct Table {
+    Table() : seeded(false), known(false) {}
+
+    bool seeded;
+    // Whether the list of chains could be read from the kernel. If not, a chain that isn't in
+    // |chains| may still exist.
+    bool known;
+    std::map<std::string, Chain> chains;
+};
+
+typedef std::map<std::string, Table> Tables;
+
+// A parsed iptables command line.
+struct Command {
+    Command() : index(0) {}
+
+    std::string table;
+    std::string op;
+    std::string chain;
+    std::string newChain;  // For -E.
+    int index;             // 1-based rule position for -I, -R and -D, or 0 if not given.
+    std::string rule;
+};
+
+Tables sTables[2];  // Indexed by family: V4, V6.
+android::Mutex sLock;
+
+bool isOwned(const std::string& chain) {
+    for (size_t i = 0; i < ARRAY_SIZE(OWNED_PREFIXES); ++i) {
+        if (!chain.compare(0, strlen(OWNED_PREFIXES[i]), OWNED_PREFIXES[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isIndex(const char* arg) {
+    if (!*arg) {
+        return false;
+    }
+    for (const char* p = arg; *p; ++p) {
+        if (!isdigit(*p)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const char* canonicalOption(const char* arg) {
+    for (size_t i = 0; i < ARRAY_SIZE(LONG_OPTIONS); ++i) {
+        if (!strcmp(arg, LONG_OPTIONS[i][0])) {
+            return LONG_OPTIONS[i][1];
+        }
+    }
+    return arg;
+}
+
+bool parseCommand(int argc, const char* argv[], Command* command) {
+    command->table = "filter";
+    int i = 0;
+    for (; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "-w")) {
+            continue;
+        }
+        if (!strcmp(arg, "-t") && i + 1 < argc) {
+            command->table = argv[++i];
+            continue;
+        }
+        if (arg[0] != '-' || strlen(arg) != 2) {
+            return false;
+        }
+        command->op = arg;
+        ++i;
+        break;
+    }
+    if (command->op.empty()) {
+        return false;
+    }
+
+    if (i < argc && argv[i][0] != '-') {
+        command->chain = argv[i++];
+    }
+    if (command->op == "-E" && i < argc) {
+        command->newChain = argv[i++];
+    }
+    if ((command->op == "-I" || command->op == "-R" || command->op == "-D") && i < argc &&
+            isIndex(argv[i])) {
+        command->index = atoi(argv[i++]);
+    }
+
+    for (; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "-w")) {
+            continue;
+        }
+        if (!strcmp(arg, "-t") && i + 1 < argc) {
+            command->table = argv[++i];
+            continue;
+        }
+        if (!command->rule.empty()) {
+            command->rule += ' ';
+        }
+        command->rule += canonicalOption(arg);
+        // The kernel ignores the remaining quota when matching a rule for deletion, and so must we.
+        if (!strcmp(arg, "--quota") && i + 1 < argc) {
+            command->rule += " *";
+            ++i;
+        }
+    }
+    return true;
+}
+
+Table& getTable(IptablesTarget family, const std::string& name) {
+    Table& table = sTables[family == V4 ? 0 : 1][name];
+    if (!table.seeded) {
+        table.seeded = true;
+        table.known = false;
+        std::vector<std::string> chains;
+        int ret = IptablesCounterReader::listChains(family, name.c_str(), &chains);
+        if (ret) {
+            ALOGW("can't list chains of %s table: %s", name.c_str(), strerror(-ret));
+            return table;
+        }
+        table.known = true;
+        for (size_t i = 0; i < chains.size(); ++i) {
+            if (isOwned(chains[i])) {
+                table.chains[chains[i]];
+            }
+        }
+    }
+    return table;
+}
+
+int findRule(const Chain& chain, const std::string& rule) {
+    for (size_t i = 0; i < chain.rules.size(); ++i) {
+        if (chain.rules[i] == rule) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Commands without a chain apply to every chain in the table. Those we don't model beyond
+// forgetting what we know.
+//
+// Only commands that can't change anything are skipped. Commands that the model expects to fail
+// still go to the kernel: if something outside netd has added the rule or chain, it's the kernel
+// that knows, and skipping the command would leave it there for good.
+ShadowRuleStore::Verdict checkCommand(const Table& table, const Command& command) {
+    if (!isOwned(command.chain)) {
+        return ShadowRuleStore::APPLY;
+    }
+
+    std::map<std::string, Chain>::const_iterator it = table.chains.find(command.chain);
+    if (it == table.chains.end() || !it->second.complete) {
+        return ShadowRuleStore::APPLY;
+    }
+    if (command.op == "-F" && it->second.rules.empty()) {
+        return ShadowRuleStore::SKIP_SUCCESS;
+    }
+    return ShadowRuleStore::APPLY;
+}
+
+// Called when the kernel rejected a command. If the model expected it to succeed, the model is
+// wrong about the chain, so stop answering anything about it from memory.
+void recordCommandFailure(Table* table, const Command& command) {
+    if (!isOwned(command.chain)) {
+        return;
+    }
+    std::map<std::string, Chain>::iterator it = table->chains.find(command.chain);
+    if (command.op == "-N") {
+        // The chain exists after all.
+        if (it == table->chains.end()) {
+            table->chains[command.chain];
+        }
+        return;
+    }
+    if (it == table->chains.end()) {
+        return;
+    }
+    Chain& chain = it->second;
+    if (command.op == "-F") {
+        // Flushing only fails if the chain doesn't exist.
+        table->chains.erase(it);
+    } else if (command.op == "-D" && chain.complete &&
+               (command.index ? static_cast<size_t>(command.index) <= chain.rules.size() :
+                                findRule(chain, command.rule) >= 0)) {
+        chain.complete = false;
+    }
+}
+
+void updateChain(Chain* chain, const Command& command) {
+    if (command.op == "-F") {
+        chain->rules.clear();
+        chain->complete = true;
+        return;
+    }
+    if (!chain->complete) {
+        return;
+    }
+
+    std::vector<std::string>& rules = chain->rules;
+    size_t position = command.index ? command.index - 1 : 0;
+    if (command.op == "-A") {
+        rules.push_back(command.rule);
+    } else if (command.op == "-I" && position <= rules.size()) {
+        rules.insert(rules.begin() + position, command.rule);
+    } else if (command.op == "-R" && command.index && position < rules.size()) {
+        rules[position] = command.rule;
+    } else if (command.op == "-D" && command.index && position < rules.size()) {
+        rules.erase(rules.begin() + position);
+    } else if (command.op == "-D" && !command.index && findRule(*chain, command.rule) >= 0) {
+        rules.erase(rules.begin() + findRule(*chain, command.rule));
+    } else if (command.op != "-Z" && command.op != "-L" && command.op != "-S" &&
+               command.op != "-C") {
+        // The kernel accepted something we didn't expect. Stop trusting our copy.
+        chain->complete = false;
+    }
+}
+
+void updateTable(Table* table, const Command& command) {
+    if (command.chain.empty()) {
+        if (command.op == "-F" || command.op == "-X") {
+            // Flushing or deleting all chains; simplest to start over.
+            *table = Table();
+        }
+        return;
+    }
+
+    if (command.op == "-N") {
+        if (isOwned(command.chain)) {
+            table->chains[command.chain].complete = true;
+        }
+        return;
+    }
+    if (command.op == "-X") {
+        table->chains.erase(command.chain);
+        return;
+    }
+    if (command.op == "-E") {
+        std::map<std::string, Chain>::iterator it = table->chains.find(command.chain);
+        Chain chain;
+        if (it != table->chains.end()) {
+            chain = it->second;
+            table->chains.erase(it);
+        }
+        if (isOwned(command.newChain)) {
+            table->chains[command.newChain] = chain;
+        }
+        return;
+    }
+
+    std::map<std::string, Chain>::iterator it = table->chains.find(command.chain);
+    if (it != table->chains.end()) {
+        updateChain(&it->second, command);
+    }
+}
+
+}  // namespace
+
+ShadowRuleStore::Verdict ShadowRuleStore::check(IptablesTarget family, int argc,
+                                                const char* argv[]) {
+    Command command;
+    if (!parseCommand(argc, argv, &command)) {
+        return APPLY;
+    }
+    android::Mutex::Autolock lock(sLock);
+    return checkCommand(getTable(family, command.table), command);
+}
+
+void ShadowRuleStore::update(IptablesTarget family, int argc, const char* argv[]) {
+    Command command;
+    if (!parseCommand(argc, argv, &command)) {
+        return;
+    }
+    android::Mutex::Autolock lock(sLock);
+    updateTable(&getTable(family, command.table), command);
+}
+
+void ShadowRuleStore::recordFailure(IptablesTarget family, int argc, const char* argv[]) {
+    Command command;
+    if (!parseCommand(argc, argv, &command)) {
+        return;
+    }
+    android::Mutex::Autolock lock(sLock);
+    recordCommandFailure(&getTable(family, command.table), command);
+}
+
+void ShadowRuleStore::forgetRules(const char* prefix) {
+    android::Mutex::Autolock lock(sLock);
+    for (size_t family = 0; family < ARRAY_SIZE(sTables); ++family) {
+        for (Tables::iterator table = sTables[family].begin(); table != sTables[family].end();
+             ++table) {
+            std::map<std::string, Chain>& chains = table->second.chains;
+            for (std::map<std::string, Chain>::iterator it = chains.begin(); it != chains.end();) {
+                if (!it->first.compare(0, strlen(prefix), prefix)) {
+                    chains.erase(it++);
+                } else {
+                    ++it;
+                }
+            }
+            // Chains may have been created as well, so read the list of chains again on next use.
+            table->second.seeded = false;
+        }
+    }
+}
+
+std::vector<std::string> ShadowRuleStore::listChains(IptablesTarget family, const char* table,
+                                                     const char* prefix) {
+    android::Mutex::Autolock lock(sLock);
+    std::vector<std::string> names;
+    const std::map<std::string, Chain>& chains = getTable(family, table).chains;
+    for (std::map<std::string, Chain>::const_iterator it = chains.begin(); it != chains.end();
+         ++it) {
+        if (!it->first.compare(0, strlen(prefix), prefix)) {
+            names.push_back(it->first);
+        }
+    }
+    return names;
+}
+
+void ShadowRuleStore::dump(std::vector<std::string>* output) {
+    android::Mutex::Autolock lock(sLock);
+    for (size_t family = 0; family < ARRAY_SIZE(sTables); ++family) {
+        for (Tables::const_iterator table = sTables[family].begin();
+             table != sTables[family].end(); ++table) {
+            const std::map<std::string, Chain>& chains = table->second.chains;
+            for (std::map<std::string, Chain>::const_iterator it = chains.begin();
+                 it != chains.end(); ++it) {
+                const Chain& chain = it->second;
+                output->push_back(std::string(family ? "v6 " : "v4 ") + table->first + " " +
+                                  it->first + (chain.complete ? "" : " (rules unknown)"));
+                for (size_t i = 0; i < chain.rules.size(); ++i) {
+                    output->push_back("  -A " + it->first + " " + chain.rules[i]);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_SHADOW_RULE_STORE_H
+#define NETD_SERVER_SHADOW_RULE_STORE_H
+
+#include "NetdConstants.h"
+
+#include <string>
+#include <vector>
+
+// In-memory copy of the chains netd owns (bw_, natctrl_, fw_, idletimer_ and oem_) and the rules in
+// them, kept up to date from every iptables command netd runs.
+//
+// The set of chains is seeded from the kernel the first time a table is used, so chains left over
+// from a previous netd instance are known too. The rules of a chain are only known once netd has
+// created or flushed it; until then the chain is "incomplete" and commands on it always go to the
+// kernel. For complete chains, commands that can't change anything, such as flushing an empty
+// chain, are answered from the model. Commands the model expects to fail are still run, since the
+// kernel may know better (e.g., after an iptables command from outside netd), and a chain the
+// kernel disagrees about becomes incomplete again.
+class ShadowRuleStore {
+public:
+    enum Verdict {
+        APPLY,         // The command has to be run.
+        SKIP_SUCCESS,  // The command would succeed without changing anything.
+    };
+
+    // |family| must be V4 or V6 in all of these. |argv| is an iptables command line without the
+    // binary name.
+
+    // Decides whether the command needs to reach the kernel.
+    static Verdict check(IptablesTarget family, int argc, const char* argv[]);
+
+    // Records that the command has been applied successfully.
+    static void update(IptablesTarget family, int argc, const char* argv[]);
+
+    // Records that the command has failed.
+    static void recordFailure(IptablesTarget family, int argc, const char* argv[]);
+
+    // Forgets everything known about the chains starting with |prefix| in both families, e.g. after
+    // a script outside netd has changed them. They are read back from the kernel on next use.
+    static void forgetRules(const char* prefix);
+
+    // Returns the known chains of |table| whose names start with |prefix|.
+    static std::vector<std::string> listChains(IptablesTarget family, const char* table,
+                                               const char* prefix);
+
+    // Appends a human-readable description of the model to |output|, one line per chain or rule.
+    static void dump(std::vector<std::string>* output);
+};
+
+#endif  // NETD_SERVER_SHADOW_RULE_STORE_H
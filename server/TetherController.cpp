@@ -36,6 +36,7 @@
 #include <cutils/properties.h>
 
 #include "Fwmark.h"
+#include "InterfaceRegistry.h"
 #include "NetdConstants.h"
 #include "Permission.h"
 #include "TetherController.h"
@@ -48,14 +49,11 @@
 #define IP6_CFG_ALL_PROXY_NDP       "/proc/sys/net/ipv6/conf/all/proxy_ndp"
 #define IP6_CFG_ALL_FORWARDING      "/proc/sys/net/ipv6/conf/all/forwarding"
 #define IP6_IFACE_CFG_ACCEPT_RA     "/proc/sys/net/ipv6/conf/%s/accept_ra"
-#define PROC_PATH_SIZE              255
 #define RTRADVDAEMON_MIN_IFACES     2
 #define MAX_TABLE_LEN               11
 #define MIN_TABLE_NUMBER            0
 #define IP_ADDR                     "ip addr"
 #define BASE_TABLE_NUMBER           1000
-#define IF_INDEX_PATH               "/sys/class/net/%s/ifindex"
-#define SYS_PATH_SIZE               PROC_PATH_SIZE
 
 /* This is the number of arguments for RTRADVDAEMON which accounts for the
  * location of the daemon, the table name option, the name of the table
@@ -336,41 +334,20 @@ int TetherController::stopV6RtrAdv() {
 
 int TetherController::getIfaceIndexForIface(const char *iface)
 {
-   FILE *fp = NULL;
-   char res[MAX_TABLE_LEN];
-   int iface_num = -1;
-   char if_index[SYS_PATH_SIZE];
-   unsigned int retval = 0;
    if (iface == NULL)
    {
      ALOGE("%s() Interface is NULL", __func__);
-     return iface_num;
+     return -1;
    }
 
-   memset(if_index, 0, sizeof(if_index));
-   retval = snprintf(if_index, sizeof(if_index), IF_INDEX_PATH, iface);
-   if (retval >= sizeof(if_index)) {
-     ALOGE("%s() String truncation occurred", __func__);
-     return iface_num;
-   }
-
-   ALOGD("%s() File path is %s", __func__, if_index);
-   fp = fopen(if_index, "r");
-   if (fp == NULL)
-   {
-     ALOGE("%s() Cannot read file : path %s, error %s", __func__, if_index, strerror(errno));
-     return iface_num;
-   }
-
-   memset(res, 0, sizeof(res));
-   while (fgets(res, sizeof(res)-1, fp) != NULL)
+   unsigned iface_num = InterfaceRegistry::nameToIndex(iface);
+   if (!iface_num)
    {
-      ALOGD("%s() %s", __func__, res);
-      iface_num = atoi(res);
-      ALOGD("%s() Interface index for interface %s is %d", __func__, iface, iface_num);
+     ALOGE("%s() Cannot find interface %s", __func__, iface);
+     return -1;
    }
 
-   fclose(fp);
+   ALOGD("%s() Interface index for interface %s is %u", __func__, iface, iface_num);
    return iface_num;
 }
 
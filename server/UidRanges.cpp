@@ -81,3 +81,20 @@ void UidRanges::remove(const UidRanges& other) {
                                    other.mRanges.end(), mRanges.begin());
     mRanges.erase(end, mRanges.end());
 }
+
+void UidRanges::coalesce() {
+    if (mRanges.empty()) {
+        return;
+    }
+    auto last = mRanges.begin();
+    for (auto iter = last + 1; iter != mRanges.end(); ++iter) {
+        // The ranges are sorted, so a range either extends the last one or starts a new one. No
+        // range ends at INVALID_UID, so |last->second + 1| can't overflow.
+        if (iter->first <= last->second + 1) {
+            last->second = std::max(last->second, iter->second);
+        } else {
+            *++last = *iter;
+        }
+    }
+    mRanges.erase(last + 1, mRanges.end());
+}
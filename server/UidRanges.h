@@ -33,6 +33,9 @@ public:
     void add(const UidRanges& other);
     void remove(const UidRanges& other);
 
+    // Merges overlapping and adjacent ranges, so that every UID is covered by exactly one range.
+    void coalesce();
+
 private:
     std::vector<Range> mRanges;
 };
@@ -40,6 +40,10 @@ bool VirtualNetwork::appliesToUser(uid_t uid) const {
     return mUidRanges.hasUid(uid);
 }
 
+const UidRanges& VirtualNetwork::getUidRanges() const {
+    return mUidRanges;
+}
+
 int VirtualNetwork::addUsers(const UidRanges& uidRanges) {
     for (const std::string& interface : mInterfaces) {
         if (int ret = RouteController::addUsersToVirtualNetwork(mNetId, interface.c_str(), mSecure,
@@ -64,6 +68,38 @@ int VirtualNetwork::removeUsers(const UidRanges& uidRanges) {
     return 0;
 }
 
+int VirtualNetwork::setUsers(const UidRanges& uidRanges) {
+    UidRanges newRanges = uidRanges;
+    newRanges.coalesce();
+
+    // mUidRanges need not be coalesced (e.g., if its users were added in several steps), so
+    // compare the UIDs covered rather than the ranges, or an unchanged set would rewrite the rules.
+    UidRanges currentRanges = mUidRanges;
+    currentRanges.coalesce();
+    if (currentRanges.getRanges() == newRanges.getRanges()) {
+        return 0;
+    }
+
+    UidRanges addedRanges = newRanges;
+    addedRanges.remove(mUidRanges);
+    UidRanges removedRanges = mUidRanges;
+    removedRanges.remove(newRanges);
+
+    // Add the new ranges before removing the old ones, so that UIDs that are covered by both (e.g.,
+    // when a range is extended) never fall off the VPN.
+    if (!addedRanges.getRanges().empty()) {
+        if (int ret = addUsers(addedRanges)) {
+            return ret;
+        }
+    }
+    if (!removedRanges.getRanges().empty()) {
+        if (int ret = removeUsers(removedRanges)) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
 Network::Type VirtualNetwork::getType() const {
     return VIRTUAL;
 }
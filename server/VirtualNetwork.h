@@ -35,9 +35,13 @@ public:
     bool getHasDns() const;
     bool isSecure() const;
     bool appliesToUser(uid_t uid) const;
+    const UidRanges& getUidRanges() const;
 
     int addUsers(const UidRanges& uidRanges) WARN_UNUSED_RESULT;
     int removeUsers(const UidRanges& uidRanges) WARN_UNUSED_RESULT;
+    // Makes the VPN apply to exactly |uidRanges|, adding and removing only the ranges that differ
+    // from the current ones.
+    int setUsers(const UidRanges& uidRanges) WARN_UNUSED_RESULT;
 
 private:
     Type getType() const override;
@@ -24,14 +24,12 @@
 
 #define LOG_TAG "OemIptablesHook"
 #include <cutils/log.h>
-#include <logwrap/logwrap.h>
 #include "NetdConstants.h"
+#include "ShadowRuleStore.h"
 
 static int runIptablesCmd(int argc, const char **argv) {
-    int res;
-
-    res = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-    return res;
+    // argv[0] is always IPTABLES_PATH.
+    return execIptablesArgv(V4, false, argc - 1, argv + 1);
 }
 
 static bool oemCleanupHooks() {
@@ -62,6 +60,8 @@ static bool oemCleanupHooks() {
 
 static bool oemInitChains() {
     int ret = system(OEM_SCRIPT_PATH);
+    // The script manipulates the oem_ chains behind our back.
+    ShadowRuleStore::forgetRules("oem_");
     if ((-1 == ret) || (0 != WEXITSTATUS(ret))) {
         ALOGE("%s failed: %s", OEM_SCRIPT_PATH, strerror(errno));
         oemCleanupHooks();